@@ -26,18 +26,34 @@
 
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#ifdef __linux__
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <sys/eventfd.h>
+#endif
 #include "mg-skt.h"
 #include "mg-skt_poll.h"
-#include <queue>
+#include "mg-skt_timer.h"
+#include "mg-skt_pool.h"
+#include "mg-skt_offload.h"
 #include <unordered_map>
-#include <unordered_set>
 #include <iostream>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <new>
 
 using namespace std;
 
@@ -51,9 +67,36 @@ using namespace std;
 #ifndef SO_SNDBUFFORCE
 #define SO_SNDBUFFORCE SO_SNDBUF
 #endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
 #define MG_RX_BUF_SIZE   5000
-#define MG_TXQ_ENTRY_MAX 4
+#define MG_RXB_SIZE       16384		// rx_buf buffer size
+#define MG_TX_HIGH_MARK   (256 << 10)	// default tx_high_mark
+#define MG_TX_LOW_MARK    (64 << 10)	// default tx_low_mark
+#define MG_TXQ_CHUNK_SIZE 16384
+#define MG_TXQ_MAX        (4 << 20)	// default per-socket tx queue cap
+#define MG_TXQ_IOV_MAX    64		// chunks flushed per writev()
+#define MG_SPLICE_LEN    65536
+#define MG_RX_BUDGET      65536		// default bytes read per socket per pass
+#define MG_ACCEPT_BUDGET  64		// default connections accepted per pass
+#define MG_DGRAM_BATCH    32		// default datagrams per recvmmsg()
+#define MG_DGRAM_BATCH_MAX 64		// datagrams per sendmmsg() / recvmmsg()
+#define MG_POOL_CLASS     64		// pool_get() size class granularity
+#define MG_POOL_CLASSES   16		// largest class, above that malloc()
+#define MG_OFFLOAD_SKT_MAX 16		// default offload jobs in flight per socket
+#define MG_LINGER_MS      30000		// skt_linger(): longest wait for the peer
+
+/* mg_skt::rx_paused reasons, reading resumes once none is left */
+#define MG_PAUSE_APP      1		// mg_skt_rx_pause()
+#define MG_PAUSE_JOBS     2		// offload jobs piling up
+#define MG_PAUSE_LINGER   4		// skt_linger(): peer done, still sending
+
+/* mg::fd_open() flags */
+#define MG_FD_CONSOLE     1		// not a socket, read as it comes
+#define MG_FD_ACCEPTED    2		// accept4()ed, already non-blocking
+#define MG_FD_WAKE        4		// the loop's own post() wakeup fd
 
 /*
  * mg_poll_drv_list contains the list of name / poll driver mappings,
@@ -67,51 +110,301 @@ void mg_register(string name, mg_skt_poll_drv *drv)
 	mg_poll_drv_list[name] = drv;
 }
 
-class mg_timer_cb {
-private:
+/* pooled, refcounted rx buffer of an rx_buf socket */
+class mg_rxb {
 public:
-	void *handle;
-	void (*callback)(void*);
+	class mg *_mg;
+	int ref;
+	unsigned char data[MG_RXB_SIZE];
+};
+/*
+ * Unsent tx data is kept in a chain of entries per socket: fixed size
+ * chunks holding a copy of the data, or references to rx buffers queued
+ * by mg_skt_tx_buf(). Both come from pools in the owning mg, so queueing
+ * data is a memcpy into the tail chunk, not a malloc per call.
+ */
+class mg_txq_ent {
+public:
+	class mg_txq_ent *next;
+	uint32_t rd, wr;	// unsent data is base[rd..wr)
+	unsigned char *base;
+	class mg_rxb *buf;	// held by a reference entry, NULL for a chunk
+	class mg_zc_req *zc;	// application buffer of mg_skt_tx_zc()
+	int chunk(void) { return !buf && !zc; }
+};
+class mg_txq_chunk : public mg_txq_ent {
+public:
+	unsigned char data[MG_TXQ_CHUNK_SIZE];
+};
+/*
+ * mg_skt_tx_zc() buffer, from the send until the kernel's completion
+ * notification covering its last MSG_ZEROCOPY send
+ */
+class mg_zc_req {
+public:
+	class mg_zc_req *next;
+	void *ctx;
+	size_t unsent;		// bytes not handed to the kernel yet
+	int zc;			// some were sent with MSG_ZEROCOPY
+	uint32_t seq_last;	// zerocopy sequence number of the last of those
+};
+/* queued outbound datagram, the payload follows the header */
+class mg_dgram_q {
+public:
+	class mg_dgram_q *next;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	size_t len;
+	unsigned char *data(void) { return (unsigned char*)(this + 1); }
 };
+#ifdef __linux__
+typedef struct mmsghdr mg_mmsghdr_t;
+#else
+typedef struct {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+} mg_mmsghdr_t;
+#endif
+/* per-socket recvmmsg() buffers, allocated once when the socket is opened */
+typedef struct {
+	int n;				// datagrams per batch
+	size_t size;			// bytes per datagram
+	mg_mmsghdr_t *msgs;
+	struct iovec *iov;
+	struct sockaddr_storage *addr;
+	mg_dgram_t *dgram;
+	unsigned char *buf;
+} mg_dgram_rx_t;
+/* per-socket state of a splice()d socket pair */
+typedef struct {
+	class mg_skt *peer;	// data read from this socket is written to peer
+	int pipe[2];		// kernel buffer between the two sockets
+	size_t len;		// bytes sitting in the pipe
+	int eof;		// nothing more will be read from this socket
+} mg_splice_t;
 
-/* TODO: Can't seem to get queue container working correctly */
-#define TXQ_ORIGINAL 1
+#if MG_HIST
+static uint64_t mg_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-#if TXQ_ORIGINAL
-typedef struct {
-	unsigned char *buf, *bufptr;
-	int buflen;
-} txq_entry_t;
-#else
-class txq_entry {
-public:
-	unsigned char *buf, *bufptr;
-	int buflen;
-	txq_entry(unsigned char *buf_, int buflen_)
-	{
-		buf = (unsigned char*)malloc(buflen_);
-		assert(buf);
-		bufptr = buf_;
-		buflen = buflen_;
-		memcpy(buf, bufptr, buflen);
+static const char *mg_hist_name[MG_HIST_COUNT] = {
+	"wait", "events", "batch", "rx", "tx", "accept", "timer"
+};
+
+static int mg_hist_bin(uint64_t v)
+{
+	if (v < (1 << MG_HIST_SUB_BITS)) {
+		return v;
 	}
-	~txq_entry(void)
-	{
-		free(buf);
-		buf = NULL;
+	if (v >> MG_HIST_MAX_BITS) {
+		v = (1ULL << MG_HIST_MAX_BITS) - 1;
 	}
-};
-#endif // TXQ_ORIGINAL
-/* global structure */
+	int e = 63 - __builtin_clzll(v) - MG_HIST_SUB_BITS;
+	return ((e + 1) << MG_HIST_SUB_BITS) + (v >> e) - (1 << MG_HIST_SUB_BITS);
+}
+
+static void mg_hist_add(mg_hist_t *h, uint64_t v)
+{
+	h->count++;
+	h->sum += v;
+	if (v > h->max) {
+		h->max = v;
+	}
+	h->bins[mg_hist_bin(v)]++;
+}
+#endif
+
+uint64_t mg_hist_pct(const mg_hist_t *h, double pct)
+{
+	uint64_t want = (uint64_t)(h->count * pct / 100), n = 0;
+	if (!h->count) {
+		return 0;
+	}
+	for (int i = 0; i < MG_HIST_BINS; i++) {
+		n += h->bins[i];
+		if (n > want || n == h->count) {
+			if (i < (1 << MG_HIST_SUB_BITS)) {
+				return i;
+			}
+			int e = (i >> MG_HIST_SUB_BITS) - 1;
+			uint64_t m = (i & ((1 << MG_HIST_SUB_BITS) - 1)) + (1 << MG_HIST_SUB_BITS);
+			uint64_t top = ((m + 1) << e) - 1;
+			return top < h->max ? top : h->max;
+		}
+	}
+	return h->max;
+}
+
+/* listener opened before dispatch(), re-opened on every reactor */
+typedef struct {
+	mg_listen_param_t p;
+	struct sockaddr_storage addr;
+} mg_listen_t;
+
+/* global structure, one per reactor */
 class mg {
 public:
 	void *console_handle;
-	unordered_set<class mg_timer_cb*> timer_cb_list;
-	struct timeval timeout;
+	mg_timer_wheel timers;
 	mg_skt_poll_drv *poll_drv;
-	mg(void) {
-		timeout.tv_sec = 1;
+	mg_skt_poll_drv *poll_drv_reg;	// registered prototype
+	int reactor_id;
+	int reactor_count;
+	atomic<int> stopping;
+	vector<mg_listen_t> listen_list;
+	vector<class mg*> reactor_list;
+	vector<thread> reactor_threads;
+	vector<class mg_skt*> zombie_list;	// closed, freed once the events are done
+	vector<class mg_skt*> rx_ready_list;	// out of budget, more to read
+	vector<class mg_skt*> dirty_list;	// autocork, flushed once the events are done
+	vector<class mg_skt*> run_list;		// the list being run, swapped to keep its capacity
+	atomic<class mg_post*> post_list;	// mg_base::post(), newest first
+	int post_fd[2];				// wakeup eventfd, or self-pipe read / write ends
+	class mg_skt *post_skt;
+	class mg_offload *offload;		// shared by every loop, owned by dispatch()
+	uint32_t offload_skt_max;
+	class mg_skt_job *offload_wait_head;	// waiting for room in the pool queues
+	class mg_skt_job *offload_wait_tail;
+	class mg_skt *skt_list;			// open sockets
+	mg_loop_stats_t stats;			// total: closed sockets only
+#if MG_HIST
+	mg_hist_t hist[MG_HIST_COUNT];
+	uint64_t hist_t;			// start of the current wait, then batch
+	uint64_t slow_ns;
+	/* a callback of hist type h started at t0 just returned */
+	void hist_cb(int h, uint64_t t0)
+	{
+		uint64_t ns = mg_now_ns() - t0;
+		mg_hist_add(&hist[h], ns);
+		if (slow_ns && ns > slow_ns) {
+			hist[h].slow++;
+			MG_LOG_ERR("mg: slow %s callback took %llu us\n", mg_hist_name[h],
+			           (unsigned long long)(ns / 1000));
+		}
+	}
+#endif
+	mg_pool chunk_pool;
+	mg_pool rxb_pool;
+	mg_pool *pool_list[MG_POOL_CLASSES];	// pool_get() size classes, on demand
+	mg_pool_param_t pool_param;
+	int spare_fd;				// given up by mg_accept_shed()
+	mg(void) : chunk_pool(sizeof(class mg_txq_chunk)), rxb_pool(sizeof(class mg_rxb)) {
+		spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+		memset(pool_list, 0, sizeof(pool_list));
+		memset(&pool_param, 0, sizeof(pool_param));
+		poll_drv = NULL;
+		poll_drv_reg = NULL;
+		reactor_id = 0;
+		reactor_count = 1;
+		stopping = 0;
+		skt_list = NULL;
+		post_list = NULL;
+		post_fd[0] = post_fd[1] = -1;
+		post_skt = NULL;
+		offload = NULL;
+		offload_skt_max = MG_OFFLOAD_SKT_MAX;
+		offload_wait_head = offload_wait_tail = NULL;
+		memset(&stats, 0, sizeof(stats));
+#if MG_HIST
+		memset(hist, 0, sizeof(hist));
+		hist_t = mg_now_ns();
+		slow_ns = 0;
+#endif
+	};
+	~mg(void) {
+		post_drop();
+		mg_events_done(this);
+		delete poll_drv;
+		post_close();
+		if (spare_fd >= 0) {
+			close(spare_fd);
+		}
+		for (mg_pool *pool : pool_list) {
+			delete pool;
+		}
 	};
+	class mg_txq_chunk *txq_chunk_get(void)
+	{
+		class mg_txq_chunk *c = (class mg_txq_chunk*)chunk_pool.get();
+		c->next = NULL;
+		c->rd = c->wr = 0;
+		c->base = c->data;
+		c->buf = NULL;
+		c->zc = NULL;
+		return c;
+	}
+	void txq_ent_put(class mg_txq_ent *e)
+	{
+		if (e->chunk()) {
+			chunk_pool.put(e);
+			return;
+		}
+		if (e->buf) {
+			rxb_put(e->buf);
+		}
+		pool_put(e, sizeof(*e));
+	}
+	class mg_rxb *rxb_get(void)
+	{
+		class mg_rxb *b = (class mg_rxb*)rxb_pool.get();
+		b->_mg = this;
+		b->ref = 1;
+		return b;
+	}
+	static void rxb_put(class mg_rxb *b)
+	{
+		if (!--b->ref) {
+			b->_mg->rxb_pool.put(b);
+		}
+	}
+	/* size class pool for size bytes, NULL if malloc()ed */
+	mg_pool *pool(size_t size)
+	{
+		size_t i = (size + MG_POOL_CLASS - 1) / MG_POOL_CLASS;
+		if (i > MG_POOL_CLASSES) {
+			return NULL;
+		}
+		i = i ? i - 1 : 0;
+		if (!pool_list[i]) {
+			pool_list[i] = new mg_pool((i + 1) * MG_POOL_CLASS);
+		}
+		return pool_list[i];
+	}
+	void *pool_get(size_t size)
+	{
+		mg_pool *p = pool(size);
+		void *o = p ? p->get() : malloc(size);
+		assert(o);
+		return o;
+	}
+	void pool_put(void *o, size_t size)
+	{
+		mg_pool *p = pool(size);
+		if (p) {
+			p->put(o);
+		}
+		else {
+			free(o);
+		}
+	}
+	void pool_reserve(const mg_pool_param_t *param);
+	class mg_skt *skt_new(void);
+	void skt_free(class mg_skt *mg_skt);
+	int drv_init(mg_skt_poll_drv *reg)
+	{
+		poll_drv_reg = reg;
+		poll_drv = reg->create();
+		assert(poll_drv);
+		int r = poll_drv->init(this);
+		if (!r) {
+			post_open();
+		}
+		return r;
+	}
 	int fd_add(int fd, class mg_skt *mg_skt)
 	{
 		return poll_drv->fd_add(fd, mg_skt);
@@ -120,464 +413,3139 @@ public:
 	{
 		return poll_drv->fd_del(mg_skt);
 	}
-	void *fd_open(int fd, mg_skt_param_t *p);
+	void *fd_open(int fd, mg_skt_param_t *p, int flags = 0);
+	void post_open(void);
+	void post_close(void);
+	void post(void (*callback)(void*), void *handle);
+	void post_push(class mg_post *e);
+	void post_run(void);
+	void post_drop(void);
+	void wake(void);
+	void offload_retry(void);
+	void offload_drain(void);
+};
+
+/* mg_base::post() record, allocated by the posting thread or built in */
+class mg_post {
+public:
+	void (*callback)(void*);
+	void *handle;
+	class mg_post *next;
+	int alloc;		// new()ed by post(), deleted once run
+};
+
+/* mg_skt_offload() job, from the socket's loop pool */
+class mg_skt_job : public mg_offload_job {
+public:
+	class mg_post post;		// completion, back to the loop
+	class mg_skt *skt;
+	void (*done)(void*, void*);
+	class mg_skt_job *next;		// the socket's jobs, in submission order
+	class mg_skt_job *wait_next;	// the loop's jobs waiting for the pool
+	int finished;
 };
 
+/* reactor owned by the calling thread, NULL outside of dispatch() */
+static thread_local class mg *mg_reactor_cur;
+
+static class mg *mg_cur(void *priv)
+{
+	return mg_reactor_cur ? mg_reactor_cur : (class mg*)priv;
+}
+
+static int mg_txq_flush(class mg_skt *mg_skt);
+
 class mg_skt {
 private:
 	class mg *_mg;
 public:
-	mg_skt(class mg *mg) { _mg = mg; }
+#if MG_HIST
+	void hist_cb(int h, uint64_t t0)
+	{
+		_mg->hist_cb(h, t0);
+	}
+#endif
+	mg_skt(class mg *mg)
+	{
+		_mg = mg;
+		memset(&stats, 0, sizeof(stats));
+		skt_next = mg->skt_list;
+		if (skt_next) {
+			skt_next->skt_prev = this;
+		}
+		mg->skt_list = this;
+		mg->stats.sockets++;
+		mg->stats.opened++;
+	}
+	~mg_skt();
 	void fd_tx_watch(int enable)
 	{
+		if (closed || unwatched || tx_watch == enable) {
+			return;
+		}
+		tx_watch = enable;
+		stats.tx_watch += enable;
 		_mg->poll_drv->fd_tx_watch(this, enable);
 	}
-	void *fd_open(int fd, mg_skt_param_t *p)
+	/* a reset peer is an error to report, not a SIGPIPE */
+	ssize_t write_msg(const struct iovec *iov, int iovcnt)
+	{
+		struct msghdr msg = {};
+		if (!is_skt) {
+			return writev(fd, iov, iovcnt);
+		}
+		msg.msg_iov = (struct iovec*)iov;
+		msg.msg_iovlen = iovcnt;
+		ssize_t l = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (l < 0 && errno == ENOTSOCK) {
+			/* e.g. a pipe from fd_open(), plain writes from now on */
+			is_skt = 0;
+			return writev(fd, iov, iovcnt);
+		}
+		return l;
+	}
+#ifdef MSG_ZEROCOPY
+	ssize_t write_zc(const struct iovec *iov, int iovcnt, int64_t *zc_seq)
 	{
-		return _mg->fd_open(fd, p);
+		struct msghdr msg = {};
+		msg.msg_iov = (struct iovec*)iov;
+		msg.msg_iovlen = iovcnt;
+		ssize_t l = sendmsg(fd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+		if (l < 0 && errno == ENOBUFS) {
+			/* out of pinned page quota, copy this one */
+			*zc_seq = -1;
+			return sendmsg(fd, &msg, MSG_NOSIGNAL);
+		}
+		*zc_seq = -1;
+		if (l >= 0) {
+			/* every successful MSG_ZEROCOPY send takes a number */
+			*zc_seq = zc_seq_next++;
+			stats.tx_zc++;
+		}
+		return l;
 	}
-	int write_buf(unsigned char **buf, int *buflen)
+#else
+	ssize_t write_zc(const struct iovec *iov, int iovcnt, int64_t *zc_seq)
 	{
-		fd_tx_watch(0);
-		while (*buflen) {
-			int l;
-			if ((l = write(fd, *buf, *buflen)) < 0) {
-				if (errno == EAGAIN) {
-					/* write buffer full, enqueue the rest */
-					fd_tx_watch(1);
-					MG_LOG_DBG("mg_skt_write[%d]: tx_watch = 1\n", fd);
-					break;
-				}
-				MG_LOG_ERR("mg_skt_write[%d]: write failed <%s>\n", fd, strerror(errno));
-				assert(0);
-			}
-			else {
-				MG_LOG_DBG("mg_skt_write[%d]: wrote %d of %d bytes\n", fd, l, *buflen);
-				*buf += l;
-				*buflen -= l;
+		*zc_seq = -1;
+		return write_msg(iov, iovcnt);
+	}
+#endif
+	void fd_rx_watch(int enable)
+	{
+		if (closed || unwatched || rx_watch == enable) {
+			return;
+		}
+		rx_watch = enable;
+		_mg->poll_drv->fd_rx_watch(this, enable);
+	}
+	void *fd_open(int fd, mg_skt_param_t *p, int flags = 0)
+	{
+		return _mg->fd_open(fd, p, flags);
+	}
+	void rx_pause(int why)
+	{
+		rx_paused |= why;
+		fd_rx_watch(0);
+	}
+	void rx_unpause(int why)
+	{
+		rx_paused &= ~why;
+		if (rx_paused || closed || rx_watch) {
+			return;
+		}
+		fd_rx_watch(1);
+		/* data may have arrived meanwhile, with no new edge to report it */
+		rx_resume();
+	}
+	/*
+	 * rx changes hands (splice, linger, handoff): a completion read still
+	 * in the kernel is finished into rx_held first. With rearm the driver
+	 * then watches for whatever reads the socket now. Returns 1 if there
+	 * was one.
+	 */
+	int rx_sync(int rearm)
+	{
+		if (!rx_inflight) {
+			return 0;
+		}
+		_mg->poll_drv->fd_rx_sync(this);
+		if (rearm) {
+			rx_rearm();
+		}
+		return 1;
+	}
+	void rx_rearm(void)
+	{
+		if (rx_watch && !closed && !unwatched) {
+			_mg->poll_drv->fd_rx_watch(this, 1);
+		}
+	}
+	void rx_hold(class mg_rxb *b, uint32_t len)
+	{
+		assert(!rx_held);
+		rx_held = b;
+		rx_held_off = 0;
+		rx_held_len = len;
+	}
+	void rx_held_drop(void)
+	{
+		if (rx_held) {
+			mg::rxb_put(rx_held);
+			rx_held = NULL;
+			rx_held_len = 0;
+		}
+	}
+	/*
+	 * One writev(), returns the number of bytes written, 0 if the socket
+	 * is full. The caller queues whatever is left and sets tx_watch.
+	 * With zc_seq, a MSG_ZEROCOPY send whose sequence number is returned
+	 * there, -1 if it had to be copied after all.
+	 * Once a write failed everything counts as written, nothing is queued
+	 * any more, and the close is reported on the next pass.
+	 */
+	size_t write_iov(const struct iovec *iov, int iovcnt, int64_t *zc_seq = NULL)
+	{
+		ssize_t l;
+		if (zc_seq) {
+			*zc_seq = -1;
+		}
+		if (tx_failed) {
+			return iov_len(iov, iovcnt);
+		}
+		do {
+			l = zc_seq ? write_zc(iov, iovcnt, zc_seq) : write_msg(iov, iovcnt);
+		} while (l < 0 && errno == EINTR);
+		if (l < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				stats.tx_eagain++;
+				MG_LOG_DBG("mg_skt_write[%d]: write buffer full\n", fd);
+				return 0;
 			}
+			MG_LOG_ERR("mg_skt_write[%d]: write failed <%s>\n", fd, strerror(errno));
+			tx_fail(errno);
+			return iov_len(iov, iovcnt);
+		}
+		MG_LOG_DBG("mg_skt_write[%d]: wrote %zd bytes\n", fd, l);
+		stats.tx_writes++;
+		stats.tx_bytes += l;
+		return l;
+	}
+	static size_t iov_len(const struct iovec *iov, int iovcnt)
+	{
+		size_t len = 0;
+		for (int i = 0; i < iovcnt; i++) {
+			len += iov[i].iov_len;
+		}
+		return len;
+	}
+	/* the connection is broken: mg_rx() reports the close on the next pass */
+	void tx_fail(int e)
+	{
+		if (!err) {
+			err = e;
 		}
-		/* return the number of unwritten bytes */
-		return *buflen;
+		tx_failed = 1;
+		rx_resume();
 	}
 	int fd_add(int fd)
 	{
 		return _mg->poll_drv->fd_add(fd, this);
 	}
+	/*
+	 * The driver can't watch fd (select: past FD_SETSIZE): the socket is
+	 * reported closed on the next pass, as after a failed write.
+	 */
+	void fd_add_failed(void)
+	{
+		unwatched = 1;
+		tx_fail(EMFILE);
+	}
+	/*
+	 * Used up its rx budget with data still to be read: with edge
+	 * triggered polling no new event may come, so mg_events_done()
+	 * calls rx again on the next pass.
+	 */
+	void rx_requeue(void)
+	{
+		stats.rx_requeues++;
+		rx_resume();
+	}
+	/* read on the next pass */
+	void rx_resume(void)
+	{
+		if (rx_ready) {
+			return;
+		}
+		rx_ready = 1;
+		_mg->rx_ready_list.push_back(this);
+	}
+	/* data was queued: autocork leaves it for the end of the pass */
+	void txq_kick(void)
+	{
+		if (!cork) {
+			fd_tx_watch(1);
+			return;
+		}
+		if (!dirty) {
+			dirty = 1;
+			_mg->dirty_list.push_back(this);
+		}
+	}
 	int fd_del()
 	{
+		if (unwatched) {
+			return 0;
+		}
 		return _mg->poll_drv->fd_del(this);
 	}
+	void splice_close();
+	/*
+	 * The driver may still hold events for this socket in the current
+	 * batch, so it is only marked closed here and freed by mg_events_done()
+	 */
 	void skt_close()
 	{
-#if TXQ_ORIGINAL
-		assert(!txq_entries());
-#else
-		assert(txq.empty());
-#endif // TXQ_ORIGINAL
+		if (dirty && !tx_watch) {
+			/* the application counts corked data as sent */
+			mg_txq_flush(this);
+		}
+		if (txq_len) {
+			MG_LOG_DBG("mg_skt_close[%d]: dropping %zu unsent bytes\n", fd, txq_len);
+			stats.tx_dropped += txq_len;
+			txq_release();
+		}
+		rx_held_drop();
+		if (linger_timer) {
+			_mg->timers.cancel(linger_timer);
+			delete linger_timer;
+			linger_timer = NULL;
+		}
+		zc_release();
 		fd_del();
+		splice_close();
 		close(fd);
-		delete this;
+		closed = 1;
+		if (job_len) {
+			/* freed once its offload jobs are done */
+			job_zombie = 1;
+		}
+		else {
+			_mg->zombie_list.push_back(this);
+		}
+		stats_unlink();
+	}
+	/* off the loop's socket list, its counters go to the loop totals */
+	void stats_unlink(void)
+	{
+		if (skt_prev) {
+			skt_prev->skt_next = skt_next;
+		}
+		else {
+			_mg->skt_list = skt_next;
+		}
+		if (skt_next) {
+			skt_next->skt_prev = skt_prev;
+		}
+		_mg->stats.sockets--;
+		mg_stats_add(&_mg->stats.total, &stats);
+	}
+	static void mg_stats_add(mg_skt_stats_t *sum, const mg_skt_stats_t *s)
+	{
+		sum->rx_events += s->rx_events;
+		sum->rx_reads += s->rx_reads;
+		sum->rx_bytes += s->rx_bytes;
+		sum->rx_requeues += s->rx_requeues;
+		sum->rx_pauses += s->rx_pauses;
+		sum->tx_events += s->tx_events;
+		sum->tx_writes += s->tx_writes;
+		sum->tx_bytes += s->tx_bytes;
+		sum->tx_eagain += s->tx_eagain;
+		sum->tx_queued += s->tx_queued;
+		sum->tx_full += s->tx_full;
+		sum->tx_watch += s->tx_watch;
+		sum->tx_zc += s->tx_zc;
+		sum->tx_zc_copied += s->tx_zc_copied;
+		sum->txq_len += s->txq_len;
+		if (s->txq_hwm > sum->txq_hwm) {
+			sum->txq_hwm = s->txq_hwm;
+		}
+		sum->accepts += s->accepts;
+		sum->accept_drops += s->accept_drops;
+		sum->tx_dropped += s->tx_dropped;
+	}
+	/* queue and budget limits of a new socket, 0 = default */
+	void limits_set(const mg_skt_param_t *p)
+	{
+		if (p->tx_queue_max) {
+			txq_max = p->tx_queue_max;
+		}
+		if (p->rx_budget) {
+			rx_budget = p->rx_budget;
+		}
+		if (p->tx_high_mark) {
+			tx_high_mark = p->tx_high_mark;
+		}
+		if (p->tx_low_mark) {
+			tx_low_mark = p->tx_low_mark;
+		}
+		cork = p->autocork;
+	}
+	/* txq_len grew */
+	void txq_grown(void)
+	{
+		tx_pending = 1;
+		stats.txq_len = txq_len;
+		if (txq_len > stats.txq_hwm) {
+			stats.txq_hwm = txq_len;
+		}
+		mg_skt_param_t *p = &params.skt;
+		if (!tx_high && p->tx_high && txq_len > tx_high_mark) {
+			tx_high = 1;
+			p->tx_high(p->handle);
+		}
+	}
+	/* txq_len shrank, from mg_dequeue() */
+	void txq_drained(void)
+	{
+		mg_skt_param_t *p = &params.skt;
+		if (tx_high && txq_len <= tx_low_mark && !closed) {
+			tx_high = 0;
+			if (p->tx_low) {
+				p->tx_low(p->handle);
+			}
+		}
+		if (tx_pending && !txq_len && !closed && !tx_failed) {
+			/* dropped by a failed write is not drained, close follows */
+			tx_pending = 0;
+			if (p->tx_drained) {
+				p->tx_drained(p->handle);
+			}
+		}
+		if (linger && !txq_len && !closed) {
+			linger_drained();
+		}
+	}
+	/* skt_linger(): all written, no more to come from this side */
+	void linger_drained(void)
+	{
+		if (linger_wr) {
+			return;
+		}
+		linger_wr = 1;
+		shutdown(fd, SHUT_WR);
+		if (linger_eof) {
+			/* the peer is done too, mg_linger_rx() closes it */
+			rx_unpause(~0);
+		}
 	}
+	int closed = 0;
+	mg_skt_stats_t stats;
+	class mg_skt *skt_next = NULL;	// mg skt_list
+	class mg_skt *skt_prev = NULL;
+	mg_splice_t *splice = NULL;
+	mg_dgram_rx_t *dgram_rx = NULL;
+	class mg_dgram_q *dgq_head = NULL;	// datagrams waiting for sendmmsg()
+	class mg_dgram_q *dgq_tail = NULL;
 	union {
 		mg_skt_param_t		skt;
 		mg_listen_param_t	listen;
 	} params;
 	int fd;
 	void (*rx)(class mg_skt*);
-#if TXQ_ORIGINAL
-	int txq_s = 0;
-	int txq_e = 0;
-	txq_entry_t txq[MG_TXQ_ENTRY_MAX] = {};
-	int txq_entries()
+	int tx_watch = 0;
+	int rx_watch = 1;
+	int tx_high = 0;	// above tx_high_mark, tx_low not called yet
+	uint32_t tx_high_mark = MG_TX_HIGH_MARK;
+	uint32_t tx_low_mark = MG_TX_LOW_MARK;
+	int rx_ready = 0;	// on the rx_ready_list
+	int cork = 0;		// autocork: writes only queue
+	int dirty = 0;		// on the dirty_list
+	int connecting = 0;	// connect() in progress, tx_watch is on
+	int err = 0;		// errno of the failure that closed it
+	int tx_failed = 0;	// a write failed, the close is due
+	int unwatched = 0;	// not known to the driver, see fd_add_failed()
+	int linger = 0;		// skt_linger(): closed once the queue is written out
+	int linger_wr = 0;	// shut down for writing
+	int linger_eof = 0;	// the peer shut down for writing
+	class mg_timer_cb *linger_timer = NULL;
+	int is_skt = 1;		// sendmsg() works on fd
+	int rx_drained = 0;	// rx_ready sockets: mg_skt_recv() hit EAGAIN or EOF
+	class mg_rxb *rx_held = NULL;	// read but not delivered yet, goes first
+	uint32_t rx_held_off = 0;
+	uint32_t rx_held_len = 0;
+	int rx_comp = 0;	// the driver has read for it, see mg_rx_comp_buf()
+	int rx_inflight = 0;	// one of those reads is in the kernel
+	int tx_pending = 0;	// tx_drained due once the queue is empty
+	uint32_t rx_budget = MG_RX_BUDGET;
+	class mg_txq_ent *txq_head = NULL;
+	class mg_txq_ent *txq_tail = NULL;
+	size_t txq_len = 0;	// bytes queued, stream or datagrams
+	size_t txq_max = MG_TXQ_MAX;
+	uint32_t zc_min = 0;	// mg_skt_tx_zc() threshold, 0 = copy
+	uint32_t zc_seq_next = 0;	// number of the next MSG_ZEROCOPY send
+	uint32_t zc_done = 0;	// sends below it are complete
+	class mg_zc_req *zc_head = NULL;	// mg_skt_tx_zc() buffers in flight
+	class mg_zc_req *zc_tail = NULL;
+	class mg_skt_job *job_head = NULL;	// mg_skt_offload() jobs not done yet
+	class mg_skt_job *job_tail = NULL;
+	uint32_t job_len = 0;
+	int rx_paused = 0;	// MG_PAUSE_* reasons reading is off for
+	int job_zombie = 0;	// closed, to be freed with its last job
+	/* the loop the socket belongs to */
+	class mg *loop(void)
 	{
-		return (txq_s - txq_e + MG_TXQ_ENTRY_MAX) % MG_TXQ_ENTRY_MAX;
+		return _mg;
 	}
-#else
-	queue<class txq_entry*> txq;
-#endif // TXQ_ORIGINAL
-};
-
-void mg_rx(class mg_skt *mg_skt)
-{
-	assert(mg_skt->rx);
-	mg_skt->rx(mg_skt);
-}
-
-void mg_dequeue(class mg_skt *mg_skt)
-{
-#if TXQ_ORIGINAL
-	MG_LOG_DBG("mg_dequeue[%d]: %d entries\n", mg_skt->fd, mg_skt->txq_entries());
-//	assert(mg_skt->txq_s != mg_skt->txq_e);
-	while (mg_skt->txq_s != mg_skt->txq_e) {
-		/* something to dequeue */
-		txq_entry_t *txq = &mg_skt->txq[mg_skt->txq_s];
-		unsigned char *bufptr = txq->bufptr;
-		int buflen = txq->buflen;
-		mg_skt->write_buf(&bufptr, &buflen);
-		if (buflen == 0) {
-			/* all data sent successfully, dequeue item */
-			free(txq->buf);
-			txq->buf = NULL;
-			txq->bufptr = NULL;
-			if (++mg_skt->txq_s == MG_TXQ_ENTRY_MAX) {
-				/* wrap */
-				mg_skt->txq_s = 0;
-			}
+	class mg_txq_chunk *txq_chunk_get(void)
+	{
+		return _mg->txq_chunk_get();
+	}
+	void *pool_get(size_t size)
+	{
+		return _mg->pool_get(size);
+	}
+	int *spare_fd(void)
+	{
+		return &_mg->spare_fd;
+	}
+	class mg_rxb *rxb_get(void)
+	{
+		return _mg->rxb_get();
+	}
+	/* queue len bytes at data in b by reference */
+	void txq_ref(class mg_rxb *b, unsigned char *data, size_t len)
+	{
+		class mg_txq_ent *e = (class mg_txq_ent*)pool_get(sizeof(*e));
+		b->ref++;
+		e->next = NULL;
+		e->base = data;
+		e->rd = 0;
+		e->wr = len;
+		e->buf = b;
+		e->zc = NULL;
+		if (txq_tail) {
+			txq_tail->next = e;
 		}
 		else {
-			/* not all the data was sent, save the rest */
-			txq->bufptr = bufptr;
-			txq->buflen = buflen;
-			break;
+			txq_head = e;
 		}
+		txq_tail = e;
+		txq_len += len;
 	}
-	if (mg_skt->txq_s == mg_skt->txq_e) {
-		/* all items have been dequeued */
-		mg_skt->fd_tx_watch(0);
-	}
-#else
-	MG_LOG_DBG("mg_dequeue[%d]: %lu entries\n", mg_skt->fd, mg_skt->txq.size());
-	while (!mg_skt->txq.empty()) {
-		/* something to dequeue */
-		class txq_entry *entry = mg_skt->txq.front();
-		std::cout << "mg_dequeue[" << mg_skt->fd << "]: entry = " << entry << " size = " << entry->buflen << '\n';
-		unsigned char *bufptr = entry->bufptr;
-		int buflen = entry->buflen;
-		mg_skt->write(&bufptr, &buflen);
-		if (buflen == 0) {
-			/* all data sent successfully, dequeue item */
-			mg_skt->txq.pop();
-			delete entry;
+	/* queue the unsent part of a zero-copy buffer, not copied either */
+	void txq_zc(class mg_zc_req *r, unsigned char *data, size_t len)
+	{
+		class mg_txq_ent *e = (class mg_txq_ent*)pool_get(sizeof(*e));
+		e->next = NULL;
+		e->base = data;
+		e->rd = 0;
+		e->wr = len;
+		e->buf = NULL;
+		e->zc = r;
+		if (txq_tail) {
+			txq_tail->next = e;
 		}
 		else {
-			/* not all the data was sent, save the rest */
-			entry->bufptr = bufptr;
-			entry->buflen = buflen;
-			break;
+			txq_head = e;
 		}
+		txq_tail = e;
+		txq_len += len;
 	}
-#endif // TXQ_ORIGINAL
-}
-
-void mg_timeout(class mg *mg)
-{
-	MG_LOG_DBG("mg_timeout\n");
-	for (class mg_timer_cb *t : mg->timer_cb_list) {
-		t->callback(t->handle);
+	/* the kernel is done with the oldest buffers: hand them back */
+	void zc_complete(void)
+	{
+		mg_skt_param_t *p = &params.skt;
+		while (zc_head && !zc_head->unsent &&
+		        (!zc_head->zc || (int32_t)(zc_head->seq_last - zc_done) < 0)) {
+			class mg_zc_req *r = zc_head;
+			zc_head = r->next;
+			if (!zc_head) {
+				zc_tail = NULL;
+			}
+			void *ctx = r->ctx;
+			_mg->pool_put(r, sizeof(*r));
+			if (p->tx_done) {
+				p->tx_done(p->handle, ctx);
+			}
+		}
 	}
-}
-
-static int mg_enqueue(class mg_skt *mg_skt, unsigned char *bufptr, int buflen)
-{
-#if TXQ_ORIGINAL
-	MG_LOG_DBG("mg_enqueue[%d]: buflen = %d\n", mg_skt->fd, buflen);
-	int qe = mg_skt->txq_e;
-	int qe_next = qe + 1;
-	txq_entry_t *txq = &mg_skt->txq[qe];
-	if (qe_next == MG_TXQ_ENTRY_MAX) {
-		qe_next = 0;
+	/* closing: the buffers are the application's again */
+	void zc_release(void)
+	{
+		while (zc_head) {
+			zc_head->unsent = 0;
+			zc_head->zc = 0;
+			zc_complete();
+		}
 	}
-	if (qe_next == mg_skt->txq_s) {
-		MG_LOG_DBG("mg_enqueue[%d]: queue is full\n", mg_skt->fd);
-		return -1;	// full
+	/* unlink and recycle the head entry */
+	void txq_pop(void)
+	{
+		class mg_txq_ent *e = txq_head;
+		txq_head = e->next;
+		if (!txq_head) {
+			txq_tail = NULL;
+		}
+		_mg->txq_ent_put(e);
 	}
-	if ((txq->buf = (unsigned char*)malloc(buflen))) {
-		memcpy(txq->buf, bufptr, buflen);
-		txq->bufptr = txq->buf;
-		txq->buflen = buflen;
-		mg_skt->txq_e = qe_next;
-		return 0;
+	/*
+	 * drop len bytes, written by the caller, from the head of the queue;
+	 * zc_seq is the zerocopy number of the send, -1 if none
+	 */
+	void txq_consume(size_t len, int64_t zc_seq = -1)
+	{
+		txq_len -= len;
+		stats.txq_len = txq_len;
+		while (len) {
+			class mg_txq_ent *c = txq_head;
+			size_t l = c->wr - c->rd;
+			if (len < l) {
+				l = len;
+			}
+			if (c->zc) {
+				c->zc->unsent -= l;
+				if (zc_seq >= 0) {
+					c->zc->zc = 1;
+					c->zc->seq_last = zc_seq;
+				}
+			}
+			if (l < c->wr - c->rd) {
+				c->rd += l;
+				break;
+			}
+			len -= l;
+			txq_pop();
+		}
 	}
-	assert(0);
-	return -1;
-#else
-	MG_LOG_DBG("mg_enqueue[%d]: queue size = %lu\n", mg_skt->fd, mg_skt->txq.size());
-	if (mg_skt->txq.size() >= MG_TXQ_ENTRY_MAX) {
-		MG_LOG_DBG("mg_enqueue[%d]: queue is full\n", mg_skt->fd);
-		assert(0);
-		return -1;	// full
+	/* unlink and free the head datagram */
+	void dgq_pop(void)
+	{
+		class mg_dgram_q *d = dgq_head;
+		dgq_head = d->next;
+		if (!dgq_head) {
+			dgq_tail = NULL;
+		}
+		txq_len -= d->len;
+		stats.txq_len = txq_len;
+		_mg->pool_put(d, sizeof(*d) + d->len);
 	}
-	class txq_entry *entry = new txq_entry(bufptr, buflen);
-	mg_skt->txq.push(entry);
-	return 0;
-#endif // TXQ_ORIGINAL
-}
-
-int mg_skt_tx(void *handle, unsigned char *bufptr, int buflen)
-{
-	class mg_skt *mg_skt = (class mg_skt*)handle;
-	MG_LOG_DBG("mg_skt_tx[%d]: sending %d bytes\n", mg_skt->fd, buflen);
-#if TXQ_ORIGINAL
-	if (!mg_skt->txq_entries())
-#else
-	if (mg_skt->txq.empty())
-#endif // TXQ_ORIGINAL
+	void txq_release(void)
 	{
-		/* currently nothing enqueued, send it straight out */
-		mg_skt->write_buf(&bufptr, &buflen);
+		while (txq_head) {
+			txq_pop();
+		}
+		while (dgq_head) {
+			dgq_pop();
+		}
+		txq_len = 0;
+		stats.txq_len = 0;
 	}
-	if (buflen) {
-		/* queue remaining data */
-		MG_LOG_DBG("mg_skt_tx[%d]: enqueued %d bytes\n", mg_skt->fd, buflen);
-		return mg_enqueue(mg_skt, bufptr, buflen);
+};
+
+mg_skt::~mg_skt()
+{
+	if (dgram_rx) {
+		delete[] dgram_rx->msgs;
+		delete[] dgram_rx->iov;
+		delete[] dgram_rx->addr;
+		delete[] dgram_rx->dgram;
+		delete[] dgram_rx->buf;
+		delete dgram_rx;
 	}
-	return 0;
 }
 
-static void mg_skt_rx(class mg_skt *mg_skt)
+/* sockets are constructed in and destroyed back to the loop's pool */
+class mg_skt *mg::skt_new(void)
 {
-	struct sockaddr_storage addr;
-	socklen_t slen = sizeof(addr);
-	unsigned char rx_buf[MG_RX_BUF_SIZE];
-	int l = recvfrom(mg_skt->fd, rx_buf, sizeof(rx_buf),
-	                 0, (struct sockaddr*)&addr, &slen);
-	mg_skt_param_t *p = &mg_skt->params.skt;
-	MG_LOG_DBG("mg_skt_rx[%d]: receiving %d bytes\n", mg_skt->fd, l);
-	switch (l) {
-	case -1:
-		MG_LOG_ERR("mg_skt_rx: read failed <%s>\n", strerror(errno));
-	/* drop through */
-	case 0:
-		/*  connection is closed */
-		if (p->close) {
-			p->close(p->handle);
+	return new (pool_get(sizeof(class mg_skt))) mg_skt(this);
+}
+
+void mg::skt_free(class mg_skt *mg_skt)
+{
+	mg_skt->~mg_skt();
+	pool_put(mg_skt, sizeof(class mg_skt));
+}
+
+void mg::pool_reserve(const mg_pool_param_t *param)
+{
+	pool_param = *param;
+	pool(sizeof(class mg_skt))->reserve(param->skts);
+	chunk_pool.reserve(param->tx_chunks);
+	if (param->app_size && param->app_count) {
+		mg_pool *p = pool(param->app_size);
+		if (p) {
+			p->reserve(param->app_count);
 		}
-		mg_skt->skt_close();
-		mg_skt = NULL;
-		break;
-	default:
-		p->rx(p->handle, (struct sockaddr*)&addr, rx_buf, l);
-		break;
 	}
 }
 
-static void mg_read(class mg_skt *mg_skt)
+static void mg_accept(class mg_skt *mg_skt);
+
+static void mg_zc_reap(class mg_skt *mg_skt);
+
+void mg_rx(class mg_skt *mg_skt)
 {
-	unsigned char rx_buf[MG_RX_BUF_SIZE];
-	int l = read(mg_skt->fd, rx_buf, sizeof(rx_buf) - 1);
-	if (l < 0) {
-		MG_LOG_ERR("mg_skt_rx[%d]: read failed <%s>\n", mg_skt->fd, strerror(errno));
+	if (mg_skt->zc_head && !mg_skt->closed) {
+		/* completions are reported as errors, whether paused or not */
+		mg_zc_reap(mg_skt);
 	}
-	else {
+	if (mg_skt->tx_failed && !mg_skt->closed) {
+		/* reported whether paused or not, as a failed read would be */
 		mg_skt_param_t *p = &mg_skt->params.skt;
-		if (l > 0) {
-			rx_buf[l] = 0;
-			p->rx(p->handle, NULL, rx_buf, l);
+		if (p->close) {
+			p->close(p->handle);
 		}
+		if (!mg_skt->closed) {
+			mg_skt->skt_close();
+		}
+		return;
+	}
+	if (mg_skt->closed || !mg_skt->rx_watch) {
+		/* e.g. paused by an earlier callback of this batch */
+		return;
 	}
+	assert(mg_skt->rx);
+	mg_skt->stats.rx_events++;
+#if MG_HIST
+	uint64_t t0 = mg_now_ns();
+	mg_skt->rx(mg_skt);
+	mg_skt->hist_cb(mg_skt->rx == mg_accept ? MG_HIST_ACCEPT : MG_HIST_RX, t0);
+#else
+	mg_skt->rx(mg_skt);
+#endif
 }
 
-void *mg_base::skt_open(mg_skt_param_t *p)
+void mg_wait_done(class mg *mg, int events)
 {
-	class mg_skt *skt = new mg_skt((class mg*)priv);
-	int r, on = 1;
-	assert(skt);
-	skt->rx = mg_skt_rx;
-	if ((skt->fd = socket(p->family, p->type | SOCK_NONBLOCK, p->protocol)) < 0) {
-		MG_LOG_ERR("mg_skt_open: socket failed <%s>\n", strerror(errno));
-		assert(0);
-	};
-	MG_LOG_DBG("mg_skt_open: opening socket %d\n", skt->fd);
-	r = setsockopt(skt->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-	assert(r == 0);
-	if (p->tx_buf_size) {
-		r = setsockopt(skt->fd, SOL_SOCKET, SO_SNDBUFFORCE,
-		               &p->tx_buf_size, sizeof(p->tx_buf_size));
-		assert(r == 0);
+#if MG_HIST
+	uint64_t now = mg_now_ns();
+	mg_hist_add(&mg->hist[MG_HIST_WAIT], now - mg->hist_t);
+	mg_hist_add(&mg->hist[MG_HIST_EVENTS], events);
+	mg->hist_t = now;
+#endif
+}
+
+static void mg_cork_flush(class mg_skt *mg_skt);
+
+void mg_events_done(class mg *mg)
+{
+	mg->stats.waits++;
+	if (mg->post_list.load(memory_order_relaxed)) {
+		mg->post_run();
 	}
-	if (p->rx_buf_size) {
-		r = setsockopt(skt->fd, SOL_SOCKET, SO_RCVBUFFORCE,
-		               &p->rx_buf_size, sizeof(p->rx_buf_size));
-		assert(r == 0);
+	if (mg->offload_wait_head) {
+		mg->offload_retry();
 	}
-	if (p->sock_addr && bind(skt->fd, p->sock_addr, p->slen) < 0) {
-		MG_LOG_ERR("mg_skt_open: bind failed <%s>\n", strerror(errno));
-		assert(0);
+	if (!mg->rx_ready_list.empty()) {
+		/* one more budget each, those still not drained go round again */
+		mg->run_list.swap(mg->rx_ready_list);
+		for (class mg_skt *mg_skt : mg->run_list) {
+			mg_skt->rx_ready = 0;
+			mg_rx(mg_skt);
+		}
+		mg->run_list.clear();
 	}
-	skt->params.skt = *p;
-	skt->fd_add(skt->fd);
-	if (p->connect_addr &&
-	        connect(skt->fd, p->connect_addr, p->connect_addr_len) < 0) {
-		switch (errno) {
-		case EAGAIN:
-		case EINPROGRESS:
-			/* connection setup in progress */
-			skt->fd_tx_watch(1);
-			break;
-		default:
-			MG_LOG_ERR("mg_skt_open[%d]: connect failed <%s>\n",
-			           skt->fd, strerror(errno));
-			assert(0);
-			break;
+	while (!mg->dirty_list.empty()) {
+		/* everything written this pass, one writev() per socket */
+		mg->run_list.swap(mg->dirty_list);
+		for (class mg_skt *mg_skt : mg->run_list) {
+			mg_skt->dirty = 0;
+			mg_cork_flush(mg_skt);
 		}
+		mg->run_list.clear();
 	}
-	else {
-		MG_LOG_DBG("mg_skt_open[%d]: connect OK\n", skt->fd);
+	size_t n = 0;
+	for (class mg_skt *mg_skt : mg->zombie_list) {
+		if (mg_skt->rx_ready) {
+			/* still on the rx_ready_list, freed on the next pass */
+			mg->zombie_list[n++] = mg_skt;
+			continue;
+		}
+		mg->skt_free(mg_skt);
 	}
-	return (void*)skt;
+	mg->zombie_list.resize(n);
+#if MG_HIST
+	mg_hist_add(&mg->hist[MG_HIST_BATCH], mg_now_ns() - mg->hist_t);
+#endif
 }
 
-void mg_base::skt_close(void *handle)
+static int mg_dgram_dequeue(class mg_skt *mg_skt);
+static void mg_splice_dequeue(class mg_skt *mg_skt);
+static size_t mg_splice_pending(class mg_skt *mg_skt);
+
+static void mg_dequeue_skt(class mg_skt *mg_skt);
+
+/* first writable event of a connecting socket, nonzero if it got closed */
+static int mg_connect_done(class mg_skt *mg_skt)
 {
-//	class mg *_mg = (class mg*)priv;
-	class mg_skt *mg_skt = (class mg_skt*)handle;
-#if TXQ_ORIGINAL
-	assert(!mg_skt->txq_entries());
+	mg_skt_param_t *p = &mg_skt->params.skt;
+	int err = 0;
+	socklen_t len = sizeof(err);
+	mg_skt->connecting = 0;
+	if (getsockopt(mg_skt->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+		err = errno;
+	}
+	if (err) {
+		MG_LOG_DBG("mg_connect[%d]: connect failed <%s>\n", mg_skt->fd, strerror(err));
+		mg_skt->err = err;
+		if (p->close) {
+			p->close(p->handle);
+		}
+		mg_skt->skt_close();
+		return 1;
+	}
+	MG_LOG_DBG("mg_connect[%d]: connected\n", mg_skt->fd);
+	if (p->connected) {
+		p->connected(p->handle);
+	}
+	return mg_skt->closed;
+}
+
+void mg_dequeue(class mg_skt *mg_skt)
+{
+	if (mg_skt->closed) {
+		return;
+	}
+	if (mg_skt->connecting && mg_connect_done(mg_skt)) {
+		return;
+	}
+#if MG_HIST
+	uint64_t t0 = mg_now_ns();
+	mg_dequeue_skt(mg_skt);
+	mg_skt->hist_cb(MG_HIST_TX, t0);
 #else
-	assert(mg_skt->txq.empty());
-#endif // TXQ_ORIGINAL
-	mg_skt->fd_del();
-	close(mg_skt->fd);
-	delete mg_skt;
+	mg_dequeue_skt(mg_skt);
+#endif
+	mg_skt->txq_drained();
+	mg_skt->zc_complete();
 }
 
-int mg_skt_fd(void *handle)
+static void mg_dequeue_skt(class mg_skt *mg_skt)
 {
-	class mg_skt *skt = (class mg_skt*)handle;
-	return skt->fd;
+	MG_LOG_DBG("mg_dequeue[%d]: %zu bytes queued\n", mg_skt->fd, mg_skt->txq_len);
+	mg_skt->stats.tx_events++;
+	if (mg_skt->dgq_head && mg_dgram_dequeue(mg_skt)) {
+		/* socket is full again, tx_watch stays on */
+		return;
+	}
+	if (mg_txq_flush(mg_skt)) {
+		/* not all the data was sent, tx_watch stays on */
+		return;
+	}
+	/* queue is empty */
+	mg_splice_dequeue(mg_skt);
+	if (!mg_splice_pending(mg_skt)) {
+		mg_skt->fd_tx_watch(0);
+	}
 }
 
-void *mg::fd_open(int fd, mg_skt_param_t *p)
+/* write out the stream queue, nonzero if the socket filled up first */
+static int mg_txq_flush(class mg_skt *mg_skt)
 {
-	class mg_skt *skt = new mg_skt(this);
-	int r, on = 1;
-	assert(skt);
-	skt->fd = fd;
-	MG_LOG_DBG("mg_fd_open: opening socket %d\n", skt->fd);
-	assert(skt->fd >= 0);
-	skt->params.skt.rx = p->rx;
-	skt->params.skt.close = p->close;
-	skt->params.skt.handle = p->handle;
-	if (p->sock_addr) {
-		skt->rx = mg_skt_rx;
-		r = setsockopt(skt->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-		assert(r == 0);
-		if (p->tx_buf_size) {
-			r = setsockopt(skt->fd, SOL_SOCKET, SO_SNDBUFFORCE,
-			               &p->tx_buf_size, sizeof(p->tx_buf_size));
-			assert(r == 0);
+	while (mg_skt->txq_head) {
+		/*
+		 * gather the queued chunks into a single writev(), zero-copy
+		 * buffers into a MSG_ZEROCOPY send of their own: the chunks
+		 * are reused as soon as they are written
+		 */
+		struct iovec iov[MG_TXQ_IOV_MAX];
+		size_t len = 0;
+		int n = 0, zc = mg_skt->txq_head->zc != NULL;
+		int64_t zc_seq = -1;
+		for (class mg_txq_ent *c = mg_skt->txq_head;
+		        c && n < MG_TXQ_IOV_MAX && (c->zc != NULL) == zc; c = c->next, n++) {
+			iov[n].iov_base = c->base + c->rd;
+			iov[n].iov_len = c->wr - c->rd;
+			len += iov[n].iov_len;
 		}
-		if (p->rx_buf_size) {
-			r = setsockopt(skt->fd, SOL_SOCKET, SO_RCVBUFFORCE,
-			               &p->rx_buf_size, sizeof(p->rx_buf_size));
-			assert(r == 0);
+		size_t l = mg_skt->write_iov(iov, n, zc ? &zc_seq : NULL);
+		mg_skt->txq_consume(l, zc_seq);
+		if (l < len) {
+			return 1;
 		}
 	}
-	else {
-		skt->rx = mg_read;
-	}
-	skt->fd_add(skt->fd);
-	return (void*)skt;
+	return 0;
 }
 
-static void mg_accept(class mg_skt *mg_skt)
+/*
+ * Autocork: what was queued during the pass goes out now. With tx_watch
+ * already on the socket is full, the tx event will write it.
+ */
+static void mg_cork_flush(class mg_skt *mg_skt)
 {
-	struct sockaddr_storage addr_;
-	struct sockaddr *addr = (struct sockaddr*)&addr_;
-	socklen_t addr_len = sizeof(struct sockaddr_storage);
-	int fd = accept(mg_skt->fd, addr, &addr_len);
-	if (fd < 0) {
-		MG_LOG_ERR("mg_accept[%d]: accept failed <%s>\n",
-		           mg_skt->fd, strerror(errno));
-		assert(0);
+	if (mg_skt->closed || mg_skt->tx_watch || !mg_skt->txq_head) {
+		return;
 	}
-	else {
-		mg_listen_param_t *lp = &mg_skt->params.listen;
-		void **client_handle;
-		mg_skt_param_t p = {};
-		p.sock_addr = addr;
-		if ((client_handle = lp->accept(lp->handle, &p))) {
-			*client_handle = mg_skt->fd_open(fd, &p);
-		}
+	MG_LOG_DBG("mg_cork_flush[%d]: %zu bytes queued\n", mg_skt->fd, mg_skt->txq_len);
+	if (mg_txq_flush(mg_skt)) {
+		mg_skt->fd_tx_watch(1);
 	}
+	mg_skt->txq_drained();
+	mg_skt->zc_complete();
 }
 
-mg_base::mg_base(void)
+void mg_skt_flush(void *handle)
 {
-	priv = (void*)new(class mg);
+	mg_cork_flush((class mg_skt*)handle);
 }
 
-int mg_base::init(std::string poll_drv_name)
+void mg_timeout(class mg *mg)
 {
-	/* TODO: replace with find() or at() */
-	for (auto &it : mg_poll_drv_list) {
-		if (poll_drv_name == it.first) {
-			/* found a match */
-			class mg *_mg = (class mg*)priv;
-			_mg->poll_drv = it.second;
-			_mg->poll_drv->init(_mg);
-			break;
+#if MG_HIST
+	uint64_t fired = mg->timers.fired, t0 = mg_now_ns();
+	mg->timers.expire(mg_timer_wheel::now_ms());
+	if (mg->timers.fired != fired) {
+		mg->hist_cb(MG_HIST_TIMER, t0);
+	}
+#else
+	mg->timers.expire(mg_timer_wheel::now_ms());
+#endif
+}
+
+int mg_poll_timeout(class mg *mg)
+{
+#if MG_HIST
+	/* the driver is about to block */
+	mg->hist_t = mg_now_ns();
+#endif
+	if (!mg->rx_ready_list.empty() || mg->post_list.load(memory_order_relaxed)) {
+		/* just poll, the ready sockets and posts are serviced straight after */
+		return 0;
+	}
+	int ms = mg->timers.next_ms(mg_timer_wheel::now_ms());
+	if (mg->offload_wait_head && (ms < 0 || ms > 1)) {
+		/* room in the pool is not signalled, look again shortly */
+		ms = 1;
+	}
+	return ms;
+}
+static int mg_enqueue(class mg_skt *mg_skt, unsigned char *bufptr, int buflen)
+{
+	MG_LOG_DBG("mg_enqueue[%d]: buflen = %d, queued = %zu\n", mg_skt->fd, buflen, mg_skt->txq_len);
+	if (mg_skt->txq_len + buflen > mg_skt->txq_max) {
+		MG_LOG_DBG("mg_enqueue[%d]: queue is full\n", mg_skt->fd);
+		mg_skt->stats.tx_full++;
+		return -1;	// full
+	}
+	mg_skt->stats.tx_queued += buflen;
+	while (buflen) {
+		class mg_txq_ent *c = mg_skt->txq_tail;
+		if (!c || !c->chunk() || c->wr == MG_TXQ_CHUNK_SIZE) {
+			c = mg_skt->txq_chunk_get();
+			if (mg_skt->txq_tail) {
+				mg_skt->txq_tail->next = c;
+			}
+			else {
+				mg_skt->txq_head = c;
+			}
+			mg_skt->txq_tail = c;
 		}
+		int l = MG_TXQ_CHUNK_SIZE - c->wr;
+		if (l > buflen) {
+			l = buflen;
+		}
+		memcpy(c->base + c->wr, bufptr, l);
+		c->wr += l;
+		bufptr += l;
+		buflen -= l;
+		mg_skt->txq_len += l;
 	}
+	mg_skt->txq_grown();
+	mg_skt->txq_kick();
 	return 0;
 }
 
-int mg_base::dispatch(mg_param_t *p)
+int mg_skt_txv(void *handle, const struct iovec *iov, int iovcnt)
 {
-	int err = 0;
-	class mg *_mg = (class mg*)priv;
-	if (p && p->console.rx) {
-		/* std_in support requested */
-		mg_skt_param_t pc = {
-			.handle = p->console.handle,
-			.rx = p->console.rx
-		};
-		_mg->console_handle = _mg->fd_open(fileno(stdin), &pc);
+	class mg_skt *mg_skt = (class mg_skt*)handle;
+	size_t len = 0, sent = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
 	}
-	while (!err) {
-		err = _mg->poll_drv->wait_for_events();
+	MG_LOG_DBG("mg_skt_tx[%d]: sending %zu bytes\n", mg_skt->fd, len);
+	if (!mg_skt->txq_len && !mg_skt->cork) {
+		/* currently nothing enqueued, send it straight out */
+		sent = mg_skt->write_iov(iov, iovcnt);
 	}
-	return err;
+	if (sent == len) {
+		return 0;
+	}
+	if (len - sent > mg_skt->txq_max - mg_skt->txq_len) {
+		MG_LOG_DBG("mg_skt_tx[%d]: queue is full\n", mg_skt->fd);
+		mg_skt->stats.tx_full++;
+		return -1;
+	}
+	/* queue remaining data */
+	MG_LOG_DBG("mg_skt_tx[%d]: enqueued %zu bytes\n", mg_skt->fd, len - sent);
+	for (int i = 0; i < iovcnt; i++) {
+		size_t l = iov[i].iov_len;
+		if (sent >= l) {
+			sent -= l;
+			continue;
+		}
+		mg_enqueue(mg_skt, (unsigned char*)iov[i].iov_base + sent, l - sent);
+		sent = 0;
+	}
+	return 0;
 }
 
-void *mg_base::listen_open(mg_listen_param_t *p)
+int mg_skt_tx(void *handle, unsigned char *bufptr, int buflen)
 {
-	class mg *_mg = (class mg*)priv;
-	class mg_skt *skt = new mg_skt(_mg);
-	int r, on = 1;
-	assert(skt);
-	assert(p->accept);
-	skt->rx = mg_accept;
-	skt->fd = socket(p->family, p->type, p->protocol);
-	assert(skt->fd >= 0);
-	r = setsockopt(skt->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-	assert(r == 0);
-	if (bind(skt->fd, p->sock_addr, p->slen) < 0) {
-		MG_LOG_ERR("mg_listen_open: bind failed <%s>\n", strerror(errno));
-		assert(0);
+	struct iovec iov = { .iov_base = bufptr, .iov_len = (size_t)buflen };
+	return mg_skt_txv(handle, &iov, 1);
+}
+
+int mg_skt_tx_buf(void *handle, void *buf, unsigned char *data, int len)
+{
+	class mg_skt *mg_skt = (class mg_skt*)handle;
+	class mg_rxb *b = (class mg_rxb*)buf;
+	size_t sent = 0;
+	assert(data >= b->data && data + len <= b->data + MG_RXB_SIZE);
+	if (!mg_skt->txq_len && !mg_skt->cork) {
+		struct iovec iov = { .iov_base = data, .iov_len = (size_t)len };
+		sent = mg_skt->write_iov(&iov, 1);
 	}
-	skt->params.listen = *p;
-	_mg->fd_add(skt->fd, skt);
-	MG_LOG_DBG("mg_listen_open: opening socket %d\n", skt->fd);
-	r = listen(skt->fd, 10);	// 10 is an arbitrary queue length
-	assert(r == 0);
-	return (void*)skt;
+	if (sent == (size_t)len) {
+		return 0;
+	}
+	if (len - sent > mg_skt->txq_max - mg_skt->txq_len) {
+		MG_LOG_DBG("mg_skt_tx_buf[%d]: queue is full\n", mg_skt->fd);
+		mg_skt->stats.tx_full++;
+		return -1;
+	}
+	MG_LOG_DBG("mg_skt_tx_buf[%d]: queued %zu bytes by reference\n", mg_skt->fd, len - sent);
+	mg_skt->stats.tx_queued += len - sent;
+	mg_skt->txq_ref(b, data + sent, len - sent);
+	mg_skt->txq_grown();
+	mg_skt->txq_kick();
+	return 0;
 }
 
-void mg_base::listen_close(void *handle)
+int mg_skt_tx_zc(void *handle, unsigned char *buf, int len, void *ctx)
 {
-	class mg *_mg = (class mg*)priv;
 	class mg_skt *mg_skt = (class mg_skt*)handle;
-	_mg->fd_del(mg_skt);
-	close(mg_skt->fd);
-	delete mg_skt;
+	if (!mg_skt->zc_min || (uint32_t)len < mg_skt->zc_min) {
+		/* not worth pinning the pages */
+		return mg_skt_tx(handle, buf, len) ? -1 : 1;
+	}
+	if ((size_t)len > mg_skt->txq_max - mg_skt->txq_len) {
+		/* the whole of it must fit, it may be queued after a partial send */
+		MG_LOG_DBG("mg_skt_tx_zc[%d]: queue is full\n", mg_skt->fd);
+		mg_skt->stats.tx_full++;
+		return -1;
+	}
+	class mg_zc_req *r = (class mg_zc_req*)mg_skt->pool_get(sizeof(*r));
+	r->next = NULL;
+	r->ctx = ctx;
+	r->unsent = len;
+	r->zc = 0;
+	r->seq_last = 0;
+	if (mg_skt->zc_tail) {
+		mg_skt->zc_tail->next = r;
+	}
+	else {
+		mg_skt->zc_head = r;
+	}
+	mg_skt->zc_tail = r;
+	size_t sent = 0;
+	if (!mg_skt->txq_len && !mg_skt->cork) {
+		struct iovec iov = { .iov_base = buf, .iov_len = (size_t)len };
+		int64_t zc_seq;
+		sent = mg_skt->write_iov(&iov, 1, &zc_seq);
+		r->unsent -= sent;
+		if (zc_seq >= 0) {
+			r->zc = 1;
+			r->seq_last = zc_seq;
+		}
+	}
+	if (sent < (size_t)len) {
+		MG_LOG_DBG("mg_skt_tx_zc[%d]: queued %zu bytes by reference\n", mg_skt->fd, len - sent);
+		mg_skt->stats.tx_queued += len - sent;
+		mg_skt->txq_zc(r, buf + sent, len - sent);
+		mg_skt->txq_grown();
+		mg_skt->txq_kick();
+	}
+	/* e.g. all copied after ENOBUFS */
+	mg_skt->zc_complete();
+	return 0;
 }
 
-void *mg_base::timer_add(void *handle, void (*callback)(void*))
+#ifdef MSG_ZEROCOPY
+/* read the zerocopy completions off the socket's error queue */
+static void mg_zc_reap(class mg_skt *mg_skt)
 {
-	class mg *_mg = (class mg*)priv;
-	class mg_timer_cb *t = new mg_timer_cb();
-	_mg->timer_cb_list.insert(t);
-	t->callback = callback;
-	t->handle = handle;
-	return (void*)t;
+	unsigned char control[128];
+	struct msghdr msg;
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(mg_skt->fd, &msg, MSG_ERRQUEUE) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				MG_LOG_ERR("mg_zc_reap[%d]: recvmsg failed <%s>\n", mg_skt->fd, strerror(errno));
+			}
+			break;
+		}
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+			        (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+				continue;
+			}
+			struct sock_extended_err *ee = (struct sock_extended_err*)CMSG_DATA(cm);
+			if (ee->ee_errno || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				continue;
+			}
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				/* e.g. loopback: pinning pages only costs, copy from now on */
+				mg_skt->stats.tx_zc_copied++;
+				mg_skt->zc_min = 0;
+			}
+			/* sends ee_info..ee_data are complete, TCP reports them in order */
+			if ((int32_t)(ee->ee_data + 1 - mg_skt->zc_done) > 0) {
+				mg_skt->zc_done = ee->ee_data + 1;
+			}
+		}
+	}
+	mg_skt->zc_complete();
 }
 
-void mg_base::timer_del(void *handle)
+/* opt in to MSG_ZEROCOPY, left off if the socket does not support it */
+static void mg_zc_open(class mg_skt *mg_skt, const mg_skt_param_t *p)
 {
+	int on = 1;
+	if (!p->zerocopy_min) {
+		return;
+	}
+	if (setsockopt(mg_skt->fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) {
+		MG_LOG_DBG("mg_zc_open[%d]: SO_ZEROCOPY <%s>\n", mg_skt->fd, strerror(errno));
+		return;
+	}
+	mg_skt->zc_min = p->zerocopy_min;
+}
+#else
+static void mg_zc_reap(class mg_skt *mg_skt)
+{
+	mg_skt->zc_complete();
+}
+
+static void mg_zc_open(class mg_skt *mg_skt, const mg_skt_param_t *p)
+{
+}
+#endif
+
+void mg_buf_hold(void *buf)
+{
+	((class mg_rxb*)buf)->ref++;
+}
+
+void mg_buf_release(void *buf)
+{
+	mg::rxb_put((class mg_rxb*)buf);
+}
+
+static uint32_t mg_skt_rx_held(class mg_skt *mg_skt);
+
+/*
+ * read until EAGAIN or until the socket's rx budget is used up, into a
+ * pooled buffer for rx_buf sockets. The buffer is reused for the next
+ * read unless the callback held on to it.
+ */
+
+static void mg_skt_rx(class mg_skt *mg_skt)
+{
+	struct sockaddr_storage addr;
+	unsigned char stack_buf[MG_RX_BUF_SIZE];
+	unsigned char *rx_buf = stack_buf;
+	size_t rx_size = sizeof(stack_buf);
+	class mg_rxb *b = NULL;
+	mg_skt_param_t *p = &mg_skt->params.skt;
+	uint32_t done = 0;
+	if (mg_skt->rx_held) {
+		done = mg_skt_rx_held(mg_skt);
+		if (mg_skt->rx_comp) {
+			/* the driver reads the rest as it comes */
+			return;
+		}
+	}
+	if (mg_skt->rx_inflight) {
+		/* the driver's read is in the kernel, the data comes with it */
+		return;
+	}
+	if (p->rx_buf) {
+		b = mg_skt->rxb_get();
+		rx_buf = b->data;
+		rx_size = sizeof(b->data);
+	}
+	while (!mg_skt->closed && mg_skt->rx_watch) {
+		if (done >= mg_skt->rx_budget) {
+			mg_skt->rx_requeue();
+			break;
+		}
+		if (b && b->ref > 1) {
+			/* held by the callback, read into a fresh one */
+			mg::rxb_put(b);
+			b = mg_skt->rxb_get();
+			rx_buf = b->data;
+		}
+		socklen_t slen = sizeof(addr);
+		int l = recvfrom(mg_skt->fd, rx_buf, rx_size,
+		                 0, (struct sockaddr*)&addr, &slen);
+		MG_LOG_DBG("mg_skt_rx[%d]: receiving %d bytes\n", mg_skt->fd, l);
+		switch (l) {
+		case -1:
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* drained */
+				break;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			MG_LOG_ERR("mg_skt_rx: read failed <%s>\n", strerror(errno));
+			mg_skt->err = errno;
+		/* drop through */
+		case 0:
+			/*  connection is closed */
+			if (p->close) {
+				p->close(p->handle);
+			}
+			mg_skt->skt_close();
+			break;
+		default:
+			done += l;
+			mg_skt->stats.rx_reads++;
+			mg_skt->stats.rx_bytes += l;
+			if (b) {
+				p->rx_buf(p->handle, b, rx_buf, l);
+			}
+			else {
+				p->rx(p->handle, (struct sockaddr*)&addr, rx_buf, l);
+			}
+			continue;
+		}
+		break;
+	}
+	if (b) {
+		mg::rxb_put(b);
+	}
+}
+
+/* read before anything else still to be read: it goes first */
+static uint32_t mg_skt_rx_held(class mg_skt *mg_skt)
+{
+	struct sockaddr_storage addr;
+	mg_skt_param_t *p = &mg_skt->params.skt;
+	class mg_rxb *b = mg_skt->rx_held;
+	unsigned char *data = b->data + mg_skt->rx_held_off;
+	uint32_t len = mg_skt->rx_held_len;
+	mg_skt->rx_held = NULL;
+	mg_skt->rx_held_len = 0;
+	if (p->rx_buf) {
+		p->rx_buf(p->handle, b, data, len);
+	}
+	else {
+		memset(&addr, 0, sizeof(addr));
+		p->rx(p->handle, (struct sockaddr*)&addr, data, len);
+	}
+	mg::rxb_put(b);
+	return len;
+}
+
+/*
+ * Completion reads, for plain rx and rx_buf stream sockets only: one at a
+ * time, and never while held data waits, so that data is delivered in
+ * the order it was read. Sockets still connecting are polled, as are
+ * zerocopy ones, whose completions come on the error queue.
+ */
+void *mg_rx_comp_buf(class mg_skt *mg_skt, unsigned char **data, size_t *size)
+{
+	if (mg_skt->closed || mg_skt->rx != mg_skt_rx || !mg_skt->rx_watch ||
+	        mg_skt->rx_held || mg_skt->rx_inflight || mg_skt->connecting ||
+	        mg_skt->zc_min || mg_skt->tx_failed) {
+		return NULL;
+	}
+	class mg_rxb *b = mg_skt->rxb_get();
+	mg_skt->rx_comp = 1;
+	mg_skt->rx_inflight = 1;
+	*data = b->data;
+	/* one read per pass, within the rx budget */
+	*size = mg_skt->rx_budget < sizeof(b->data) ? mg_skt->rx_budget : sizeof(b->data);
+	return b;
+}
+
+void mg_rx_comp_held(class mg_skt *mg_skt, void *buf, int res)
+{
+	class mg_rxb *b = (class mg_rxb*)buf;
+	mg_skt->rx_inflight = 0;
+	if (res > 0) {
+		mg_skt->stats.rx_reads++;
+		mg_skt->stats.rx_bytes += res;
+		mg_skt->rx_hold(b, res);
+		return;
+	}
+	mg::rxb_put(b);
+	if (res < 0 && res != -ECANCELED && !mg_skt->err) {
+		/* the next read finds the connection closed */
+		MG_LOG_ERR("mg_skt_rx: read failed <%s>\n", strerror(-res));
+		mg_skt->err = -res;
+	}
+}
+
+void mg_rx_comp(class mg_skt *mg_skt, void *buf, int res)
+{
+	MG_LOG_DBG("mg_rx_comp[%d]: %d\n", mg_skt->fd, res);
+	mg_rx_comp_held(mg_skt, buf, res);
+	if (res != -ECANCELED) {
+		/* as for a readiness event, unless paused meanwhile */
+		mg_rx(mg_skt);
+	}
+}
+
+/* rx_ready sockets: the application does the reading */
+static void mg_skt_rx_notify(class mg_skt *mg_skt)
+{
+	mg_skt_param_t *p = &mg_skt->params.skt;
+	mg_skt->rx_drained = 0;
+	p->rx_ready(p->handle);
+	if (!mg_skt->closed && mg_skt->rx_watch && !mg_skt->rx_drained) {
+		/* left data behind: no new edge may come for it */
+		mg_skt->rx_requeue();
+	}
+}
+
+int mg_skt_recv(void *handle, void *buf, int len)
+{
+	class mg_skt *mg_skt = (class mg_skt*)handle;
+	if (mg_skt->rx_held && len > 0) {
+		/* handed over with the socket, see skt_adopt() */
+		uint32_t l = (uint32_t)len < mg_skt->rx_held_len ? len : mg_skt->rx_held_len;
+		memcpy(buf, mg_skt->rx_held->data + mg_skt->rx_held_off, l);
+		mg_skt->rx_held_off += l;
+		mg_skt->rx_held_len -= l;
+		if (!mg_skt->rx_held_len) {
+			mg_skt->rx_held_drop();
+		}
+		return l;
+	}
+	for (;;) {
+		ssize_t l = recv(mg_skt->fd, buf, len, 0);
+		if (l > 0) {
+			mg_skt->stats.rx_reads++;
+			mg_skt->stats.rx_bytes += l;
+			return l;
+		}
+		if (l < 0 && errno == EINTR) {
+			continue;
+		}
+		mg_skt->rx_drained = 1;
+		if (l < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return -1;
+		}
+		if (l < 0) {
+			MG_LOG_DBG("mg_skt_recv[%d]: read failed <%s>\n", mg_skt->fd, strerror(errno));
+			mg_skt->err = errno;
+		}
+		return 0;
+	}
+}
+
+static void mg_read(class mg_skt *mg_skt)
+{
+	unsigned char rx_buf[MG_RX_BUF_SIZE];
+	int l = read(mg_skt->fd, rx_buf, sizeof(rx_buf) - 1);
+	if (l < 0) {
+		MG_LOG_ERR("mg_skt_rx[%d]: read failed <%s>\n", mg_skt->fd, strerror(errno));
+	}
+	else {
+		mg_skt_param_t *p = &mg_skt->params.skt;
+		if (l > 0) {
+			mg_skt->stats.rx_reads++;
+			mg_skt->stats.rx_bytes += l;
+			rx_buf[l] = 0;
+			p->rx(p->handle, NULL, rx_buf, l);
+		}
+	}
+}
+
+/*
+ * Datagram batches: up to MG_DGRAM_BATCH_MAX datagrams are moved per
+ * recvmmsg() / sendmmsg(), each with its own peer address.
+ */
+#ifdef __linux__
+#define mg_recvmmsg(fd, msgs, n) recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL)
+#define mg_sendmmsg(fd, msgs, n) sendmmsg(fd, msgs, n, MSG_DONTWAIT)
+#else
+/* one syscall per datagram, same return values as recvmmsg() / sendmmsg() */
+static int mg_recvmmsg(int fd, mg_mmsghdr_t *msgs, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		ssize_t l = recvmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+		if (l < 0) {
+			return i ? i : -1;
+		}
+		msgs[i].msg_len = l;
+	}
+	return i;
+}
+
+static int mg_sendmmsg(int fd, mg_mmsghdr_t *msgs, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		ssize_t l = sendmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+		if (l < 0) {
+			return i ? i : -1;
+		}
+		msgs[i].msg_len = l;
+	}
+	return i;
+}
+#endif
+
+static void mg_dgram_rx_open(class mg_skt *mg_skt, mg_skt_param_t *p)
+{
+	mg_dgram_rx_t *r = new mg_dgram_rx_t();
+	r->n = p->rx_batch_size ? p->rx_batch_size : MG_DGRAM_BATCH;
+	if (r->n > MG_DGRAM_BATCH_MAX) {
+		r->n = MG_DGRAM_BATCH_MAX;
+	}
+	r->size = p->rx_dgram_size ? p->rx_dgram_size : MG_RX_BUF_SIZE;
+	r->msgs = new mg_mmsghdr_t[r->n]();
+	r->iov = new struct iovec[r->n];
+	r->addr = new struct sockaddr_storage[r->n];
+	r->dgram = new mg_dgram_t[r->n];
+	r->buf = new unsigned char[r->n * r->size];
+	for (int i = 0; i < r->n; i++) {
+		r->iov[i].iov_base = r->buf + i * r->size;
+		r->iov[i].iov_len = r->size;
+		r->msgs[i].msg_hdr.msg_iov = &r->iov[i];
+		r->msgs[i].msg_hdr.msg_iovlen = 1;
+		r->msgs[i].msg_hdr.msg_name = &r->addr[i];
+	}
+	mg_skt->dgram_rx = r;
+}
+
+/* read batches until EAGAIN or until the socket's rx budget is used up */
+static void mg_dgram_rx(class mg_skt *mg_skt)
+{
+	mg_dgram_rx_t *r = mg_skt->dgram_rx;
+	mg_skt_param_t *p = &mg_skt->params.skt;
+	uint32_t done = 0;
+	while (!mg_skt->closed && mg_skt->rx_watch) {
+		if (done >= mg_skt->rx_budget) {
+			mg_skt->rx_requeue();
+			return;
+		}
+		for (int i = 0; i < r->n; i++) {
+			r->msgs[i].msg_hdr.msg_namelen = sizeof(r->addr[i]);
+		}
+		uint32_t done_before = done;
+		int m = mg_recvmmsg(mg_skt->fd, r->msgs, r->n);
+		if (m < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* drained */
+				return;
+			}
+			if (errno == EINTR || errno == ECONNREFUSED) {
+				/* ICMP error of an earlier datagram, nothing lost */
+				continue;
+			}
+			MG_LOG_ERR("mg_dgram_rx[%d]: recvmmsg failed <%s>\n", mg_skt->fd, strerror(errno));
+			return;
+		}
+		MG_LOG_DBG("mg_dgram_rx[%d]: received %d datagrams\n", mg_skt->fd, m);
+		int k = 0;
+		for (int i = 0; i < m; i++) {
+			if (r->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				MG_LOG_ERR("mg_dgram_rx[%d]: datagram larger than %zu bytes dropped\n",
+				           mg_skt->fd, r->size);
+				continue;
+			}
+			mg_dgram_t *d = &r->dgram[k++];
+			d->addr = (struct sockaddr*)&r->addr[i];
+			d->addr_len = r->msgs[i].msg_hdr.msg_namelen;
+			d->buf = (unsigned char*)r->iov[i].iov_base;
+			d->len = r->msgs[i].msg_len;
+			done += d->len;
+		}
+		mg_skt->stats.rx_reads += k;
+		mg_skt->stats.rx_bytes += done - done_before;
+		if (p->rx_batch) {
+			p->rx_batch(p->handle, r->dgram, k);
+		}
+		else {
+			/* one at a time for the plain rx callback */
+			for (int i = 0; i < k && !mg_skt->closed; i++) {
+				p->rx(p->handle, r->dgram[i].addr, r->dgram[i].buf, r->dgram[i].len);
+			}
+		}
+		if (m < r->n) {
+			/* short batch, nothing left */
+			return;
+		}
+	}
+}
+
+/*
+ * One sendmmsg(), returns how many datagrams are done with: sent, or
+ * dropped because they can never be sent. 0 if the socket is full.
+ */
+static int mg_dgram_send(class mg_skt *mg_skt, mg_mmsghdr_t *msgs, int n)
+{
+	for (;;) {
+		int m = mg_sendmmsg(mg_skt->fd, msgs, n);
+		if (m >= 0) {
+			MG_LOG_DBG("mg_dgram_send[%d]: sent %d datagrams\n", mg_skt->fd, m);
+			mg_skt->stats.tx_writes += m;
+			for (int i = 0; i < m; i++) {
+				mg_skt->stats.tx_bytes += msgs[i].msg_len;
+			}
+			return m;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			mg_skt->stats.tx_eagain++;
+			return 0;
+		}
+		if (errno != EINTR) {
+			/* unreachable, too big... it is the first one that failed */
+			MG_LOG_ERR("mg_dgram_send[%d]: datagram dropped <%s>\n",
+			           mg_skt->fd, strerror(errno));
+			return 1;
+		}
+	}
+}
+
+static void mg_dgram_msg(mg_mmsghdr_t *msg, struct iovec *iov,
+                         struct sockaddr *addr, socklen_t addr_len,
+                         unsigned char *buf, size_t len)
+{
+	memset(msg, 0, sizeof(*msg));
+	iov->iov_base = buf;
+	iov->iov_len = len;
+	msg->msg_hdr.msg_name = addr;
+	msg->msg_hdr.msg_namelen = addr ? addr_len : 0;
+	msg->msg_hdr.msg_iov = iov;
+	msg->msg_hdr.msg_iovlen = 1;
+}
+
+static int mg_dgram_enqueue(class mg_skt *mg_skt, const mg_dgram_t *d)
+{
+	if (mg_skt->txq_len + d->len > mg_skt->txq_max) {
+		MG_LOG_DBG("mg_dgram_enqueue[%d]: queue is full\n", mg_skt->fd);
+		mg_skt->stats.tx_full++;
+		return -1;
+	}
+	class mg_dgram_q *q = (class mg_dgram_q*)mg_skt->pool_get(sizeof(*q) + d->len);
+	q->next = NULL;
+	q->addr_len = d->addr ? d->addr_len : 0;
+	assert(q->addr_len <= sizeof(q->addr));
+	memcpy(&q->addr, d->addr, q->addr_len);
+	q->len = d->len;
+	memcpy(q->data(), d->buf, d->len);
+	if (mg_skt->dgq_tail) {
+		mg_skt->dgq_tail->next = q;
+	}
+	else {
+		mg_skt->dgq_head = q;
+	}
+	mg_skt->dgq_tail = q;
+	mg_skt->txq_len += d->len;
+	mg_skt->stats.tx_queued += d->len;
+	mg_skt->txq_grown();
+	mg_skt->fd_tx_watch(1);
+	return 0;
+}
+
+/* flush the datagram queue, returns non zero if some are still queued */
+static int mg_dgram_dequeue(class mg_skt *mg_skt)
+{
+	mg_mmsghdr_t msgs[MG_DGRAM_BATCH_MAX];
+	struct iovec iov[MG_DGRAM_BATCH_MAX];
+	while (mg_skt->dgq_head) {
+		int n = 0;
+		for (class mg_dgram_q *q = mg_skt->dgq_head;
+		        q && n < MG_DGRAM_BATCH_MAX; q = q->next, n++) {
+			mg_dgram_msg(&msgs[n], &iov[n], q->addr_len ? (struct sockaddr*)&q->addr : NULL,
+			             q->addr_len, q->data(), q->len);
+		}
+		int m = mg_dgram_send(mg_skt, msgs, n);
+		if (!m) {
+			return 1;
+		}
+		while (m--) {
+			mg_skt->dgq_pop();
+		}
+	}
+	return 0;
+}
+
+int mg_skt_tx_dgram(void *handle, const mg_dgram_t *dgram, int n)
+{
+	class mg_skt *mg_skt = (class mg_skt*)handle;
+	mg_mmsghdr_t msgs[MG_DGRAM_BATCH_MAX];
+	struct iovec iov[MG_DGRAM_BATCH_MAX];
+	int i = 0;
+	if (!mg_skt->dgq_head) {
+		/* currently nothing enqueued, send them straight out */
+		while (i < n) {
+			int m = n - i < MG_DGRAM_BATCH_MAX ? n - i : MG_DGRAM_BATCH_MAX;
+			for (int j = 0; j < m; j++) {
+				const mg_dgram_t *d = &dgram[i + j];
+				mg_dgram_msg(&msgs[j], &iov[j], d->addr, d->addr_len, d->buf, d->len);
+			}
+			m = mg_dgram_send(mg_skt, msgs, m);
+			if (!m) {
+				break;
+			}
+			i += m;
+		}
+	}
+	/* queue the remaining ones, in order */
+	for (; i < n; i++) {
+		if (mg_dgram_enqueue(mg_skt, &dgram[i]) < 0) {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * splice() forwarding: data read from one socket of the pair goes through
+ * a pipe straight into the other one, it never reaches user space.
+ */
+#ifdef __linux__
+/* move as much as possible from skt's pipe to its peer, returns bytes left */
+static size_t mg_splice_flush(class mg_skt *mg_skt)
+{
+	mg_splice_t *sp = mg_skt->splice;
+	while (sp->len) {
+		if (sp->peer->txq_len) {
+			/* queued data goes first, mg_dequeue() on the peer carries on */
+			sp->peer->fd_tx_watch(1);
+			break;
+		}
+		ssize_t l = splice(sp->pipe[0], NULL, sp->peer->fd, NULL, sp->len,
+		                   SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+		if (l < 0) {
+			if (errno == EAGAIN) {
+				sp->peer->stats.tx_eagain++;
+				/* peer is full, mg_dequeue() on the peer carries on */
+				sp->peer->fd_tx_watch(1);
+				break;
+			}
+			MG_LOG_ERR("mg_splice_flush[%d]: splice failed <%s>\n",
+			           sp->peer->fd, strerror(errno));
+			/* the peer is broken, the data can never be delivered */
+			sp->len = 0;
+			sp->eof = 1;
+			break;
+		}
+		MG_LOG_DBG("mg_splice_flush[%d]: %zd bytes to %d\n", mg_skt->fd, l, sp->peer->fd);
+		sp->len -= l;
+		sp->peer->stats.tx_writes++;
+		sp->peer->stats.tx_bytes += l;
+	}
+	return sp->len;
+}
+
+static void mg_splice_rx(class mg_skt *mg_skt)
+{
+	mg_splice_t *sp = mg_skt->splice;
+	uint32_t done = 0;
+	while (!sp->eof && sp->peer) {
+		if (mg_splice_flush(mg_skt)) {
+			/* resumed by mg_splice_dequeue() once the peer drains */
+			return;
+		}
+		if (sp->eof) {
+			break;
+		}
+		if (done >= mg_skt->rx_budget) {
+			mg_skt->rx_requeue();
+			return;
+		}
+		ssize_t l = splice(mg_skt->fd, NULL, sp->pipe[1], NULL, MG_SPLICE_LEN,
+		                   SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+		if (l > 0) {
+			sp->len += l;
+			done += l;
+			mg_skt->stats.rx_reads++;
+			mg_skt->stats.rx_bytes += l;
+			continue;
+		}
+		if (l < 0 && errno == EAGAIN) {
+			/* the pipe is empty here, so the socket is drained */
+			return;
+		}
+		if (l < 0) {
+			MG_LOG_ERR("mg_splice_rx[%d]: splice failed <%s>\n", mg_skt->fd, strerror(errno));
+			mg_skt->err = errno;
+		}
+		sp->eof = 1;
+	}
+	if (sp->peer && mg_splice_flush(mg_skt)) {
+		/* deliver what is left before propagating the close */
+		return;
+	}
+	/*  connection is closed */
+	mg_skt_param_t *p = &mg_skt->params.skt;
+	if (p->close) {
+		p->close(p->handle);
+	}
+	if (!mg_skt->closed) {
+		mg_skt->skt_close();
+	}
+}
+
+/* mg_skt has room again: drain the pipe feeding it and resume its source */
+static void mg_splice_dequeue(class mg_skt *mg_skt)
+{
+	if (!mg_skt->splice || !mg_skt->splice->peer) {
+		return;
+	}
+	class mg_skt *src = mg_skt->splice->peer;
+	if (!mg_splice_flush(src)) {
+		mg_splice_rx(src);
+	}
+}
+
+/* bytes waiting in the pipe feeding mg_skt */
+static size_t mg_splice_pending(class mg_skt *mg_skt)
+{
+	if (!mg_skt->splice || !mg_skt->splice->peer) {
+		return 0;
+	}
+	return mg_skt->splice->peer->splice->len;
+}
+
+/* read but not delivered yet: queued for the peer ahead of the pipe */
+static void mg_splice_held(class mg_skt *mg_skt, class mg_skt *peer)
+{
+	mg_skt->rx_sync(1);
+	if (!mg_skt->rx_held) {
+		return;
+	}
+	size_t max = peer->txq_max;
+	peer->txq_max = SIZE_MAX;
+	mg_skt_tx_buf(peer, mg_skt->rx_held, mg_skt->rx_held->data + mg_skt->rx_held_off,
+	              mg_skt->rx_held_len);
+	peer->txq_max = max;
+	mg_skt->rx_held_drop();
+}
+
+/*
+ * splice() into a reset socket raises SIGPIPE and cannot be given
+ * MSG_NOSIGNAL: unless the application handles it, ignore it, the
+ * error is reported by mg_splice_flush()
+ */
+static int mg_sigpipe_ignore(void)
+{
+	struct sigaction sa;
+	if (sigaction(SIGPIPE, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+		signal(SIGPIPE, SIG_IGN);
+	}
+	return 0;
+}
+
+static int mg_splice_open(class mg_skt *mg_skt, class mg_skt *peer)
+{
+	static int sigpipe = mg_sigpipe_ignore();
+	(void)sigpipe;
+	mg_splice_t *sp = new mg_splice_t();
+	if (pipe2(sp->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		MG_LOG_ERR("mg_splice_open[%d]: pipe failed <%s>\n", mg_skt->fd, strerror(errno));
+		delete sp;
+		return -1;
+	}
+	/* a blocking socket would stall the loop in splice() */
+	fcntl(mg_skt->fd, F_SETFL, fcntl(mg_skt->fd, F_GETFL) | O_NONBLOCK);
+	sp->peer = peer;
+	mg_skt->splice = sp;
+	return 0;
+}
+
+void mg_skt::splice_close()
+{
+	if (!splice) {
+		return;
+	}
+	if (splice->peer && splice->peer->splice &&
+	        splice->peer->splice->peer == this) {
+		/* the peer has nowhere to send to any more */
+		splice->peer->splice->peer = NULL;
+	}
+	close(splice->pipe[0]);
+	close(splice->pipe[1]);
+	delete splice;
+	splice = NULL;
+}
+
+int mg_skt_splice(void *handle_a, void *handle_b)
+{
+	class mg_skt *a = (class mg_skt*)handle_a;
+	class mg_skt *b = (class mg_skt*)handle_b;
+	assert(!a->splice && !b->splice);
+	if (mg_splice_open(a, b) < 0) {
+		return -1;
+	}
+	if (mg_splice_open(b, a) < 0) {
+		a->splice_close();
+		return -1;
+	}
+	MG_LOG_DBG("mg_skt_splice: %d <-> %d\n", a->fd, b->fd);
+	a->rx = mg_splice_rx;
+	b->rx = mg_splice_rx;
+	mg_splice_held(a, b);
+	mg_splice_held(b, a);
+	return 0;
+}
+#else
+static void mg_splice_dequeue(class mg_skt *mg_skt)
+{
+}
+
+static size_t mg_splice_pending(class mg_skt *mg_skt)
+{
+	return 0;
+}
+
+void mg_skt::splice_close()
+{
+}
+
+int mg_skt_splice(void *handle_a, void *handle_b)
+{
+	return -1;
+}
+#endif // __linux__
+
+void *mg_base::skt_open(mg_skt_param_t *p)
+{
+	class mg_skt *skt = mg_cur(priv)->skt_new();
+	int r, on = 1;
+	assert(skt);
+	skt->rx = mg_skt_rx;
+	if ((skt->fd = socket(p->family, p->type | SOCK_NONBLOCK, p->protocol)) < 0) {
+		MG_LOG_ERR("mg_skt_open: socket failed <%s>\n", strerror(errno));
+		assert(0);
+	};
+	MG_LOG_DBG("mg_skt_open: opening socket %d\n", skt->fd);
+	r = setsockopt(skt->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	assert(r == 0);
+	if (p->tx_buf_size) {
+		r = setsockopt(skt->fd, SOL_SOCKET, SO_SNDBUFFORCE,
+		               &p->tx_buf_size, sizeof(p->tx_buf_size));
+		assert(r == 0);
+	}
+	if (p->rx_buf_size) {
+		r = setsockopt(skt->fd, SOL_SOCKET, SO_RCVBUFFORCE,
+		               &p->rx_buf_size, sizeof(p->rx_buf_size));
+		assert(r == 0);
+	}
+	if (p->sock_addr && bind(skt->fd, p->sock_addr, p->slen) < 0) {
+		MG_LOG_ERR("mg_skt_open: bind failed <%s>\n", strerror(errno));
+		assert(0);
+	}
+	skt->params.skt = *p;
+	skt->limits_set(p);
+	mg_zc_open(skt, p);
+	if (p->rx_batch || p->type == SOCK_DGRAM) {
+		mg_dgram_rx_open(skt, p);
+		skt->rx = mg_dgram_rx;
+	}
+	else if (p->rx_ready) {
+		skt->rx = mg_skt_rx_notify;
+	}
+	if (skt->fd_add(skt->fd) < 0) {
+		/* reported by close, as a connect that failed */
+		skt->fd_add_failed();
+	}
+	else if (p->connect_addr &&
+	        connect(skt->fd, p->connect_addr, p->connect_addr_len) < 0) {
+		switch (errno) {
+		case EAGAIN:
+		case EINPROGRESS:
+			/* connection setup in progress */
+			skt->connecting = 1;
+			skt->fd_tx_watch(1);
+			break;
+		default:
+			MG_LOG_ERR("mg_skt_open[%d]: connect failed <%s>\n",
+			           skt->fd, strerror(errno));
+			assert(0);
+			break;
+		}
+	}
+	else if (p->connect_addr) {
+		MG_LOG_DBG("mg_skt_open[%d]: connect OK\n", skt->fd);
+		if (p->connected) {
+			/* still reported from the loop, once the caller has the handle */
+			skt->connecting = 1;
+			skt->fd_tx_watch(1);
+		}
+	}
+	if (p->splice) {
+		mg_skt_splice(skt, p->splice);
+	}
+	return (void*)skt;
+}
+
+void mg_base::skt_close(void *handle)
+{
+	class mg_skt *mg_skt = (class mg_skt*)handle;
+	mg_skt->skt_close();
+}
+
+static void mg_linger_timeout(void *handle)
+{
+	class mg_skt *mg_skt = (class mg_skt*)handle;
+	MG_LOG_DBG("mg_skt_linger[%d]: timed out\n", mg_skt->fd);
+	mg_skt->skt_close();
+}
+
+/*
+ * Discard whatever the peer still sends, so that the final close() does
+ * not reset the connection, until it shuts down its side too
+ */
+static void mg_linger_rx(class mg_skt *mg_skt)
+{
+	unsigned char buf[MG_RX_BUF_SIZE];
+	uint32_t done = 0;
+	ssize_t l;
+	for (;;) {
+		if (done >= mg_skt->rx_budget) {
+			mg_skt->rx_requeue();
+			return;
+		}
+		l = recv(mg_skt->fd, buf, sizeof(buf), 0);
+		if (l > 0) {
+			done += l;
+			continue;
+		}
+		if (l < 0 && errno == EINTR) {
+			continue;
+		}
+		break;
+	}
+	if (l < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	if (l == 0 && !mg_skt->linger_wr) {
+		/* half closed: the peer may still be reading what is queued */
+		mg_skt->linger_eof = 1;
+		mg_skt->rx_pause(MG_PAUSE_LINGER);
+		return;
+	}
+	mg_skt->skt_close();
+}
+
+void mg_base::skt_linger(void *handle)
+{
+	class mg_skt *mg_skt = (class mg_skt*)handle;
+	mg_skt_param_t *p = &mg_skt->params.skt;
+	if (mg_skt->closed || mg_skt->linger) {
+		return;
+	}
+	if (mg_skt->rx == mg_accept || mg_skt->dgram_rx || mg_skt->dgq_head ||
+	        mg_skt->connecting || mg_skt->tx_failed) {
+		/* nothing worth waiting for */
+		mg_skt->skt_close();
+		return;
+	}
+	MG_LOG_DBG("mg_skt_linger[%d]: %zu bytes queued\n", mg_skt->fd, mg_skt->txq_len);
+	/* the handle is the application's no more: tx_done is all it still gets */
+	void (*tx_done)(void*, void*) = p->tx_done;
+	void *h = p->handle;
+	memset(p, 0, sizeof(*p));
+	p->handle = h;
+	p->tx_done = tx_done;
+	mg_skt->splice_close();
+	mg_skt->linger = 1;
+	mg_skt->rx = mg_linger_rx;
+	/* read ahead of the application: discarded with the rest */
+	mg_skt->rx_sync(1);
+	mg_skt->rx_held_drop();
+	mg_skt->linger_timer = new mg_timer_cb();
+	mg_skt->linger_timer->handle = mg_skt;
+	mg_skt->linger_timer->callback = mg_linger_timeout;
+	mg_skt->loop()->timers.add(mg_skt->linger_timer, MG_LINGER_MS);
+	/* read whatever the application or its jobs had paused */
+	mg_skt->rx_unpause(~0);
+	mg_skt->rx_resume();
+	if (!mg_skt->txq_len) {
+		mg_skt->linger_drained();
+	}
+	else {
+		/* corked data included, it goes out as usual */
+		mg_skt->txq_kick();
+	}
+}
+
+int mg_skt_fd(void *handle)
+{
+	class mg_skt *skt = (class mg_skt*)handle;
+	return skt->fd;
+}
+
+size_t mg_skt_tx_queued(void *handle)
+{
+	class mg_skt *skt = (class mg_skt*)handle;
+	return skt->txq_len;
+}
+
+int mg_skt_error(void *handle)
+{
+	class mg_skt *skt = (class mg_skt*)handle;
+	return skt->err;
+}
+
+int mg_skt_rx_watched(class mg_skt *mg_skt)
+{
+	return mg_skt->rx_watch;
+}
+
+int mg_skt_tx_watched(class mg_skt *mg_skt)
+{
+	return mg_skt->tx_watch;
+}
+
+void mg_skt_rx_pause(void *handle)
+{
+	class mg_skt *skt = (class mg_skt*)handle;
+	if (!(skt->rx_paused & MG_PAUSE_APP)) {
+		skt->stats.rx_pauses++;
+	}
+	skt->rx_pause(MG_PAUSE_APP);
+}
+
+void mg_skt_rx_resume(void *handle)
+{
+	class mg_skt *skt = (class mg_skt*)handle;
+	skt->rx_unpause(MG_PAUSE_APP);
+}
+
+/*
+ * Offload jobs go from the loop to the pool, whose workers hand them back
+ * through post(). A socket keeps its jobs in submission order and only
+ * completes the ones at its head, so a job done early waits for the
+ * earlier ones.
+ */
+static void mg_job_done(void *handle)
+{
+	class mg_skt_job *job = (class mg_skt_job*)handle;
+	class mg_skt *skt = job->skt;
+	class mg *mg = skt->loop();
+	job->finished = 1;
+	while ((job = skt->job_head) && job->finished) {
+		skt->job_head = job->next;
+		if (!skt->job_head) {
+			skt->job_tail = NULL;
+		}
+		skt->job_len--;
+		job->done(job->arg, skt->closed ? NULL : skt);
+		mg->pool_put(job, sizeof(*job));
+	}
+	if (skt->job_zombie) {
+		if (!skt->job_len) {
+			skt->job_zombie = 0;
+			mg->zombie_list.push_back(skt);
+		}
+		return;
+	}
+	if ((skt->rx_paused & MG_PAUSE_JOBS) && skt->job_len <= mg->offload_skt_max / 2) {
+		skt->rx_unpause(MG_PAUSE_JOBS);
+	}
+}
+
+/* on the worker, once the job's work is done */
+static void mg_job_complete(class mg_offload_job *j)
+{
+	class mg_skt_job *job = (class mg_skt_job*)j;
+	job->skt->loop()->post_push(&job->post);
+}
+
+void mg_skt_offload(void *handle, void (*work)(void*), void (*done)(void*, void*), void *arg)
+{
+	class mg_skt *skt = (class mg_skt*)handle;
+	class mg *mg = skt->loop();
+	if (!mg->offload) {
+		work(arg);
+		done(arg, handle);
+		return;
+	}
+	class mg_skt_job *job = new (mg->pool_get(sizeof(class mg_skt_job))) mg_skt_job;
+	job->work = work;
+	job->arg = arg;
+	job->complete = mg_job_complete;
+	job->post.callback = mg_job_done;
+	job->post.handle = job;
+	job->post.alloc = 0;
+	job->skt = skt;
+	job->done = done;
+	job->next = NULL;
+	job->wait_next = NULL;
+	job->finished = 0;
+	if (skt->job_tail) {
+		skt->job_tail->next = job;
+	}
+	else {
+		skt->job_head = job;
+	}
+	skt->job_tail = job;
+	skt->job_len++;
+	mg->stats.offloads++;
+	int full = mg->offload_wait_head || mg->offload->submit(job) < 0;
+	if (full) {
+		/* keep it, in order, until the pool has room */
+		mg->stats.offload_full++;
+		if (mg->offload_wait_tail) {
+			mg->offload_wait_tail->wait_next = job;
+		}
+		else {
+			mg->offload_wait_head = job;
+		}
+		mg->offload_wait_tail = job;
+	}
+	if (full || skt->job_len >= mg->offload_skt_max) {
+		/* stop reading more work than the pool can take */
+		skt->rx_pause(MG_PAUSE_JOBS);
+	}
+}
+
+void mg::offload_retry(void)
+{
+	while (offload_wait_head && offload->submit(offload_wait_head) == 0) {
+		offload_wait_head = offload_wait_head->wait_next;
+	}
+	if (!offload_wait_head) {
+		offload_wait_tail = NULL;
+	}
+}
+
+/*
+ * After the loop has stopped and the pool has run what it had queued:
+ * complete the jobs handed back, then run the waiting ones here.
+ */
+void mg::offload_drain(void)
+{
+	post_run();
+	while (offload_wait_head) {
+		class mg_skt_job *job = offload_wait_head;
+		offload_wait_head = job->wait_next;
+		job->work(job->arg);
+		mg_job_done(job);
+	}
+	offload_wait_tail = NULL;
+}
+
+void mg_skt_stats(void *handle, mg_skt_stats_t *stats)
+{
+	class mg_skt *skt = (class mg_skt*)handle;
+	*stats = skt->stats;
+	stats->handle = handle;
+	stats->fd = skt->fd;
+}
+
+/*
+ * post(): a lock-free stack pushed by any thread and taken whole by the
+ * loop, which runs it oldest first at the end of its pass. Only the post
+ * finding the stack empty wakes the loop up, the others ride along.
+ */
+void mg::post(void (*callback)(void*), void *handle)
+{
+	class mg_post *e = new mg_post;
+	e->callback = callback;
+	e->handle = handle;
+	e->alloc = 1;
+	post_push(e);
+}
+
+void mg::post_push(class mg_post *e)
+{
+	class mg_post *head = post_list.load(memory_order_relaxed);
+	do {
+		e->next = head;
+	} while (!post_list.compare_exchange_weak(head, e, memory_order_release,
+	                                          memory_order_relaxed));
+	if (!head && this != mg_reactor_cur) {
+		/* from its own loop, mg_poll_timeout() sees it before blocking */
+		wake();
+	}
+}
+
+void mg::post_run(void)
+{
+	class mg_post *e = post_list.exchange(NULL, memory_order_acquire);
+	class mg_post *fifo = NULL;
+	while (e) {
+		class mg_post *next = e->next;
+		e->next = fifo;
+		fifo = e;
+		e = next;
+	}
+	while (fifo) {
+		int alloc;
+		e = fifo;
+		fifo = e->next;
+		alloc = e->alloc;
+		stats.posts++;
+		/* a built in record may be gone once its callback returns */
+		e->callback(e->handle);
+		if (alloc) {
+			delete e;
+		}
+	}
+}
+
+void mg::post_drop(void)
+{
+	class mg_post *e = post_list.exchange(NULL, memory_order_acquire);
+	while (e) {
+		class mg_post *next = e->next;
+		if (e->alloc) {
+			delete e;
+		}
+		e = next;
+	}
+}
+
+void mg::wake(void)
+{
+	uint64_t one = 1;
+	if (post_fd[1] < 0) {
+		/* no driver yet */
+		return;
+	}
+	/* EAGAIN: the pipe is full, the loop is woken up anyway */
+	if (write(post_fd[1], &one, post_fd[0] == post_fd[1] ? sizeof(one) : 1) < 0 &&
+	    errno != EAGAIN) {
+		MG_LOG_ERR("mg_wake[%d]: write failed <%s>\n", post_fd[1], strerror(errno));
+	}
+}
+
+static void mg_post_rx(class mg_skt *mg_skt)
+{
+	class mg *mg = (class mg*)mg_skt->params.skt.handle;
+	uint64_t buf[8];
+	/* one read resets an eventfd, a self-pipe is read until empty */
+	while (read(mg_skt->fd, buf, sizeof(buf)) == sizeof(buf));
+	mg->stats.wakeups++;
+	/* the posts themselves run from mg_events_done() */
+}
+
+/* the wakeup fd, watched like a socket but not one of the loop's sockets */
+void mg::post_open(void)
+{
+	mg_skt_param_t p = {};
+#ifdef __linux__
+	post_fd[0] = post_fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	assert(post_fd[0] >= 0);
+#else
+	int r = pipe(post_fd);
+	assert(r == 0);
+	for (int fd : post_fd) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+#endif
+	p.handle = this;
+	post_skt = (class mg_skt*)fd_open(post_fd[0], &p, MG_FD_WAKE);
+	post_skt->stats_unlink();
+	stats.opened--;
+}
+
+/* once the driver is gone */
+void mg::post_close(void)
+{
+	if (!post_skt) {
+		return;
+	}
+	close(post_fd[0]);
+	if (post_fd[1] != post_fd[0]) {
+		close(post_fd[1]);
+	}
+	post_fd[0] = post_fd[1] = -1;
+	skt_free(post_skt);
+	post_skt = NULL;
+}
+
+/* console: not a socket, read as it comes (e.g. line by line from stdin) */
+void *mg::fd_open(int fd, mg_skt_param_t *p, int flags)
+{
+	class mg_skt *skt = skt_new();
+	int r, on = 1;
+	assert(skt);
+	skt->fd = fd;
+	MG_LOG_DBG("mg_fd_open: opening socket %d\n", skt->fd);
+	assert(skt->fd >= 0);
+	skt->params.skt.rx = p->rx;
+	skt->params.skt.close = p->close;
+	skt->params.skt.handle = p->handle;
+	skt->params.skt.rx_buf = p->rx_buf;
+	skt->params.skt.tx_high = p->tx_high;
+	skt->params.skt.tx_low = p->tx_low;
+	skt->params.skt.tx_done = p->tx_done;
+	skt->params.skt.autocork = p->autocork;
+	skt->params.skt.rx_ready = p->rx_ready;
+	skt->params.skt.tx_drained = p->tx_drained;
+	skt->limits_set(p);
+	mg_zc_open(skt, p);
+	if (flags & MG_FD_WAKE) {
+		skt->rx = mg_post_rx;
+	}
+	else if (!(flags & MG_FD_CONSOLE)) {
+		skt->rx = p->rx_ready ? mg_skt_rx_notify : mg_skt_rx;
+		if (!(flags & MG_FD_ACCEPTED)) {
+			/* mg_skt_rx() reads until EAGAIN */
+			fcntl(skt->fd, F_SETFL, fcntl(skt->fd, F_GETFL) | O_NONBLOCK);
+			r = setsockopt(skt->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+			assert(r == 0);
+		}
+		if (p->tx_buf_size) {
+			r = setsockopt(skt->fd, SOL_SOCKET, SO_SNDBUFFORCE,
+			               &p->tx_buf_size, sizeof(p->tx_buf_size));
+			assert(r == 0);
+		}
+		if (p->rx_buf_size) {
+			r = setsockopt(skt->fd, SOL_SOCKET, SO_RCVBUFFORCE,
+			               &p->rx_buf_size, sizeof(p->rx_buf_size));
+			assert(r == 0);
+		}
+	}
+	else {
+		skt->rx = mg_read;
+	}
+	if (skt->fd_add(skt->fd) < 0) {
+		skt->fd_add_failed();
+	}
+	return (void*)skt;
+}
+
+/* accepted sockets are born non-blocking, no fcntl() per connection */
+static int mg_accept_fd(int fd, struct sockaddr *addr, socklen_t *addr_len)
+{
+#ifdef __linux__
+	return accept4(fd, addr, addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	int afd = accept(fd, addr, addr_len);
+	if (afd >= 0) {
+		fcntl(afd, F_SETFL, fcntl(afd, F_GETFL) | O_NONBLOCK);
+		fcntl(afd, F_SETFD, FD_CLOEXEC);
+	}
+	return afd;
+#endif
+}
+
+/*
+ * Out of fds: the pending connection would keep the listener readable
+ * and the loop spinning. Give up the spare fd to accept and drop it.
+ */
+static int mg_accept_shed(class mg_skt *mg_skt)
+{
+	int *spare = mg_skt->spare_fd();
+	if (*spare < 0) {
+		return -1;
+	}
+	close(*spare);
+	int fd = accept(mg_skt->fd, NULL, NULL);
+	if (fd >= 0) {
+		close(fd);
+		mg_skt->stats.accept_drops++;
+	}
+	*spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	return fd;
+}
+
+/* accept until EAGAIN, at most accept_batch (MG_ACCEPT_BUDGET) connections per pass */
+static void mg_accept(class mg_skt *mg_skt)
+{
+	struct sockaddr_storage addr_;
+	struct sockaddr *addr = (struct sockaddr*)&addr_;
+	mg_listen_param_t *lp = &mg_skt->params.listen;
+	uint32_t n, batch = lp->accept_batch ? lp->accept_batch : MG_ACCEPT_BUDGET;
+	for (n = 0; n < batch && !mg_skt->closed && mg_skt->rx_watch; n++) {
+		socklen_t addr_len = sizeof(struct sockaddr_storage);
+		int fd = mg_accept_fd(mg_skt->fd, addr, &addr_len);
+		if (fd < 0) {
+			switch (errno) {
+			case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+			case EWOULDBLOCK:
+#endif
+				return;
+			case EINTR:
+			case ECONNABORTED:
+			case EPROTO:
+				/* this one connection went wrong, carry on */
+				continue;
+			case EMFILE:
+			case ENFILE:
+				MG_LOG_DBG("mg_accept[%d]: out of fds, dropping a connection\n",
+				           mg_skt->fd);
+				if (mg_accept_shed(mg_skt) >= 0) {
+					continue;
+				}
+				return;
+			default:
+				/* e.g. ENOBUFS: try again on the next event */
+				MG_LOG_ERR("mg_accept[%d]: accept failed <%s>\n",
+				           mg_skt->fd, strerror(errno));
+				return;
+			}
+		}
+		void **client_handle;
+		mg_skt_param_t p = {};
+		p.sock_addr = addr;
+		mg_skt->stats.accepts++;
+		if ((client_handle = lp->accept(lp->handle, &p))) {
+			*client_handle = mg_skt->fd_open(fd, &p, MG_FD_ACCEPTED);
+			class mg_skt *c = (class mg_skt*)*client_handle;
+			if (c->unwatched) {
+				/* the driver can't take it: shed, as when out of fds */
+				MG_LOG_DBG("mg_accept[%d]: fd %d can't be watched, dropping a connection\n",
+				           mg_skt->fd, fd);
+				mg_skt->stats.accept_drops++;
+				if (p.close) {
+					p.close(p.handle);
+				}
+				if (!c->closed) {
+					c->skt_close();
+				}
+				continue;
+			}
+			if (p.splice) {
+				mg_skt_splice(*client_handle, p.splice);
+			}
+			if (p.connected) {
+				p.connected(p.handle);
+			}
+		}
+		else {
+			/* refused by the application */
+			close(fd);
+		}
+	}
+	if (n == batch) {
+		mg_skt->rx_requeue();
+	}
+}
+
+mg_base::mg_base(const mg_pool_param_t *pool)
+{
+	class mg *_mg = new mg;
+	if (pool) {
+		_mg->pool_reserve(pool);
+	}
+	priv = (void*)_mg;
+}
+
+mg_base::~mg_base(void)
+{
+	class mg *_mg = (class mg*)priv;
+	for (class mg *r : _mg->reactor_list) {
+		delete r;
+	}
+	delete _mg;
+}
+
+int mg_base::init(std::string poll_drv_name, int reactors)
+{
+	auto it = mg_poll_drv_list.find(poll_drv_name);
+	if (it == mg_poll_drv_list.end()) {
+		MG_LOG_ERR("mg_init: unknown poll driver\n");
+		return -1;
+	}
+	class mg *_mg = (class mg*)priv;
+	_mg->reactor_count = reactors > 1 ? reactors : 1;
+	return _mg->drv_init(it->second);
+}
+
+vector<string> mg_base::drivers(void)
+{
+	vector<string> names;
+	for (auto &it : mg_poll_drv_list) {
+		names.push_back(it.first);
+	}
+	return names;
+}
+
+void mg_base::stop(void)
+{
+	class mg *_mg = (class mg*)priv;
+	_mg->stopping = 1;
+	if (_mg != mg_reactor_cur) {
+		_mg->wake();
+	}
+	for (class mg *r : _mg->reactor_list) {
+		r->stopping = 1;
+		if (r != mg_reactor_cur) {
+			r->wake();
+		}
+	}
+}
+
+void mg_base::post(void (*callback)(void*), void *handle, int reactor)
+{
+	class mg *_mg = (class mg*)priv;
+	if (reactor < 0) {
+		_mg = mg_cur(priv);
+	}
+	else if (reactor > 0) {
+		assert(reactor <= (int)_mg->reactor_list.size());
+		_mg = _mg->reactor_list[reactor - 1];
+	}
+	_mg->post(callback, handle);
+}
+
+void *mg_base::fd_open(int fd, mg_skt_param_t *p)
+{
+	class mg_skt *skt = (class mg_skt*)mg_cur(priv)->fd_open(fd, p);
+	if (p->splice) {
+		mg_skt_splice(skt, p->splice);
+	}
+	return skt;
+}
+
+static class mg_skt *mg_listen_skt(class mg *_mg, mg_listen_param_t *p)
+{
+	class mg_skt *skt = _mg->skt_new();
+	int r, on = 1;
+	assert(skt);
+	assert(p->accept);
+	skt->rx = mg_accept;
+	/* non-blocking, mg_accept() accepts until EAGAIN */
+	skt->fd = socket(p->family, p->type | SOCK_NONBLOCK, p->protocol);
+	assert(skt->fd >= 0);
+	r = setsockopt(skt->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	assert(r == 0);
+	if (_mg->reactor_count > 1) {
+		/* every reactor binds its own copy of the listener */
+		r = setsockopt(skt->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+		assert(r == 0);
+	}
+	if (bind(skt->fd, p->sock_addr, p->slen) < 0) {
+		MG_LOG_ERR("mg_listen_open: bind failed <%s>\n", strerror(errno));
+		assert(0);
+	}
+	skt->params.listen = *p;
+	r = skt->fd_add(skt->fd);
+	assert(r == 0);
+	MG_LOG_DBG("mg_listen_open: opening socket %d\n", skt->fd);
+	r = listen(skt->fd, p->backlog > 0 ? p->backlog : SOMAXCONN);
+	assert(r == 0);
+	return skt;
+}
+
+/* pin the calling thread to a single cpu */
+static void mg_reactor_pin(int cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+		MG_LOG_ERR("mg_reactor_pin: cpu %d <%s>\n", cpu, strerror(errno));
+	}
+#endif
+}
+
+/* body of every reactor, loop 0 runs on the thread calling dispatch() */
+static int mg_reactor_run(class mg *_mg, class mg *mg0, mg_param_t *p, int cpu)
+{
+	int err = 0;
+	mg_reactor_cur = _mg;
+	if (cpu >= 0) {
+		mg_reactor_pin(cpu);
+	}
+	if (_mg != mg0) {
+		for (mg_listen_t l : mg0->listen_list) {
+			l.p.sock_addr = (struct sockaddr*)&l.addr;
+			mg_listen_skt(_mg, &l.p);
+		}
+	}
+	if (p && p->reactor.start) {
+		p->reactor.start(p->reactor.handle, _mg->reactor_id);
+	}
+	while (!err && !_mg->stopping) {
+		err = _mg->poll_drv->wait_for_events();
+	}
+	mg_reactor_cur = NULL;
+	return err;
+}
+
+int mg_base::dispatch(mg_param_t *p)
+{
+	int err;
+	class mg *_mg = (class mg*)priv;
+	vector<int> cpus;
+	if (p && p->console.rx) {
+		/* std_in support requested */
+		mg_skt_param_t pc = {
+			.handle = p->console.handle,
+			.rx = p->console.rx
+		};
+		_mg->console_handle = _mg->fd_open(fileno(stdin), &pc, MG_FD_CONSOLE);
+	}
+#ifdef __linux__
+	if (_mg->reactor_count > 1) {
+		/* spread the reactors over the cpus we are allowed to run on */
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (CPU_ISSET(cpu, &set)) {
+					cpus.push_back(cpu);
+				}
+			}
+		}
+	}
+#endif
+	if (p && p->offload.threads > 0) {
+		_mg->offload = new mg_offload(p->offload.threads, p->offload.queue_max);
+		if (p->offload.skt_max) {
+			_mg->offload_skt_max = p->offload.skt_max;
+		}
+	}
+	/* no reallocation under post() from other threads */
+	_mg->reactor_list.reserve(_mg->reactor_count);
+	for (int i = 1; i < _mg->reactor_count; i++) {
+		class mg *r = new mg;
+		r->offload = _mg->offload;
+		r->offload_skt_max = _mg->offload_skt_max;
+		r->reactor_id = i;
+		r->reactor_count = _mg->reactor_count;
+		r->pool_reserve(&_mg->pool_param);
+		r->drv_init(_mg->poll_drv_reg);
+		_mg->reactor_list.push_back(r);
+		_mg->reactor_threads.push_back(
+		    thread(mg_reactor_run, r, _mg, p,
+		           cpus.empty() ? -1 : cpus[i % cpus.size()]));
+	}
+	err = mg_reactor_run(_mg, _mg, p, cpus.empty() ? -1 : cpus[0]);
+	for (thread &t : _mg->reactor_threads) {
+		t.join();
+	}
+	if (_mg->offload) {
+		delete _mg->offload;
+		_mg->reactor_list.insert(_mg->reactor_list.begin(), _mg);
+		for (class mg *r : _mg->reactor_list) {
+			mg_reactor_cur = r;
+			r->offload_drain();
+			r->offload = NULL;
+		}
+		mg_reactor_cur = NULL;
+		_mg->reactor_list.erase(_mg->reactor_list.begin());
+	}
+	return err;
+}
+
+void *mg_base::listen_open(mg_listen_param_t *p)
+{
+	class mg *_mg = mg_cur(priv);
+	class mg_skt *skt = mg_listen_skt(_mg, p);
+	if (!mg_reactor_cur && _mg->reactor_count > 1) {
+		/* not dispatching yet: remember it for the other reactors */
+		mg_listen_t l;
+		l.p = *p;
+		assert(p->slen <= sizeof(l.addr));
+		memcpy(&l.addr, p->sock_addr, p->slen);
+		_mg->listen_list.push_back(l);
+	}
+	return (void*)skt;
+}
+
+void mg_base::listen_close(void *handle)
+{
+	class mg_skt *mg_skt = (class mg_skt*)handle;
+	mg_skt->skt_close();
+}
+
+void *mg_base::timer_add(void *handle, void (*callback)(void*))
+{
+	return timer_add(handle, callback, 1000, 1);
+}
+
+void *mg_base::timer_add(void *handle, void (*callback)(void*),
+                         uint32_t ms, int periodic)
+{
+	class mg *_mg = mg_cur(priv);
+	class mg_timer_cb *t = new mg_timer_cb();
+	assert(ms || !periodic);
+	t->_mg = _mg;
+	t->callback = callback;
+	t->handle = handle;
+	t->interval = periodic ? ms : 0;
+	_mg->timers.add(t, ms);
+	return (void*)t;
+}
+
+void mg_base::timer_mod(void *handle, uint32_t ms)
+{
+	class mg_timer_cb *t = (class mg_timer_cb*)handle;
+	if (!ms) {
+		t->_mg->timers.cancel(t);
+		return;
+	}
+	if (t->interval) {
+		t->interval = ms;
+	}
+	t->_mg->timers.add(t, ms);
+}
+void mg_base::stats(mg_loop_stats_t *loop, vector<mg_skt_stats_t> *skts)
+{
+	class mg *_mg = mg_cur(priv);
+	*loop = _mg->stats;
+	loop->reactor_id = _mg->reactor_id;
+	loop->timers = _mg->timers.fired;
+	if (skts) {
+		skts->clear();
+	}
+	for (class mg_skt *skt = _mg->skt_list; skt; skt = skt->skt_next) {
+		mg_skt::mg_stats_add(&loop->total, &skt->stats);
+		if (skts) {
+			mg_skt_stats_t s;
+			mg_skt_stats(skt, &s);
+			skts->push_back(s);
+		}
+	}
+}
+
+int mg_base::hist(mg_hist_t *h)
+{
+#if MG_HIST
+	class mg *_mg = mg_cur(priv);
+	memcpy(h, _mg->hist, sizeof(_mg->hist));
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+void mg_base::hist_slow(uint32_t us)
+{
+#if MG_HIST
 	class mg *_mg = (class mg*)priv;
+	_mg->slow_ns = (uint64_t)us * 1000;
+	for (class mg *r : _mg->reactor_list) {
+		r->slow_ns = _mg->slow_ns;
+	}
+#endif
+}
+
+void *mg_base::pool_get(size_t size)
+{
+	return mg_cur(priv)->pool_get(size);
+}
+
+void mg_base::pool_put(void *p, size_t size)
+{
+	mg_cur(priv)->pool_put(p, size);
+}
+
+void mg_base::timer_del(void *handle)
+{
 	class mg_timer_cb *t = (class mg_timer_cb*)handle;
-	_mg->timer_cb_list.erase(t);
+	t->_mg->timers.cancel(t);
 	delete t;
 }
+
+/*
+ * Hot restart: sockets go to another process over a connected AF_UNIX
+ * stream socket, one message each: a header carrying the fd with
+ * SCM_RIGHTS, then the application's bytes, then the unsent data. The
+ * receiver acknowledges each socket once it has all of it, only then is
+ * the sender's copy closed.
+ */
+#define MG_HANDOFF_MAGIC 0x6d67686f	// "mgho"
+#define MG_HANDOFF_ACK   'k'
+
+enum {
+	MG_HANDOFF_END,
+	MG_HANDOFF_LISTENER,
+	MG_HANDOFF_STREAM
+};
+
+typedef struct {
+	uint32_t magic;
+	uint32_t kind;
+	uint32_t app_len;
+	uint32_t addr_len;
+	uint64_t tx_len;
+	uint64_t rx_len;	// read but not delivered yet
+	struct sockaddr_storage addr;	// listener: where it is bound
+} mg_handoff_hdr_t;
+
+/*
+ * The loop is blocked meanwhile: give up on a process that makes no
+ * progress for MG_HANDOFF_TIMEOUT_MS, errno is then ETIMEDOUT.
+ */
+static int mg_handoff_wait(int fd, short events)
+{
+	struct pollfd pfd = { fd, events, 0 };
+	int r;
+	while ((r = poll(&pfd, 1, MG_HANDOFF_TIMEOUT_MS)) < 0 && errno == EINTR);
+	if (r == 0) {
+		MG_LOG_ERR("mg_handoff[%d]: no progress in %d ms\n", fd, MG_HANDOFF_TIMEOUT_MS);
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * All of len bytes over the unix socket: blocking or not, each wait goes
+ * through mg_handoff_wait().
+ */
+static int mg_handoff_io(int fd, void *buf, size_t len, int wr)
+{
+	unsigned char *p = (unsigned char*)buf;
+	while (len) {
+		ssize_t l = wr ? send(fd, p, len, MSG_NOSIGNAL | MSG_DONTWAIT) :
+		            recv(fd, p, len, MSG_DONTWAIT);
+		if (l < 0 && (errno == EINTR || errno == EAGAIN)) {
+			if (mg_handoff_wait(fd, wr ? POLLOUT : POLLIN) < 0) {
+				return -1;
+			}
+			continue;
+		}
+		if (l <= 0) {
+			MG_LOG_ERR("mg_handoff[%d]: %s failed <%s>\n", fd, wr ? "write" : "read",
+			           l < 0 ? strerror(errno) : "closed");
+			return -1;
+		}
+		p += l;
+		len -= l;
+	}
+	return 0;
+}
+
+/* header, with fd attached unless it is -1 */
+static int mg_handoff_hdr_send(int unix_fd, mg_handoff_hdr_t *h, int fd)
+{
+	union {
+		struct cmsghdr c;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+	struct iovec iov = { h, sizeof(*h) };
+	struct msghdr msg = {};
+	ssize_t l;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0) {
+		memset(&cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf.buf;
+		msg.msg_controllen = sizeof(cbuf.buf);
+		struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(c), &fd, sizeof(int));
+	}
+	while ((l = sendmsg(unix_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0) {
+		if (errno != EINTR && errno != EAGAIN) {
+			MG_LOG_ERR("mg_handoff[%d]: sendmsg failed <%s>\n", unix_fd, strerror(errno));
+			return -1;
+		}
+		if (mg_handoff_wait(unix_fd, POLLOUT) < 0) {
+			return -1;
+		}
+	}
+	/* the fd went with the first byte, the rest is plain data */
+	return mg_handoff_io(unix_fd, (unsigned char*)h + l, sizeof(*h) - l, 1);
+}
+
+/*
+ * The receiver's acknowledgement, until which the socket is still ours.
+ * On a timeout the unix socket is shut down first: the receiver can't
+ * send it any more and drops what it got, one sent before is still read.
+ */
+static int mg_handoff_ack(int unix_fd)
+{
+	unsigned char ack = 0;
+	if (mg_handoff_io(unix_fd, &ack, 1, 0) < 0) {
+		if (errno != ETIMEDOUT) {
+			return -1;
+		}
+		shutdown(unix_fd, SHUT_RDWR);
+		if (recv(unix_fd, &ack, 1, MSG_DONTWAIT) != 1) {
+			return -1;
+		}
+	}
+	if (ack != MG_HANDOFF_ACK) {
+		MG_LOG_ERR("mg_skt_handoff[%d]: bad acknowledgement\n", unix_fd);
+		return -1;
+	}
+	return 0;
+}
+
+/* read len bytes out of a splice pipe, which holds at least that many */
+static void mg_handoff_pipe(int fd, unsigned char *buf, size_t len)
+{
+	if (len && read(fd, buf, len) != (ssize_t)len) {
+		memset(buf, 0, len);
+	}
+}
+
+int mg_skt_handoff(void *handle, int unix_fd, const void *app, uint32_t app_len)
+{
+	class mg_skt *skt = (class mg_skt*)handle;
+	mg_handoff_hdr_t h;
+	unsigned char *tx = NULL;
+	int type = 0, synced, r;
+	socklen_t len = sizeof(type);
+	if (app_len > MG_HANDOFF_APP_MAX || skt->closed || skt->linger || skt->connecting ||
+	        skt->job_len || skt->rx == mg_read || skt->dgram_rx || skt->dgq_head ||
+	        skt->txq_len + mg_splice_pending(skt) > MG_HANDOFF_TX_MAX ||
+	        getsockopt(skt->fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_STREAM) {
+		/* not something that can be handed over, still ours */
+		return -1;
+	}
+	/* a completion read still in the kernel: its data goes along */
+	synced = skt->rx_sync(0);
+	memset(&h, 0, sizeof(h));
+	h.magic = MG_HANDOFF_MAGIC;
+	h.app_len = app_len;
+	if (skt->rx == mg_accept) {
+		h.kind = MG_HANDOFF_LISTENER;
+		len = sizeof(h.addr);
+		getsockname(skt->fd, (struct sockaddr*)&h.addr, &len);
+		h.addr_len = len;
+	}
+	else {
+		/* whatever is queued for it, then what its splice peer read for it */
+		size_t pending = mg_splice_pending(skt);
+		h.kind = MG_HANDOFF_STREAM;
+		h.tx_len = skt->txq_len + pending;
+		h.rx_len = skt->rx_held_len;
+		if (h.tx_len) {
+			unsigned char *p = tx = (unsigned char*)malloc(h.tx_len);
+			assert(tx);
+			for (class mg_txq_ent *e = skt->txq_head; e; e = e->next) {
+				memcpy(p, e->base + e->rd, e->wr - e->rd);
+				p += e->wr - e->rd;
+			}
+			if (pending) {
+				mg_splice_t *sp = skt->splice->peer->splice;
+				mg_handoff_pipe(sp->pipe[0], p, pending);
+				sp->len = 0;
+			}
+		}
+	}
+	r = mg_handoff_hdr_send(unix_fd, &h, skt->fd);
+	if (!r && app_len) {
+		r = mg_handoff_io(unix_fd, (void*)app, app_len, 1);
+	}
+	if (!r && h.tx_len) {
+		r = mg_handoff_io(unix_fd, tx, h.tx_len, 1);
+	}
+	if (!r && h.rx_len) {
+		r = mg_handoff_io(unix_fd, skt->rx_held->data + skt->rx_held_off, h.rx_len, 1);
+	}
+	if (!r) {
+		/* whatever the kernel buffered is lost if the receiver dies first */
+		r = mg_handoff_ack(unix_fd);
+	}
+	if (r) {
+		/*
+		 * Shut down, so that no acknowledgement can follow: the receiver
+		 * drops what it got of the message, fd included. The socket
+		 * stays ours, with what was taken out of the splice pipe queued
+		 * after its own data.
+		 */
+		shutdown(unix_fd, SHUT_RDWR);
+		size_t pending = h.tx_len - skt->txq_len, max = skt->txq_max;
+		if (pending) {
+			skt->txq_max = SIZE_MAX;
+			mg_skt_tx(skt, tx + skt->txq_len, pending);
+			skt->txq_max = max;
+		}
+		free(tx);
+		if (synced) {
+			skt->rx_rearm();
+		}
+		if (skt->rx_held) {
+			skt->rx_resume();
+		}
+		return -2;
+	}
+	free(tx);
+	if (skt->splice && skt->splice->len && skt->splice->peer) {
+		/* read from it for the peer, which stays here: queue it there */
+		size_t l = skt->splice->len;
+		unsigned char *buf = (unsigned char*)malloc(l);
+		assert(buf);
+		mg_handoff_pipe(skt->splice->pipe[0], buf, l);
+		skt->splice->len = 0;
+		if (mg_skt_tx(skt->splice->peer, buf, l) < 0) {
+			MG_LOG_ERR("mg_skt_handoff[%d]: %zu bytes for %d dropped\n", skt->fd, l,
+			           skt->splice->peer->fd);
+		}
+		free(buf);
+	}
+	/* handed over, not to be sent from here */
+	skt->txq_release();
+	skt->skt_close();
+	return 0;
+}
+
+int mg_handoff_end(int unix_fd)
+{
+	mg_handoff_hdr_t h;
+	memset(&h, 0, sizeof(h));
+	h.magic = MG_HANDOFF_MAGIC;
+	h.kind = MG_HANDOFF_END;
+	return mg_handoff_hdr_send(unix_fd, &h, -1);
+}
+
+int mg_handoff_recv(int unix_fd, mg_handoff_t *h)
+{
+	union {
+		struct cmsghdr c;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+	mg_handoff_hdr_t hdr;
+	struct iovec iov = { &hdr, sizeof(hdr) };
+	struct msghdr msg = {};
+	ssize_t l;
+	memset(h, 0, sizeof(*h));
+	h->fd = -1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+	while ((l = recvmsg(unix_fd, &msg, MSG_DONTWAIT)) < 0) {
+		if (errno != EINTR && errno != EAGAIN) {
+			MG_LOG_ERR("mg_handoff_recv[%d]: recvmsg failed <%s>\n", unix_fd, strerror(errno));
+			return -1;
+		}
+		if (mg_handoff_wait(unix_fd, POLLIN) < 0) {
+			return -1;
+		}
+	}
+	if (l == 0) {
+		MG_LOG_ERR("mg_handoff_recv[%d]: closed before the end\n", unix_fd);
+		return -1;
+	}
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+		memcpy(&h->fd, CMSG_DATA(c), sizeof(int));
+		fcntl(h->fd, F_SETFD, FD_CLOEXEC);
+	}
+	if ((size_t)l < sizeof(hdr) &&
+	        mg_handoff_io(unix_fd, (unsigned char*)&hdr + l, sizeof(hdr) - l, 0) < 0) {
+		goto fail;
+	}
+	if (hdr.magic != MG_HANDOFF_MAGIC || hdr.app_len > MG_HANDOFF_APP_MAX ||
+	        hdr.addr_len > sizeof(h->addr) || hdr.tx_len > MG_HANDOFF_TX_MAX ||
+	        hdr.rx_len > MG_RXB_SIZE) {
+		MG_LOG_ERR("mg_handoff_recv[%d]: bad message\n", unix_fd);
+		goto fail;
+	}
+	if (hdr.kind == MG_HANDOFF_END) {
+		return 0;
+	}
+	if (h->fd < 0) {
+		goto fail;
+	}
+	h->listener = hdr.kind == MG_HANDOFF_LISTENER;
+	memcpy(&h->addr, &hdr.addr, hdr.addr_len);
+	h->addr_len = hdr.addr_len;
+	h->app_len = hdr.app_len;
+	if (mg_handoff_io(unix_fd, h->app, h->app_len, 0) < 0) {
+		goto fail;
+	}
+	if (hdr.tx_len) {
+		h->tx = (unsigned char*)malloc(hdr.tx_len);
+		assert(h->tx);
+		h->tx_len = hdr.tx_len;
+		if (mg_handoff_io(unix_fd, h->tx, h->tx_len, 0) < 0) {
+			goto fail;
+		}
+	}
+	if (hdr.rx_len) {
+		h->rx = (unsigned char*)malloc(hdr.rx_len);
+		assert(h->rx);
+		h->rx_len = hdr.rx_len;
+		if (mg_handoff_io(unix_fd, h->rx, h->rx_len, 0) < 0) {
+			goto fail;
+		}
+	}
+	{
+		/* ours once the sender knows, it then closes its copy */
+		unsigned char ack = MG_HANDOFF_ACK;
+		if (mg_handoff_io(unix_fd, &ack, 1, 1) < 0) {
+			/* the sender gave up on it and keeps serving it */
+			goto fail;
+		}
+	}
+	return 1;
+fail:
+	if (h->fd >= 0) {
+		close(h->fd);
+		h->fd = -1;
+	}
+	free(h->tx);
+	h->tx = NULL;
+	free(h->rx);
+	h->rx = NULL;
+	return -1;
+}
+
+void *mg_base::skt_adopt(mg_handoff_t *h, mg_skt_param_t *p)
+{
+	assert(!h->listener && h->fd >= 0);
+	class mg_skt *skt = (class mg_skt*)fd_open(h->fd, p);
+	if (h->tx_len) {
+		/* queued again ahead of anything new, whatever its size */
+		if (h->tx_len > skt->txq_max) {
+			skt->txq_max = h->tx_len;
+		}
+		mg_skt_tx(skt, h->tx, h->tx_len);
+	}
+	if (h->rx_len) {
+		/* delivered before anything read from here on */
+		class mg_rxb *b = skt->rxb_get();
+		memcpy(b->data, h->rx, h->rx_len);
+		skt->rx_hold(b, h->rx_len);
+		skt->rx_resume();
+	}
+	free(h->tx);
+	h->tx = NULL;
+	h->tx_len = 0;
+	free(h->rx);
+	h->rx = NULL;
+	h->rx_len = 0;
+	h->fd = -1;
+	return skt;
+}
+
+void *mg_base::listen_adopt(mg_handoff_t *h, mg_listen_param_t *p)
+{
+	class mg *_mg = mg_cur(priv);
+	class mg_skt *skt = _mg->skt_new();
+	int r, on = 0;
+	socklen_t len = sizeof(on);
+	assert(h->listener && h->fd >= 0);
+	assert(p->accept);
+	skt->rx = mg_accept;
+	skt->fd = h->fd;
+	fcntl(skt->fd, F_SETFL, fcntl(skt->fd, F_GETFL) | O_NONBLOCK);
+	skt->params.listen = *p;
+	r = skt->fd_add(skt->fd);
+	assert(r == 0);
+	MG_LOG_DBG("mg_listen_adopt: socket %d\n", skt->fd);
+	if (!mg_reactor_cur && _mg->reactor_count > 1 &&
+	        getsockopt(skt->fd, SOL_SOCKET, SO_REUSEPORT, &on, &len) == 0 && on) {
+		/* the other reactors bind copies of their own, as for listen_open() */
+		mg_listen_t l;
+		l.p = *p;
+		l.p.family = h->addr.ss_family;
+		l.p.type = SOCK_STREAM;
+		l.p.slen = h->addr_len;
+		memcpy(&l.addr, &h->addr, h->addr_len);
+		_mg->listen_list.push_back(l);
+	}
+	h->fd = -1;
+	return skt;
+}
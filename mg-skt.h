@@ -25,9 +25,21 @@
 #ifndef __MG_SKT_H__
 #define __MG_SKT_H__
 
+#include <stdint.h>
+#include <sys/socket.h>
 #include <string>
+#include <vector>
 
 struct sockaddr;
+struct iovec;
+
+/* one datagram of a batch */
+typedef struct {
+	struct sockaddr *addr;	// source on rx, destination on tx (NULL if connected)
+	socklen_t addr_len;
+	unsigned char *buf;
+	int len;
+} mg_dgram_t;
 
 typedef struct {
 	void *handle;
@@ -42,6 +54,66 @@ typedef struct {
 	socklen_t slen;
 	uint32_t tx_buf_size;
 	uint32_t rx_buf_size;
+	void *splice;	// socket to mg_skt_splice() with once this one is open
+	uint32_t tx_queue_max;	// unsent bytes mg_skt_tx() may queue, 0 = 4MB
+	uint32_t rx_budget;	// bytes read per loop pass before yielding, 0 = 64KB
+	/*
+	 * Datagram sockets are read with recvmmsg() into buffers allocated
+	 * once per socket, each batch is handed to rx_batch. Without rx_batch
+	 * every datagram goes to rx on its own.
+	 */
+	void (*rx_batch)(void*, mg_dgram_t*, int);
+	uint32_t rx_batch_size;	// datagrams per recvmmsg(), 0 = 32
+	uint32_t rx_dgram_size;	// largest datagram, longer ones are dropped, 0 = 5000
+	/*
+	 * Stream sockets: read into pooled, refcounted buffers and hand them
+	 * to rx_buf instead of rx. buf is the buffer's handle, the data is
+	 * only valid during the call unless held with mg_buf_hold(), e.g. to
+	 * forward it with mg_skt_tx_buf().
+	 */
+	void (*rx_buf)(void*, void *buf, unsigned char*, int);
+	/*
+	 * Tx flow control: tx_high is called when the tx queue grows past
+	 * tx_high_mark bytes, tx_low once mg_dequeue() has drained it back
+	 * to tx_low_mark, e.g. to pause and resume the socket feeding this
+	 * one. Marks of 0 = 256KB / 64KB.
+	 */
+	void (*tx_high)(void*);
+	void (*tx_low)(void*);
+	uint32_t tx_high_mark;
+	uint32_t tx_low_mark;
+	/*
+	 * mg_skt_tx_zc() sends of zerocopy_min bytes or more use MSG_ZEROCOPY
+	 * (Linux, TCP), 0 = off. tx_done tells when such a buffer is free.
+	 */
+	uint32_t zerocopy_min;
+	void (*tx_done)(void*, void *ctx);
+	/*
+	 * Stream sockets: mg_skt_tx() and friends only queue, everything
+	 * queued during a loop pass goes out in one writev() at its end.
+	 */
+	int autocork;
+	/*
+	 * connect_addr: called from the loop once the connection is up. A
+	 * connect that fails is reported by close. Accepted sockets: called
+	 * once the accept callback's handle has been filled in, or close is
+	 * called instead if the poll driver can't watch it (select: fds past
+	 * FD_SETSIZE) and the connection is dropped.
+	 */
+	void (*connected)(void*);
+	/*
+	 * Stream sockets: nothing is read by the library, rx_ready is called
+	 * when the socket is readable and the application reads it with
+	 * mg_skt_recv() into buffers of its own. Called again on the next
+	 * pass until mg_skt_recv() finds it drained, unless paused. The peer
+	 * closing is seen by mg_skt_recv(), close is not called.
+	 */
+	void (*rx_ready)(void*);
+	/*
+	 * the tx queue has been written out, nothing is left to send. Not
+	 * called if a write failed, close is.
+	 */
+	void (*tx_drained)(void*);
 } mg_skt_param_t;
 
 typedef struct {
@@ -52,32 +124,320 @@ typedef struct {
 	struct sockaddr *sock_addr;
 	socklen_t slen;
 	int protocol;
+	int backlog;		// listen() queue length, 0 = SOMAXCONN
+	uint32_t accept_batch;	// connections accepted per pass, 0 = 64
 } mg_listen_param_t;
 
+/*
+ * Counters of a socket. They are plain integers updated by the socket's
+ * loop, so read them from that loop (e.g. from its callbacks) for exact
+ * values.
+ */
+typedef struct {
+	void *handle;		// socket handle, in mg_base::stats() snapshots
+	int fd;
+	uint64_t rx_events;	// readable events
+	uint64_t rx_reads;	// reads returning data (datagrams, for batches)
+	uint64_t rx_bytes;
+	uint64_t rx_requeues;	// times the rx budget ran out
+	uint64_t rx_pauses;	// mg_skt_rx_pause() calls
+	uint64_t tx_events;	// writable events
+	uint64_t tx_writes;	// writes that sent data
+	uint64_t tx_bytes;
+	uint64_t tx_eagain;	// writes that found the socket full
+	uint64_t tx_queued;	// bytes that had to be queued
+	uint64_t tx_full;	// sends rejected, tx queue full
+	uint64_t tx_watch;	// tx_watch switched on
+	uint64_t tx_zc;		// MSG_ZEROCOPY sends
+	uint64_t tx_zc_copied;	// completions the kernel copied anyway
+	uint64_t txq_len;	// bytes queued now
+	uint64_t txq_hwm;	// most bytes ever queued
+	uint64_t accepts;	// listeners: connections accepted
+	uint64_t accept_drops;	// listeners: connections shed, out of fds
+	uint64_t tx_dropped;	// bytes still queued when skt_close() was called
+} mg_skt_stats_t;
+
+/* counters of an event loop */
+typedef struct {
+	int reactor_id;
+	uint64_t waits;		// wait_for_events() passes
+	uint64_t timers;	// timer callbacks run
+	uint64_t sockets;	// open now
+	uint64_t opened;	// sockets opened so far
+	uint64_t posts;		// post() callbacks run
+	uint64_t wakeups;	// woken up by post() or stop()
+	uint64_t offloads;	// mg_skt_offload() jobs
+	uint64_t offload_full;	// jobs that found every pool queue full
+	mg_skt_stats_t total;	// sum over all sockets, closed ones included
+} mg_loop_stats_t;
+
+/*
+ * Event loop histograms, only recorded when built with MG_HIST=1 (make
+ * HIST=1). Log-linear bins, HDR style: values below 16 are exact, above
+ * that each power of 2 is split into 16 bins, i.e. within ~6%.
+ */
+enum {
+	MG_HIST_WAIT,		// ns blocked in the kernel per wakeup
+	MG_HIST_EVENTS,		// events per wakeup
+	MG_HIST_BATCH,		// ns processing a wakeup, timers included
+	MG_HIST_RX,		// ns per rx callback
+	MG_HIST_TX,		// ns per dequeue of a writable socket
+	MG_HIST_ACCEPT,		// ns per accept pass of a listener
+	MG_HIST_TIMER,		// ns per pass running due timers
+	MG_HIST_COUNT
+};
+#define MG_HIST_SUB_BITS 4
+#define MG_HIST_MAX_BITS 44	// larger values land in the last bin
+#define MG_HIST_BINS     ((MG_HIST_MAX_BITS - MG_HIST_SUB_BITS + 1) << MG_HIST_SUB_BITS)
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t slow;		// callbacks over the hist_slow() threshold
+	uint64_t bins[MG_HIST_BINS];
+} mg_hist_t;
+
+/* upper bound of the bin holding the pct percentile (0..100) */
+uint64_t mg_hist_pct(const mg_hist_t *h, double pct);
+
 typedef struct {
 	struct {
 		void (*rx)(void*, struct sockaddr *, unsigned char*, int);
 		void *handle;
 	} console;
+	struct {
+		/* called on each reactor thread (id 0..n-1) before its loop starts */
+		void (*start)(void*, int);
+		void *handle;
+	} reactor;
+	/* thread pool shared by every loop for mg_skt_offload(), threads 0 = none */
+	struct {
+		int threads;
+		uint32_t queue_max;	// jobs per worker queue, 0 = default
+		uint32_t skt_max;	// jobs of a socket in flight before its rx is paused, 0 = default
+	} offload;
 } mg_param_t;
 
+#define MG_HANDOFF_APP_MAX 256
+#define MG_HANDOFF_TX_MAX  (64 << 20)	// unsent bytes that may go along with a socket
+#define MG_HANDOFF_TIMEOUT_MS 1000	// longest wait on the other process
+
+/*
+ * A socket handed over by another process (hot restart), see
+ * mg_skt_handoff(). Adopted with mg_base::listen_adopt() or skt_adopt().
+ */
+typedef struct {
+	int fd;
+	int listener;		// listen socket, else a connected stream socket
+	struct sockaddr_storage addr;	// listener: where it is bound
+	socklen_t addr_len;
+	uint32_t app_len;
+	unsigned char app[MG_HANDOFF_APP_MAX];	// as given to mg_skt_handoff()
+	unsigned char *tx;	// unsent data, queued again by skt_adopt()
+	size_t tx_len;
+	unsigned char *rx;	// read but not delivered, first in line after skt_adopt()
+	size_t rx_len;
+} mg_handoff_t;
+
+/*
+ * Objects preallocated for each event loop. Sockets, tx queue chunks and
+ * pool_get() records come from per-loop slab pools, these only size the
+ * first slabs; the pools grow as needed.
+ */
+typedef struct {
+	uint32_t skts;		// sockets, listeners included
+	uint32_t tx_chunks;	// 16KB tx queue chunks
+	uint32_t app_size;	// application records of app_size bytes
+	uint32_t app_count;
+} mg_pool_param_t;
+
 class mg_base {
 public:
-	mg_base();
-	int init(std::string);
+	mg_base(const mg_pool_param_t *pool = NULL);
+	/* sockets, listeners and timers are to be closed before */
+	~mg_base();
+	/*
+	 * reactors > 1 runs that many event loops, one thread per loop pinned
+	 * to its own CPU. Each loop gets its own SO_REUSEPORT copy of every
+	 * listen_open() socket, so the kernel spreads accepts over the loops.
+	 * Sockets and timers opened from a callback belong to the calling
+	 * loop; those opened before dispatch() belong to loop 0.
+	 */
+	int init(std::string, int reactors = 1);	// -1 if no such driver
+	/* names of the poll drivers init() accepts */
+	static std::vector<std::string> drivers(void);
 	int dispatch(mg_param_t*);
+	/*
+	 * Make dispatch() return, from any thread: the loops are woken up and
+	 * stop once the callbacks of their current pass are done.
+	 */
+	void stop(void);
+	/*
+	 * Run callback(handle) on a loop, from any thread: on the given
+	 * reactor once it has started, by default on the calling loop or on
+	 * loop 0 from outside dispatch(). Posted callbacks run in posting
+	 * order at the end of the loop's pass; a burst of posts only wakes
+	 * the loop up once. Posts still queued when the mg_base is deleted
+	 * are dropped.
+	 */
+	void post(void (*callback)(void*), void *handle, int reactor = -1);
 	void *listen_open(mg_listen_param_t *p);
 	void listen_close(void*);
 	void *skt_open(mg_skt_param_t *p);
+	/* take over an already open socket, e.g. one end of a socketpair() */
+	void *fd_open(int fd, mg_skt_param_t *p);
+	/* at once: data still queued is dropped, and counted in tx_dropped */
 	void skt_close(void*);
+	/*
+	 * Graceful close: the handle is released at once, no callbacks but
+	 * tx_done come any more. The queued data is written out, then the
+	 * socket is shut down for writing and closed once the peer has shut
+	 * down its side, or after 30 seconds.
+	 */
+	void skt_linger(void*);
+	/*
+	 * Take over a socket received with mg_handoff_recv(), on the calling
+	 * loop. A stream socket gets its unsent data queued again, p as for
+	 * fd_open(); a listener is served with p's handle, accept and limits,
+	 * and by the other reactors too if it was bound with SO_REUSEPORT.
+	 */
+	void *skt_adopt(mg_handoff_t *h, mg_skt_param_t *p);
+	void *listen_adopt(mg_handoff_t *h, mg_listen_param_t *p);
+	/* 1 second periodic timer */
 	void *timer_add(void *handle, void (*callback)(void*));
+	/*
+	 * Millisecond timer, periodic or one-shot. A one-shot timer stays
+	 * allocated after it fires, so it can be re-armed with timer_mod(),
+	 * until timer_del(). timer_mod() with 0 ms stops the timer.
+	 */
+	void *timer_add(void *handle, void (*callback)(void*), uint32_t ms, int periodic);
+	void timer_mod(void *timer, uint32_t ms);
 	void timer_del(void*);
+	/*
+	 * Snapshot of the calling loop's counters and, if skts is not NULL,
+	 * of every socket open on it. From outside dispatch(), loop 0.
+	 */
+	void stats(mg_loop_stats_t *loop, std::vector<mg_skt_stats_t> *skts);
+	/*
+	 * Copy of the calling loop's MG_HIST_COUNT histograms, -1 if built
+	 * without MG_HIST.
+	 */
+	int hist(mg_hist_t *h);
+	/* log and count callbacks taking longer than us, 0 = off */
+	void hist_slow(uint32_t us);
+	/*
+	 * Allocate from / free to the calling loop's pools, e.g. connection
+	 * records, size classes up to 1KB and malloc() above that. Free on the
+	 * loop that allocated, with the same size.
+	 */
+	void *pool_get(size_t size);
+	void pool_put(void *p, size_t size);
 private:
 	/* hide all the private stuff here! */
 	void *priv;
 };
 
+/*
+ * Whatever can't be written straight away is queued, up to the socket's
+ * tx_queue_max. Returns -1 if the unwritten part would overflow the
+ * queue, in which case it is dropped.
+ */
 int mg_skt_tx(void *handle, unsigned char *buf, int len);
+/* as mg_skt_tx(), gathering the buffers into a single writev() */
+int mg_skt_txv(void *handle, const struct iovec *iov, int iovcnt);
+/* autocork sockets: write out what is queued now, not at the end of the pass */
+void mg_skt_flush(void *handle);
+/* bytes queued, not written yet */
+size_t mg_skt_tx_queued(void *handle);
+/*
+ * rx_ready sockets: read up to len bytes into buf. Returns the number of
+ * bytes read, 0 if the peer closed or on error (see mg_skt_error()), -1
+ * if there is nothing to read now.
+ */
+int mg_skt_recv(void *handle, void *buf, int len);
+/*
+ * Send a batch of datagrams, each to its own addr, with sendmmsg().
+ * What the socket can't take now is queued, up to tx_queue_max, and
+ * flushed when it becomes writable. Returns the number of datagrams sent
+ * or queued, the remaining ones are dropped.
+ */
+int mg_skt_tx_dgram(void *handle, const mg_dgram_t *dgram, int n);
+/*
+ * As mg_skt_tx(), for len bytes at data inside an rx_buf buffer: the part
+ * that can't be written straight away is queued by reference, holding
+ * the buffer until it is sent, instead of being copied.
+ */
+int mg_skt_tx_buf(void *handle, void *buf, unsigned char *data, int len);
+/*
+ * Zero-copy send of a buffer that is left untouched until tx_done(ctx)
+ * is called: once the kernel has finished with it, or when the socket is
+ * closed. Returns 0 if so, -1 if the tx queue is full, 1 if the data was
+ * copied instead, e.g. below zerocopy_min, and buf is free straight away
+ * (tx_done is not called).
+ */
+int mg_skt_tx_zc(void *handle, unsigned char *buf, int len, void *ctx);
+/* keep / drop an rx_buf buffer, on the loop that read it */
+void mg_buf_hold(void *buf);
+void mg_buf_release(void *buf);
 int mg_skt_fd(void *handle);
+/*
+ * From the close callback: errno of the failed connect, read or write
+ * that closed the socket, 0 if the peer closed it. Set as soon as the
+ * write fails, the close callback follows on the next pass.
+ */
+int mg_skt_error(void *handle);
+/*
+ * Run work(job) on the offload pool, then done(job, handle) back on the
+ * socket's loop, where it may send on the socket. The done callbacks of
+ * a socket run in the order its jobs were submitted; handle is NULL if
+ * the socket was closed meanwhile. Reading from the socket is paused
+ * while skt_max of its jobs are in flight, or while the pool queues are
+ * full, and resumed once half of them are done. Without a pool both run
+ * straight away.
+ */
+void mg_skt_offload(void *handle, void (*work)(void*), void (*done)(void*, void*), void *job);
+/*
+ * Hot restart: hand a listener or a connected stream socket over to
+ * another process through unix_fd, a connected AF_UNIX stream socket,
+ * with app_len (up to MG_HANDOFF_APP_MAX) bytes of the application's own
+ * description of it. Its unsent data goes along, so does what a splice
+ * peer has read for it, while what it read for its peer is queued on the
+ * peer. The socket is then closed here, without the close callback; the
+ * connection lives on in the receiver. Blocks until the receiver has
+ * confirmed it has the socket, each wait on it bounded by
+ * MG_HANDOFF_TIMEOUT_MS. Returns 0 once handed over, -1 if it can't be
+ * (datagram, console, connecting, closing, with offload jobs in flight
+ * or over MG_HANDOFF_TX_MAX bytes unsent), -2 if unix_fd failed, the
+ * receiver went away or timed out, after which unix_fd is shut down and
+ * of no more use. On error the socket is left open and still the
+ * caller's.
+ */
+int mg_skt_handoff(void *handle, int unix_fd, const void *app, uint32_t app_len);
+/* tell the receiver every socket has been sent */
+int mg_handoff_end(int unix_fd);
+/*
+ * Receiving side, blocking, up to MG_HANDOFF_TIMEOUT_MS per wait: 1 with
+ * the next socket in h, which the sender no longer uses, 0 once the
+ * sender is done, -1 on error, including a socket the sender gave up on.
+ */
+int mg_handoff_recv(int unix_fd, mg_handoff_t *h);
+/*
+ * Stop / restart reading from a socket: its read interest is dropped
+ * from the poll driver, nothing is read or accepted until resumed. The
+ * library's own pauses, e.g. while mg_skt_offload() jobs pile up, are
+ * kept apart: reading resumes once neither holds it.
+ */
+void mg_skt_rx_pause(void *handle);
+void mg_skt_rx_resume(void *handle);
+void mg_skt_stats(void *handle, mg_skt_stats_t *stats);
+/*
+ * Forward everything read from either socket to the other one with
+ * splice(), without copying through user space. The rx callbacks are no
+ * longer called; when one side closes, its pending data is delivered
+ * first and then its close callback is called as usual. Returns -1 if
+ * not supported, in which case the rx callbacks stay in charge.
+ */
+int mg_skt_splice(void *handle_a, void *handle_b);
 
 #endif // __MG_SKT_H__
@@ -0,0 +1,521 @@
+/*
+
+    COPYRIGHT AND PERMISSION NOTICE
+    Copyright (c) 2019-2020 Mark Griffiths
+    All rights reserved.
+    Permission to use, copy, modify, and distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+    OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+    USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the name of a copyright holder shall
+    not be used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization of the
+    copyright holder.
+
+    mg-skt poll driver benchmarks.
+
+	Drives the library over loopback TCP and socketpairs, one driver at a
+	time, on a single event loop running both ends of every connection:
+	- accept:     connections/sec through listen_open() and accept
+	- throughput: messages/sec and bytes/sec through mg_skt_tx()
+	- round trip: p50 / p99 / p999 ping-pong latency
+	- idle fds:   round trip cost with 10 .. 10000 idle fds registered
+	- post:       post() callbacks/sec from other threads, and posts
+	              run per loop wakeup
+
+	usage: mg-skt-bench [driver ...]	(default: every registered driver)
+
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "mg-skt.h"
+
+#define BENCH_MS          1000		// duration of each timed run
+#define BENCH_ACCEPT_N    10000		// connections per accept run
+#define BENCH_ACCEPT_WIN  64		// connections in flight, below the listen backlog
+#define BENCH_BURST       65536		// bytes per throughput burst
+#define BENCH_RTT_SIZE    64
+#define BENCH_RTT_MAX     1000000	// samples kept per run
+#define BENCH_IDLE_RTTS   20000		// round trips per idle fd run
+#define BENCH_POST_THREADS 4
+#define BENCH_POST_N      500000		// posts per thread
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* a fresh library instance for every run */
+static mg_base *bench_mg_open(const std::string &drv)
+{
+	mg_base *mg = new mg_base;
+	if (mg->init(drv) < 0) {
+		printf("no such driver: %s\n", drv.c_str());
+		exit(1);
+	}
+	return mg;
+}
+
+static void bench_stop(void *handle)
+{
+	((mg_base*)handle)->stop();
+}
+
+static void bench_dispatch(mg_base *mg)
+{
+	mg_param_t p = {};
+	mg->dispatch(&p);
+}
+
+/* listener on an ephemeral loopback port */
+static void *bench_listen(mg_base *mg, void *handle,
+                          void **(*accept)(void*, mg_skt_param_t*),
+                          struct sockaddr_in *addr)
+{
+	socklen_t len = sizeof(*addr);
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	mg_listen_param_t lp = {
+		.handle = handle,
+		.accept = accept,
+		.family = AF_INET,
+		.type = SOCK_STREAM,
+		.sock_addr = (struct sockaddr*)addr,
+		.slen = sizeof(*addr)
+	};
+	void *l = mg->listen_open(&lp);
+	assert(l);
+	getsockname(mg_skt_fd(l), (struct sockaddr*)addr, &len);
+	return l;
+}
+
+static void *bench_connect(mg_base *mg, struct sockaddr_in *addr, void *handle,
+                           void (*rx)(void*, struct sockaddr*, unsigned char*, int),
+                           void (*close)(void*))
+{
+	mg_skt_param_t p = {
+		.handle = handle,
+		.rx = rx,
+		.close = close,
+		.family = AF_INET,
+		.type = SOCK_STREAM,
+		.connect_addr = (struct sockaddr*)addr,
+		.connect_addr_len = sizeof(*addr),
+	};
+	return mg->skt_open(&p);
+}
+
+/*
+ * accept: keep BENCH_ACCEPT_WIN connects in flight; every accepted
+ * connection is refused straight away, the client's close opens the next.
+ */
+typedef struct {
+	mg_base *mg;
+	struct sockaddr_in addr;
+	int opened;
+	int accepted;
+	int closed;
+} bench_accept_t;
+
+static void bench_accept_close(void *handle);
+
+static void bench_accept_open(bench_accept_t *b)
+{
+	b->opened++;
+	bench_connect(b->mg, &b->addr, b, NULL, bench_accept_close);
+}
+
+static void **bench_accept_cb(void *handle, mg_skt_param_t *p)
+{
+	bench_accept_t *b = (bench_accept_t*)handle;
+	b->accepted++;
+	return NULL;
+}
+
+static void bench_accept_close(void *handle)
+{
+	bench_accept_t *b = (bench_accept_t*)handle;
+	b->closed++;
+	if (b->opened < BENCH_ACCEPT_N) {
+		bench_accept_open(b);
+	}
+	else if (b->closed == b->opened) {
+		b->mg->stop();
+	}
+}
+
+static void bench_accept(const std::string &drv)
+{
+	bench_accept_t b = {};
+	b.mg = bench_mg_open(drv);
+	void *l = bench_listen(b.mg, &b, bench_accept_cb, &b.addr);
+	uint64_t t = bench_now_ns();
+	for (int i = 0; i < BENCH_ACCEPT_WIN; i++) {
+		bench_accept_open(&b);
+	}
+	bench_dispatch(b.mg);
+	t = bench_now_ns() - t;
+	printf("%-10s %10.0f\n", drv.c_str(), b.accepted * 1e9 / t);
+	b.mg->listen_close(l);
+	delete b.mg;
+}
+
+/*
+ * throughput: the sender keeps two bursts of messages in flight, the
+ * receiver acks every burst with one byte.
+ */
+typedef struct {
+	mg_base *mg;
+	void *tx, *rx;
+	int size;
+	int burst_msgs;
+	uint64_t sent_msgs;
+	uint64_t rx_bytes;
+	uint64_t acked;		// bursts acked so far
+	unsigned char *buf;
+} bench_tput_t;
+
+static void bench_tput_burst(bench_tput_t *b)
+{
+	for (int i = 0; i < b->burst_msgs; i++) {
+		if (mg_skt_tx(b->tx, b->buf, b->size) < 0) {
+			printf("tx queue full\n");
+			exit(1);
+		}
+	}
+	b->sent_msgs += b->burst_msgs;
+}
+
+static void bench_tput_ack_rx(void *handle, struct sockaddr *addr, unsigned char *buf, int len)
+{
+	bench_tput_t *b = (bench_tput_t*)handle;
+	for (int i = 0; i < len; i++) {
+		bench_tput_burst(b);
+	}
+}
+
+static void bench_tput_data_rx(void *handle, struct sockaddr *addr, unsigned char *buf, int len)
+{
+	bench_tput_t *b = (bench_tput_t*)handle;
+	uint64_t burst = (uint64_t)b->burst_msgs * b->size;
+	unsigned char ack = 0;
+	b->rx_bytes += len;
+	while (b->rx_bytes / burst > b->acked) {
+		b->acked++;
+		mg_skt_tx(b->rx, &ack, 1);
+	}
+}
+
+static void *bench_fd_open(mg_base *mg, int fd, void *handle,
+                           void (*rx)(void*, struct sockaddr*, unsigned char*, int))
+{
+	mg_skt_param_t p = {
+		.handle = handle,
+		.rx = rx,
+	};
+	return mg->fd_open(fd, &p);
+}
+
+static void bench_tput(const std::string &drv, int size)
+{
+	bench_tput_t b = {};
+	int sv[2];
+	b.mg = bench_mg_open(drv);
+	b.size = size;
+	b.burst_msgs = size < BENCH_BURST ? BENCH_BURST / size : 1;
+	b.buf = new unsigned char[size]();
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	b.tx = bench_fd_open(b.mg, sv[0], &b, bench_tput_ack_rx);
+	b.rx = bench_fd_open(b.mg, sv[1], &b, bench_tput_data_rx);
+	void *timer = b.mg->timer_add(b.mg, bench_stop, BENCH_MS, 0);
+	uint64_t t = bench_now_ns();
+	bench_tput_burst(&b);
+	bench_tput_burst(&b);
+	bench_dispatch(b.mg);
+	t = bench_now_ns() - t;
+	b.mg->timer_del(timer);
+	uint64_t msgs = b.rx_bytes / size;
+	printf("%-10s %6d %12.0f %10.1f\n", drv.c_str(), size,
+	       msgs * 1e9 / t, b.rx_bytes * 1e3 / t);
+	b.mg->skt_close(b.tx);
+	b.mg->skt_close(b.rx);
+	delete b.mg;
+	delete[] b.buf;
+}
+
+/*
+ * round trip: one BENCH_RTT_SIZE message bounces between the two ends,
+ * the client times every round trip.
+ */
+typedef struct {
+	mg_base *mg;
+	void *client, *server;
+	int got;		// bytes of the current echo received
+	uint64_t t_sent;
+	uint64_t rtts;
+	uint64_t max;		// stop after this many round trips, 0: timed
+	std::vector<uint32_t> samples;
+	unsigned char buf[BENCH_RTT_SIZE];
+} bench_rtt_t;
+
+static void bench_rtt_ping(bench_rtt_t *b)
+{
+	b->got = 0;
+	b->t_sent = bench_now_ns();
+	mg_skt_tx(b->client, b->buf, sizeof(b->buf));
+}
+
+static void bench_rtt_client_rx(void *handle, struct sockaddr *addr, unsigned char *buf, int len)
+{
+	bench_rtt_t *b = (bench_rtt_t*)handle;
+	b->got += len;
+	if (b->got < BENCH_RTT_SIZE) {
+		return;
+	}
+	if (b->samples.size() < BENCH_RTT_MAX) {
+		b->samples.push_back(bench_now_ns() - b->t_sent);
+	}
+	if (++b->rtts == b->max) {
+		b->mg->stop();
+		return;
+	}
+	bench_rtt_ping(b);
+}
+
+static void bench_rtt_server_rx(void *handle, struct sockaddr *addr, unsigned char *buf, int len)
+{
+	bench_rtt_t *b = (bench_rtt_t*)handle;
+	mg_skt_tx(b->server, buf, len);
+}
+
+static void **bench_rtt_accept(void *handle, mg_skt_param_t *p)
+{
+	bench_rtt_t *b = (bench_rtt_t*)handle;
+	p->handle = b;
+	p->rx = bench_rtt_server_rx;
+	return &b->server;
+}
+
+static uint32_t bench_pct(std::vector<uint32_t> &s, double pct)
+{
+	size_t i = (size_t)(s.size() * pct / 100);
+	return s[i < s.size() ? i : s.size() - 1];
+}
+
+static void bench_rtt(const std::string &drv)
+{
+	bench_rtt_t *b = new bench_rtt_t();
+	struct sockaddr_in addr;
+	b->mg = bench_mg_open(drv);
+	void *l = bench_listen(b->mg, b, bench_rtt_accept, &addr);
+	b->client = bench_connect(b->mg, &addr, b, bench_rtt_client_rx, NULL);
+	void *timer = b->mg->timer_add(b->mg, bench_stop, BENCH_MS, 0);
+	bench_rtt_ping(b);
+	bench_dispatch(b->mg);
+	b->mg->timer_del(timer);
+	std::sort(b->samples.begin(), b->samples.end());
+	printf("%-10s %10.1f %10.1f %10.1f %10lu\n", drv.c_str(),
+	       bench_pct(b->samples, 50) / 1e3, bench_pct(b->samples, 99) / 1e3,
+	       bench_pct(b->samples, 99.9) / 1e3, (unsigned long)b->rtts);
+	b->mg->skt_close(b->client);
+	b->mg->skt_close(b->server);
+	b->mg->listen_close(l);
+	delete b->mg;
+	delete b;
+}
+
+/*
+ * idle fds: a socketpair ping-pong with n other fds registered (both ends
+ * of n / 2 socketpairs) and never ready. Returns ns per round trip, 0 if
+ * the driver can't take that many fds.
+ */
+static double bench_idle(const std::string &drv, int n)
+{
+	bench_rtt_t *b = new bench_rtt_t();
+	std::vector<void*> idle;
+	int sv[2];
+	if (drv == "select" && n + 16 > FD_SETSIZE) {
+		delete b;
+		return 0;
+	}
+	b->mg = bench_mg_open(drv);
+	for (int i = 0; i < n / 2; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+			perror("socketpair");
+			exit(1);
+		}
+		idle.push_back(bench_fd_open(b->mg, sv[0], NULL, NULL));
+		idle.push_back(bench_fd_open(b->mg, sv[1], NULL, NULL));
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	b->client = bench_fd_open(b->mg, sv[0], b, bench_rtt_client_rx);
+	b->server = bench_fd_open(b->mg, sv[1], b, bench_rtt_server_rx);
+	b->max = BENCH_IDLE_RTTS;
+	uint64_t t = bench_now_ns();
+	bench_rtt_ping(b);
+	bench_dispatch(b->mg);
+	t = bench_now_ns() - t;
+	for (void *s : idle) {
+		b->mg->skt_close(s);
+	}
+	b->mg->skt_close(b->client);
+	b->mg->skt_close(b->server);
+	delete b->mg;
+	delete b;
+	return (double)t / BENCH_IDLE_RTTS;
+}
+
+/*
+ * post: every producer thread posts BENCH_POST_N callbacks, the handle
+ * being the producer and sequence number, checked to arrive in order
+ */
+typedef struct {
+	mg_base *mg;
+	uint64_t seq[BENCH_POST_THREADS];	// next expected, per producer
+	uint64_t done;
+	int order_ok;
+} bench_post_t;
+
+static bench_post_t *bench_post_cur;
+
+static void bench_post_cb(void *handle)
+{
+	bench_post_t *b = bench_post_cur;
+	uintptr_t v = (uintptr_t)handle;
+	int t = v >> 32;
+	if ((v & 0xffffffff) != b->seq[t]++) {
+		b->order_ok = 0;
+	}
+	if (++b->done == (uint64_t)BENCH_POST_THREADS * BENCH_POST_N) {
+		b->mg->stop();
+	}
+}
+
+static void bench_post_producer(mg_base *mg, int t)
+{
+	for (uintptr_t i = 0; i < BENCH_POST_N; i++) {
+		mg->post(bench_post_cb, (void*)(((uintptr_t)t << 32) | i));
+	}
+}
+
+static void bench_post(const std::string &drv)
+{
+	bench_post_t b = {};
+	std::vector<std::thread> producers;
+	mg_loop_stats_t ls;
+	b.mg = bench_mg_open(drv);
+	b.order_ok = 1;
+	bench_post_cur = &b;
+	uint64_t t = bench_now_ns();
+	for (int i = 0; i < BENCH_POST_THREADS; i++) {
+		producers.push_back(std::thread(bench_post_producer, b.mg, i));
+	}
+	bench_dispatch(b.mg);
+	t = bench_now_ns() - t;
+	for (std::thread &p : producers) {
+		p.join();
+	}
+	b.mg->stats(&ls, NULL);
+	printf("%-10s %12.0f %12.1f %6s\n", drv.c_str(), b.done * 1e9 / t,
+	       ls.wakeups ? (double)b.done / ls.wakeups : 0.0, b.order_ok ? "yes" : "NO");
+	delete b.mg;
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<std::string> drivers;
+	static const int idle_n[] = { 10, 100, 1000, 10000 };
+	struct rlimit rl;
+	for (int i = 1; i < argc; i++) {
+		drivers.push_back(argv[i]);
+	}
+	if (drivers.empty()) {
+		drivers = mg_base::drivers();
+		std::sort(drivers.begin(), drivers.end());
+	}
+	/* room for the largest idle fd run */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	printf("== accept: connections/sec, loopback TCP\n");
+	printf("%-10s %10s\n", "driver", "conn/s");
+	for (auto &d : drivers) {
+		bench_accept(d);
+	}
+	printf("\n== throughput: mg_skt_tx() over a socketpair, %d ms per size\n", BENCH_MS);
+	printf("%-10s %6s %12s %10s\n", "driver", "size", "msgs/s", "MB/s");
+	for (auto &d : drivers) {
+		for (int size : { 64, 1024, 16384 }) {
+			bench_tput(d, size);
+		}
+	}
+	printf("\n== round trip: %d byte ping-pong, loopback TCP, us\n", BENCH_RTT_SIZE);
+	printf("%-10s %10s %10s %10s %10s\n", "driver", "p50", "p99", "p999", "count");
+	for (auto &d : drivers) {
+		bench_rtt(d);
+	}
+	printf("\n== idle fds: ns per socketpair round trip with n idle fds\n");
+	printf("%-10s", "driver");
+	for (int n : idle_n) {
+		printf(" %10d", n);
+	}
+	printf("\n");
+	for (auto &d : drivers) {
+		printf("%-10s", d.c_str());
+		for (int n : idle_n) {
+			if (n + 64 > (int)rl.rlim_cur) {
+				printf(" %10s", "no fds");
+				continue;
+			}
+			double ns = bench_idle(d, n);
+			if (ns) {
+				printf(" %10.0f", ns);
+			}
+			else {
+				printf(" %10s", "n/a");
+			}
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+	printf("\n== post: %d threads posting %d callbacks each to one loop\n",
+	       BENCH_POST_THREADS, BENCH_POST_N);
+	printf("%-10s %12s %12s %6s\n", "driver", "posts/s", "posts/wakeup", "order");
+	for (auto &d : drivers) {
+		bench_post(d);
+	}
+	return 0;
+}
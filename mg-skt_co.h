@@ -0,0 +1,483 @@
+/*
+
+    COPYRIGHT AND PERMISSION NOTICE
+    Copyright (c) 2015-2020 Mark Griffiths
+    All rights reserved.
+    Permission to use, copy, modify, and distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+    OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+    USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the name of a copyright holder shall
+    not be used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization of the
+    copyright holder.
+
+	"mg-skt" non-blocking sockets abstraction layer, C++20 coroutines.
+
+	Optional, header only: needs -std=c++20, the library itself does not.
+
+	mg_co_task echo(mg_co_skt *s)
+	{
+		unsigned char buf[4096];
+		int n;
+		while ((n = co_await s->read(buf, sizeof(buf))) > 0) {
+			if (co_await s->write(buf, n) < 0) {
+				break;
+			}
+		}
+		s->close();
+	}
+
+	mg_co_task server(mg_co *co, mg_listen_param_t *p)
+	{
+		mg_co_listener *l = co->listen(p);
+		for (;;) {
+			echo(co_await l->accept());
+		}
+	}
+
+ */
+
+#ifndef __MG_SKT_CO_H__
+#define __MG_SKT_CO_H__
+
+#include <coroutine>
+#include <cstdlib>
+#include <exception>
+#include <new>
+#include "mg-skt.h"
+#include "mg-skt_pool.h"
+
+#define MG_CO_FRAME_CLASS   64	// frame pool size classes
+#define MG_CO_FRAME_CLASSES 64	// frames up to 4KB are pooled, malloc() above
+
+/*
+ * Coroutine frames come from per-thread slab pools by size class: a
+ * coroutine is started and freed on the same loop, and after the first
+ * few no frame costs a malloc(). The pools last as long as the thread.
+ */
+class mg_co_frames {
+public:
+	static void *get(size_t size)
+	{
+		mg_pool *p = pool(size);
+		void *f = p ? p->get() : malloc(size);
+		if (!f) {
+			throw std::bad_alloc();
+		}
+		return f;
+	}
+	static void put(void *f, size_t size)
+	{
+		mg_pool *p = pool(size);
+		if (p) {
+			p->put(f);
+		}
+		else {
+			free(f);
+		}
+	}
+private:
+	static mg_pool *pool(size_t size)
+	{
+		static thread_local mg_pool *pool_list[MG_CO_FRAME_CLASSES];
+		size_t i = (size + MG_CO_FRAME_CLASS - 1) / MG_CO_FRAME_CLASS;
+		if (i > MG_CO_FRAME_CLASSES) {
+			return NULL;
+		}
+		i = i ? i - 1 : 0;
+		if (!pool_list[i]) {
+			pool_list[i] = new mg_pool((i + 1) * MG_CO_FRAME_CLASS);
+		}
+		return pool_list[i];
+	}
+};
+
+/*
+ * Return type of a coroutine: it runs as soon as it is called, up to its
+ * first co_await that has to wait, and frees itself when it returns.
+ * Nothing waits for it.
+ */
+class mg_co_task {
+public:
+	struct promise_type {
+		mg_co_task get_return_object() { return mg_co_task(); }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+		static void *operator new(size_t size) { return mg_co_frames::get(size); }
+		static void operator delete(void *f, size_t size) { mg_co_frames::put(f, size); }
+	};
+};
+
+class mg_co;
+class mg_co_listener;
+
+/*
+ * A stream socket driven by coroutines: at most one read and one write
+ * awaited at a time. Reads go straight from the kernel into the caller's
+ * buffer (rx_ready mode). The socket is paused when found readable with
+ * no reader, and resumed by the next read that has to wait.
+ */
+class mg_co_skt {
+public:
+	void *handle = NULL;	// library socket
+	class mg_co *co;
+	/* awaited read */
+	class read_op {
+	public:
+		class mg_co_skt *s;
+		void *buf;
+		int len;
+		int res;
+		bool await_ready()
+		{
+			if (!s->handle) {
+				res = -1;
+				return true;
+			}
+			res = mg_skt_recv(s->handle, buf, len);
+			return res >= 0;
+		}
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			s->rx_op = this;
+			s->rx_wait = h;
+			/* no-op unless paused */
+			mg_skt_rx_resume(s->handle);
+		}
+		/* bytes read, 0 once the peer has closed, -1 once the connection failed */
+		int await_resume() { return res; }
+	};
+	/* awaited write */
+	class write_op {
+	public:
+		class mg_co_skt *s;
+		const void *buf;
+		int len;
+		int res;
+		bool await_ready()
+		{
+			if (!s->handle || mg_skt_error(s->handle)) {
+				/* failed, or about to be closed because a write failed */
+				res = -1;
+				return true;
+			}
+			res = mg_skt_tx(s->handle, (unsigned char*)buf, len);
+			return res < 0 || !mg_skt_tx_queued(s->handle);
+		}
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			s->tx_op = this;
+			s->tx_wait = h;
+		}
+		/* 0 once written out, -1 if the tx queue was full or the connection failed */
+		int await_resume() { return res; }
+	};
+	read_op read(void *buf, int len) { return read_op{ this, buf, len, 0 }; }
+	write_op write(const void *buf, int len) { return write_op{ this, buf, len, 0 }; }
+	/*
+	 * Close the socket, this object goes with it: once, by whichever
+	 * coroutine uses it last. Also needed after a failed read or write.
+	 */
+	inline void close(void);
+
+	/* library callbacks */
+	static void rx_ready_cb(void *handle)
+	{
+		class mg_co_skt *s = (class mg_co_skt*)handle;
+		if (!s->rx_wait) {
+			/* nobody to read for */
+			mg_skt_rx_pause(s->handle);
+			return;
+		}
+		int n = mg_skt_recv(s->handle, s->rx_op->buf, s->rx_op->len);
+		if (n < 0) {
+			return;
+		}
+		s->rx_op->res = n;
+		std::coroutine_handle<> h = s->rx_wait;
+		s->rx_wait = nullptr;
+		h.resume();
+	}
+	static void tx_drained_cb(void *handle)
+	{
+		class mg_co_skt *s = (class mg_co_skt*)handle;
+		if (s->tx_wait) {
+			std::coroutine_handle<> h = s->tx_wait;
+			s->tx_wait = nullptr;
+			h.resume();
+		}
+	}
+	static inline void connected_cb(void *handle);
+	static void connect_failed_cb(void *handle)
+	{
+		class mg_co_skt *s = (class mg_co_skt*)handle;
+		s->up = 0;
+		std::coroutine_handle<> h = s->rx_wait;
+		s->rx_wait = nullptr;
+		h.resume();
+	}
+	static inline void close_cb(void *handle);
+	void param_set(mg_skt_param_t *p)
+	{
+		p->handle = this;
+		p->rx_ready = rx_ready_cb;
+		p->tx_drained = tx_drained_cb;
+		p->connected = connected_cb;
+		p->close = close_cb;
+	}
+	read_op *rx_op = NULL;
+	write_op *tx_op = NULL;
+	std::coroutine_handle<> rx_wait;	// reader, or connect()
+	std::coroutine_handle<> tx_wait;
+	class mg_co_listener *acceptor = NULL;	// accepted, not handed over yet
+	int connecting = 0;	// connect() not done yet
+	int up = 1;
+};
+
+/* listening socket: connections are accepted one co_await at a time */
+class mg_co_listener {
+public:
+	void *handle;
+	class mg_co *co;
+	std::coroutine_handle<> wait;
+	class mg_co_skt *accepted = NULL;
+	class accept_op {
+	public:
+		class mg_co_listener *l;
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			l->wait = h;
+			mg_skt_rx_resume(l->handle);
+		}
+		class mg_co_skt *await_resume()
+		{
+			class mg_co_skt *s = l->accepted;
+			l->accepted = NULL;
+			return s;
+		}
+	};
+	accept_op accept(void) { return accept_op{ this }; }
+	static inline void **accept_cb(void *handle, mg_skt_param_t *p);
+};
+
+/*
+ * Coroutine front end of one event loop: sockets, listeners and timers
+ * are that loop's, and so are the coroutines using them.
+ */
+class mg_co {
+public:
+	class mg_base *mg;
+	mg_co(class mg_base *mg_) : mg(mg_) {}
+	~mg_co()
+	{
+		while (timer_free) {
+			class mg_co_timer *t = timer_free;
+			timer_free = t->next;
+			mg->timer_del(t->timer);
+			mg->pool_put(t, sizeof(*t));
+		}
+	}
+	class mg_co_skt *skt_new(void)
+	{
+		class mg_co_skt *s = new (mg->pool_get(sizeof(class mg_co_skt))) mg_co_skt();
+		s->co = this;
+		return s;
+	}
+	void skt_free(class mg_co_skt *s)
+	{
+		s->~mg_co_skt();
+		mg->pool_put(s, sizeof(*s));
+	}
+	/* p: address and options, its handle and accept are the layer's */
+	class mg_co_listener *listen(mg_listen_param_t *p)
+	{
+		class mg_co_listener *l = new mg_co_listener();
+		mg_listen_param_t lp = *p;
+		l->co = this;
+		lp.handle = l;
+		lp.accept = mg_co_listener::accept_cb;
+		l->handle = mg->listen_open(&lp);
+		if (!l->handle) {
+			delete l;
+			return NULL;
+		}
+		/* accept only when asked to */
+		mg_skt_rx_pause(l->handle);
+		return l;
+	}
+	void listen_close(class mg_co_listener *l)
+	{
+		mg->listen_close(l->handle);
+		delete l;
+	}
+	/* awaited connect, NULL if it failed */
+	class connect_op {
+	public:
+		class mg_co *co;
+		mg_skt_param_t p;
+		class mg_co_skt *s;
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			s = co->skt_new();
+			s->param_set(&p);
+			s->connecting = 1;
+			s->rx_wait = h;
+			s->handle = co->mg->skt_open(&p);
+		}
+		class mg_co_skt *await_resume()
+		{
+			if (!s->up) {
+				/* the library closes its socket once we are done */
+				co->skt_free(s);
+				return NULL;
+			}
+			return s;
+		}
+	};
+	/* p: NULL or further socket options, its callbacks are the layer's */
+	connect_op connect(struct sockaddr *addr, socklen_t len, const mg_skt_param_t *p = NULL)
+	{
+		connect_op op = { this, {}, NULL };
+		if (p) {
+			op.p = *p;
+		}
+		op.p.family = addr->sa_family;
+		op.p.type = SOCK_STREAM;
+		op.p.connect_addr = addr;
+		op.p.connect_addr_len = len;
+		return op;
+	}
+	/* one-shot timers, recycled */
+	class mg_co_timer {
+	public:
+		void *timer;
+		std::coroutine_handle<> h;
+		class mg_co *co;
+		class mg_co_timer *next;
+	};
+	class sleep_op {
+	public:
+		class mg_co *co;
+		uint32_t ms;
+		bool await_ready() { return !ms; }
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			class mg_co_timer *t = co->timer_free;
+			if (t) {
+				co->timer_free = t->next;
+				t->h = h;
+				co->mg->timer_mod(t->timer, ms);
+				return;
+			}
+			t = (class mg_co_timer*)co->mg->pool_get(sizeof(*t));
+			t->co = co;
+			t->h = h;
+			t->timer = co->mg->timer_add(t, timer_cb, ms, 0);
+		}
+		void await_resume() {}
+	};
+	sleep_op sleep(uint32_t ms) { return sleep_op{ this, ms }; }
+	static void timer_cb(void *handle)
+	{
+		class mg_co_timer *t = (class mg_co_timer*)handle;
+		std::coroutine_handle<> h = t->h;
+		t->next = t->co->timer_free;
+		t->co->timer_free = t;
+		h.resume();
+	}
+	class mg_co_timer *timer_free = NULL;
+};
+
+void mg_co_skt::close(void)
+{
+	if (handle) {
+		co->mg->skt_close(handle);
+	}
+	co->skt_free(this);
+}
+
+/* connect done, or accepted and its handle filled in */
+void mg_co_skt::connected_cb(void *handle)
+{
+	class mg_co_skt *s = (class mg_co_skt*)handle;
+	std::coroutine_handle<> h;
+	if (s->acceptor) {
+		class mg_co_listener *l = s->acceptor;
+		s->acceptor = NULL;
+		l->accepted = s;
+		h = l->wait;
+		l->wait = nullptr;
+	}
+	else {
+		s->connecting = 0;
+		h = s->rx_wait;
+		s->rx_wait = nullptr;
+	}
+	h.resume();
+}
+
+/*
+ * The library closes its socket once this returns: the handle is
+ * dropped, so that close() only frees this object, and whoever waits is
+ * told the connection failed.
+ */
+void mg_co_skt::close_cb(void *handle)
+{
+	class mg_co_skt *s = (class mg_co_skt*)handle;
+	s->handle = NULL;
+	if (s->acceptor) {
+		/* dropped before it was handed over: wait for the next one */
+		class mg_co_listener *l = s->acceptor;
+		s->co->skt_free(s);
+		mg_skt_rx_resume(l->handle);
+		return;
+	}
+	if (s->connecting) {
+		connect_failed_cb(handle);
+		return;
+	}
+	std::coroutine_handle<> rx = s->rx_wait;
+	std::coroutine_handle<> tx = s->tx_wait;
+	s->rx_wait = nullptr;
+	s->tx_wait = nullptr;
+	if (tx) {
+		/* before the reader runs, it may close() s */
+		s->tx_op->res = -1;
+	}
+	if (rx) {
+		s->rx_op->res = -1;
+		rx.resume();
+	}
+	if (tx) {
+		tx.resume();
+	}
+}
+
+void **mg_co_listener::accept_cb(void *handle, mg_skt_param_t *p)
+{
+	class mg_co_listener *l = (class mg_co_listener*)handle;
+	if (!l->wait) {
+		return NULL;
+	}
+	/* one connection per accept(), handed over once it is open */
+	mg_skt_rx_pause(l->handle);
+	class mg_co_skt *s = l->co->skt_new();
+	s->param_set(p);
+	s->acceptor = l;
+	return &s->handle;
+}
+
+#endif // __MG_SKT_CO_H__
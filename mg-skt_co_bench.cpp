@@ -0,0 +1,338 @@
+/*
+
+    COPYRIGHT AND PERMISSION NOTICE
+    Copyright (c) 2019-2020 Mark Griffiths
+    All rights reserved.
+    Permission to use, copy, modify, and distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+    OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+    USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the name of a copyright holder shall
+    not be used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization of the
+    copyright holder.
+
+    mg-skt coroutine layer benchmark.
+
+	The same loopback TCP echo ping-pong, written once against the
+	callback API and once with mg-skt_co.h coroutines, on a single event
+	loop running both ends of every connection. Reports round trips/sec
+	and heap allocations (operator new) per round trip.
+
+	usage: mg-skt-co-bench [driver ...]	(default: every registered driver)
+
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <time.h>
+#include "mg-skt.h"
+#include "mg-skt_co.h"
+
+#define BENCH_MS       1000	// duration of each timed run
+#define BENCH_MSG_SIZE 64
+
+/* heap allocations, counted while a run is timed */
+static uint64_t bench_news;
+static int bench_counting;
+
+void *operator new(size_t size)
+{
+	bench_news += bench_counting;
+	void *p = malloc(size ? size : 1);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t size) noexcept
+{
+	free(p);
+}
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static mg_base *bench_mg_open(const std::string &drv)
+{
+	mg_base *mg = new mg_base;
+	if (mg->init(drv) < 0) {
+		printf("no such driver: %s\n", drv.c_str());
+		exit(1);
+	}
+	return mg;
+}
+
+static void bench_dispatch(mg_base *mg)
+{
+	mg_param_t p = {};
+	mg->dispatch(&p);
+}
+
+static mg_listen_param_t bench_listen_param(struct sockaddr_in *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	mg_listen_param_t lp = {
+		.family = AF_INET,
+		.type = SOCK_STREAM,
+		.sock_addr = (struct sockaddr*)addr,
+		.slen = sizeof(*addr)
+	};
+	return lp;
+}
+
+typedef struct {
+	mg_base *mg;
+	int conns;
+	int stopping;		// timed out, finish the round trips in flight
+	int live;		// connections not closed yet, both ends
+	uint64_t rtts;
+	uint64_t t;		// ns, while timed
+} bench_t;
+
+/* start timing once every connection is up */
+static void bench_start(bench_t *b)
+{
+	bench_news = 0;
+	bench_counting = 1;
+	b->t = bench_now_ns();
+}
+
+static void bench_timeout(void *handle)
+{
+	bench_t *b = (bench_t*)handle;
+	b->t = bench_now_ns() - b->t;
+	bench_counting = 0;
+	b->stopping = 1;
+}
+
+static void bench_report(const char *api, const std::string &drv, bench_t *b)
+{
+	printf("%-10s %-10s %6d %12.0f %10.3f\n", drv.c_str(), api, b->conns,
+	       b->rtts * 1e9 / b->t, (double)bench_news / b->rtts);
+}
+
+/*
+ * callbacks: every echo comes back to the client's rx, which sends the
+ * next message
+ */
+typedef struct {
+	bench_t *b;
+	void *skt;
+	int got;
+	unsigned char buf[BENCH_MSG_SIZE];
+} bench_cb_conn_t;
+
+static void bench_cb_client_rx(void *handle, struct sockaddr *addr, unsigned char *buf, int len)
+{
+	bench_cb_conn_t *c = (bench_cb_conn_t*)handle;
+	c->got += len;
+	if (c->got < BENCH_MSG_SIZE) {
+		return;
+	}
+	c->got = 0;
+	c->b->rtts++;
+	if (c->b->stopping) {
+		if (!--c->b->live) {
+			c->b->mg->stop();
+		}
+		return;
+	}
+	mg_skt_tx(c->skt, c->buf, sizeof(c->buf));
+}
+
+static void bench_cb_server_rx(void *handle, struct sockaddr *addr, unsigned char *buf, int len)
+{
+	bench_cb_conn_t *c = (bench_cb_conn_t*)handle;
+	mg_skt_tx(c->skt, buf, len);
+}
+
+typedef struct {
+	bench_t *b;
+	std::vector<bench_cb_conn_t*> servers;
+} bench_cb_listen_t;
+
+static void **bench_cb_accept(void *handle, mg_skt_param_t *p)
+{
+	bench_cb_listen_t *l = (bench_cb_listen_t*)handle;
+	bench_cb_conn_t *c = new bench_cb_conn_t();
+	c->b = l->b;
+	p->handle = c;
+	p->rx = bench_cb_server_rx;
+	l->servers.push_back(c);
+	return &c->skt;
+}
+
+static void bench_cb(const std::string &drv, int conns)
+{
+	bench_t b = {};
+	bench_cb_listen_t l = {};
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	std::vector<bench_cb_conn_t*> clients;
+	b.mg = bench_mg_open(drv);
+	b.conns = b.live = conns;
+	l.b = &b;
+	mg_listen_param_t lp = bench_listen_param(&addr);
+	lp.handle = &l;
+	lp.accept = bench_cb_accept;
+	void *lh = b.mg->listen_open(&lp);
+	assert(lh);
+	getsockname(mg_skt_fd(lh), (struct sockaddr*)&addr, &len);
+	for (int i = 0; i < conns; i++) {
+		bench_cb_conn_t *c = new bench_cb_conn_t();
+		c->b = &b;
+		mg_skt_param_t p = {
+			.handle = c,
+			.rx = bench_cb_client_rx,
+			.family = AF_INET,
+			.type = SOCK_STREAM,
+			.connect_addr = (struct sockaddr*)&addr,
+			.connect_addr_len = sizeof(addr),
+		};
+		c->skt = b.mg->skt_open(&p);
+		clients.push_back(c);
+		mg_skt_tx(c->skt, c->buf, sizeof(c->buf));
+	}
+	void *timer = b.mg->timer_add(&b, bench_timeout, BENCH_MS, 0);
+	bench_start(&b);
+	bench_dispatch(b.mg);
+	b.mg->timer_del(timer);
+	bench_report("callback", drv, &b);
+	for (bench_cb_conn_t *c : clients) {
+		b.mg->skt_close(c->skt);
+		delete c;
+	}
+	for (bench_cb_conn_t *c : l.servers) {
+		b.mg->skt_close(c->skt);
+		delete c;
+	}
+	b.mg->listen_close(lh);
+	delete b.mg;
+}
+
+/* coroutines: one per end of every connection, plus the acceptor */
+static void bench_co_done(bench_t *b)
+{
+	if (!--b->live) {
+		b->mg->stop();
+	}
+}
+
+static mg_co_task bench_co_echo(bench_t *b, mg_co_skt *s)
+{
+	unsigned char buf[BENCH_MSG_SIZE];
+	int n;
+	while ((n = co_await s->read(buf, sizeof(buf))) > 0) {
+		if (co_await s->write(buf, n) < 0) {
+			break;
+		}
+	}
+	s->close();
+	bench_co_done(b);
+}
+
+static mg_co_task bench_co_server(bench_t *b, mg_co_listener *l)
+{
+	for (int i = 0; i < b->conns; i++) {
+		bench_co_echo(b, co_await l->accept());
+	}
+}
+
+static mg_co_task bench_co_client(bench_t *b, mg_co *co, struct sockaddr_in *addr)
+{
+	unsigned char buf[BENCH_MSG_SIZE] = {};
+	mg_co_skt *s = co_await co->connect((struct sockaddr*)addr, sizeof(*addr));
+	assert(s);
+	while (!b->stopping) {
+		int got = 0;
+		co_await s->write(buf, sizeof(buf));
+		while (got < BENCH_MSG_SIZE) {
+			int n = co_await s->read(buf + got, sizeof(buf) - got);
+			assert(n > 0);
+			got += n;
+		}
+		b->rtts++;
+	}
+	/* the server's read sees the close */
+	s->close();
+	bench_co_done(b);
+}
+
+static void bench_co(const std::string &drv, int conns)
+{
+	bench_t b = {};
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	b.mg = bench_mg_open(drv);
+	b.conns = conns;
+	b.live = 2 * conns;
+	mg_co *co = new mg_co(b.mg);
+	mg_listen_param_t lp = bench_listen_param(&addr);
+	mg_co_listener *l = co->listen(&lp);
+	assert(l);
+	getsockname(mg_skt_fd(l->handle), (struct sockaddr*)&addr, &len);
+	bench_co_server(&b, l);
+	for (int i = 0; i < conns; i++) {
+		bench_co_client(&b, co, &addr);
+	}
+	void *timer = b.mg->timer_add(&b, bench_timeout, BENCH_MS, 0);
+	bench_start(&b);
+	bench_dispatch(b.mg);
+	b.mg->timer_del(timer);
+	bench_report("coroutine", drv, &b);
+	co->listen_close(l);
+	delete co;
+	delete b.mg;
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<std::string> drivers;
+	for (int i = 1; i < argc; i++) {
+		drivers.push_back(argv[i]);
+	}
+	if (drivers.empty()) {
+		drivers = mg_base::drivers();
+		std::sort(drivers.begin(), drivers.end());
+	}
+	printf("== echo round trips, %d byte messages over loopback TCP, %d ms per run\n",
+	       BENCH_MSG_SIZE, BENCH_MS);
+	printf("%-10s %-10s %6s %12s %10s\n", "driver", "api", "conns", "rtt/s", "news/rtt");
+	for (auto &d : drivers) {
+		for (int conns : { 1, 64 }) {
+			bench_cb(d, conns);
+			bench_co(d, conns);
+		}
+	}
+	return 0;
+}
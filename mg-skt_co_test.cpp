@@ -0,0 +1,203 @@
+/*
+
+    COPYRIGHT AND PERMISSION NOTICE
+    Copyright (c) 2019-2020 Mark Griffiths
+    All rights reserved.
+    Permission to use, copy, modify, and distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+    OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+    USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the name of a copyright holder shall
+    not be used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization of the
+    copyright holder.
+
+    mg-skt coroutine layer tests.
+
+	A coroutine writes to a peer that does not read until its write has
+	to wait, then the peer resets the connection: the write must come
+	back with -1, for an accepted and for a connected socket alike.
+
+	usage: mg-skt-co-test [driver ...]	(default: every registered driver)
+
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "mg-skt.h"
+#include "mg-skt_co.h"
+
+#define TEST_TIMEOUT_MS 5000
+#define TEST_CHUNK      65536
+
+#define CHECK(c) do { \
+	if (!(c)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #c); \
+		exit(1); \
+	} \
+} while (0)
+
+typedef struct {
+	mg_base *mg;
+	mg_co *co;
+	mg_co_skt *s;		// the writer's socket, once up
+	int peer;		// the other end, a plain socket
+	int res;		// last write result
+	int timed_out;
+} test_t;
+
+static void test_timeout(void *handle)
+{
+	test_t *t = (test_t*)handle;
+	t->timed_out = 1;
+	t->mg->stop();
+}
+
+/* a small receive buffer, so that the writer has to wait soon */
+static int test_socket(void)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int size = 4096;
+	CHECK(fd >= 0);
+	CHECK(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == 0);
+	return fd;
+}
+
+/* reset as soon as the writer waits */
+static mg_co_task test_reset(test_t *t)
+{
+	struct linger lg = { 1, 0 };
+	while (!t->s || !mg_skt_tx_queued(t->s->handle)) {
+		co_await t->co->sleep(5);
+	}
+	CHECK(setsockopt(t->peer, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg)) == 0);
+	close(t->peer);
+	t->peer = -1;
+}
+
+static mg_co_task test_write(test_t *t, mg_co_skt *s)
+{
+	static unsigned char buf[TEST_CHUNK];
+	CHECK(s);
+	t->s = s;
+	while ((t->res = co_await s->write(buf, sizeof(buf))) == 0) {
+	}
+	s->close();
+	t->s = NULL;
+	t->mg->stop();
+}
+
+static mg_co_task test_accept(test_t *t, mg_co_listener *l)
+{
+	test_write(t, co_await l->accept());
+}
+
+static mg_co_task test_connect(test_t *t, struct sockaddr_in *addr, int lfd)
+{
+	mg_co_skt *s = co_await t->co->connect((struct sockaddr*)addr, sizeof(*addr));
+	t->peer = accept(lfd, NULL, NULL);
+	CHECK(t->peer >= 0);
+	test_write(t, s);
+}
+
+static void test_run(test_t *t)
+{
+	mg_param_t p = {};
+	void *timer = t->mg->timer_add(t, test_timeout, TEST_TIMEOUT_MS, 0);
+	test_reset(t);
+	t->mg->dispatch(&p);
+	t->mg->timer_del(timer);
+	CHECK(!t->timed_out);
+	CHECK(t->res == -1);
+}
+
+static void test_loopback(struct sockaddr_in *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+/* the peer connects to a coroutine listener */
+static void test_accepted(const std::string &drv)
+{
+	test_t t = {};
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	t.mg = new mg_base;
+	CHECK(t.mg->init(drv) == 0);
+	t.co = new mg_co(t.mg);
+	test_loopback(&addr);
+	mg_listen_param_t lp = {
+		.family = AF_INET,
+		.type = SOCK_STREAM,
+		.sock_addr = (struct sockaddr*)&addr,
+		.slen = sizeof(addr)
+	};
+	mg_co_listener *l = t.co->listen(&lp);
+	CHECK(l);
+	getsockname(mg_skt_fd(l->handle), (struct sockaddr*)&addr, &len);
+	t.peer = test_socket();
+	CHECK(connect(t.peer, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+	test_accept(&t, l);
+	test_run(&t);
+	t.co->listen_close(l);
+	delete t.co;
+	delete t.mg;
+}
+
+/* a coroutine connects to the peer */
+static void test_connected(const std::string &drv)
+{
+	test_t t = {};
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	t.mg = new mg_base;
+	CHECK(t.mg->init(drv) == 0);
+	t.co = new mg_co(t.mg);
+	test_loopback(&addr);
+	int lfd = test_socket();
+	CHECK(bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+	CHECK(listen(lfd, 1) == 0);
+	getsockname(lfd, (struct sockaddr*)&addr, &len);
+	test_connect(&t, &addr, lfd);
+	test_run(&t);
+	close(lfd);
+	delete t.co;
+	delete t.mg;
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<std::string> drivers;
+	for (int i = 1; i < argc; i++) {
+		drivers.push_back(argv[i]);
+	}
+	if (drivers.empty()) {
+		drivers = mg_base::drivers();
+		std::sort(drivers.begin(), drivers.end());
+	}
+	for (auto &d : drivers) {
+		test_accepted(d);
+		test_connected(d);
+		printf("%s: ok\n", d.c_str());
+	}
+	return 0;
+}
@@ -24,7 +24,6 @@
 
  */
 #include <sys/epoll.h>
-#include <sys/timerfd.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
@@ -38,7 +37,6 @@
 
 class mg_skt_poll_epoll : mg_skt_poll_drv {
 private:
-	int timer_fd;
 	int efd;
 	class mg *_mg_handle;
 public:
@@ -46,27 +44,31 @@ public:
 	// constructor
 	mg_skt_poll_epoll()
 	{
+		efd = -1;
 		mg_register(name, this);
 	};
+	mg_skt_poll_epoll(const mg_skt_poll_epoll &proto)
+	{
+		efd = -1;
+		_mg_handle = NULL;
+	};
+	~mg_skt_poll_epoll()
+	{
+		if (efd >= 0) {
+			close(efd);
+		}
+	}
+	// new driver instance for an mg loop
+	mg_skt_poll_drv *create(void)
+	{
+		return new mg_skt_poll_epoll(*this);
+	}
 	// override init function
 	int init(class mg *mg_handle)
 	{
-		struct itimerspec new_value = {
-			.it_interval = { .tv_sec = 1 },
-			.it_value = { .tv_sec = 1 }
-		};
 		efd = epoll_create1(0);
 		MG_LOG_DBG("mg_epoll_init: efd = %d\n", efd);
 		assert(efd >= 0);
-		/* setup one sec recurring timer */
-		timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
-		assert(timer_fd >= 0);
-		if (timerfd_settime(timer_fd, 0, &new_value, NULL) < 0) {
-			assert(0);
-		}
-		if (fd_add(timer_fd, NULL)) {
-			assert(0);
-		}
 		_mg_handle = mg_handle;
 		return 0;
 	}
@@ -92,25 +94,42 @@ public:
 		}
 		return 0;
 	}
-	// watch for tx complete event
-	int fd_tx_watch(class mg_skt *mg_skt, int enable)
+	// events of interest changed
+	int fd_mod(class mg_skt *mg_skt)
 	{
 		struct epoll_event event;
 		event.data.ptr = (void*)mg_skt;
-		event.events = enable ? (EPOLLIN | EPOLLOUT | EPOLLET) : (EPOLLIN | EPOLLET);
+		event.events = EPOLLET;
+		if (mg_skt_rx_watched(mg_skt)) {
+			event.events |= EPOLLIN;
+		}
+		if (mg_skt_tx_watched(mg_skt)) {
+			event.events |= EPOLLOUT;
+		}
 		if (epoll_ctl(efd, EPOLL_CTL_MOD, mg_skt_fd(mg_skt), &event)) {
-			MG_LOG_ERR("mg_epoll_tx_watch: epoll_ctl failed <%s>, efd=%d, fd=%d\n",
+			MG_LOG_ERR("mg_epoll_fd_mod: epoll_ctl failed <%s>, efd=%d, fd=%d\n",
 			           strerror(errno), efd, mg_skt_fd(mg_skt));
 			assert(0);
 		}
 		return 0;
+	}
+	// watch for tx complete event
+	int fd_tx_watch(class mg_skt *mg_skt, int enable)
+	{
+		return fd_mod(mg_skt);
+	};
+	// watch for rx events, off while paused
+	int fd_rx_watch(class mg_skt *mg_skt, int enable)
+	{
+		return fd_mod(mg_skt);
 	};
 	// wait_for_events
 	int wait_for_events(void)
 	{
 		struct epoll_event events[MAXEVENTS], *e;
 		int i, err = 0;
-		int n = epoll_wait(efd, events, MAXEVENTS, -1);
+		/* sleep no longer than until the next timer is due */
+		int n = epoll_wait(efd, events, MAXEVENTS, mg_poll_timeout(_mg_handle));
 		if (n < 0) {
 			if (errno == EINTR) {
 				MG_LOG_DBG("wait_for_events: signal interrupt...resuming\n");
@@ -120,32 +139,30 @@ public:
 				err = errno;
 				assert(0);
 			}
-			return 0;
+			n = 0;
 		}
+		mg_wait_done(_mg_handle, n);
 		for (i = 0, e = events; i < n; i++, e++) {
-			if (e->events & EPOLLHUP) {
+			if ((e->events & EPOLLHUP) && !(e->events & (EPOLLIN | EPOLLERR))) {
 				continue;
 			}
-			assert((e->events & EPOLLERR) == 0);
 			class mg_skt *mg_skt = (class mg_skt*)e->data.ptr;
 			if (e->events & (EPOLLOUT)) {
 				mg_dequeue(mg_skt);
 			}
-			if (e->events & (EPOLLIN)) {
-				if (mg_skt) {
-					mg_rx(mg_skt);
-				}
-				else {
-					uint64_t exp;
-					int s = read(timer_fd, &exp, sizeof(uint64_t));
-					assert(s == sizeof(uint64_t));
-					mg_timeout(_mg_handle);
-				}
+			/*
+			 * EPOLLERR: a socket error, reported by the read, or
+			 * MSG_ZEROCOPY completions on the error queue
+			 */
+			if (e->events & (EPOLLIN | EPOLLERR)) {
+				mg_rx(mg_skt);
 			}
 		}
+		mg_timeout(_mg_handle);
+		mg_events_done(_mg_handle);
 		return err;
 	}
 };
 
-// create an instance of this: constructor calls mg_register()
+// create the prototype instance: constructor calls mg_register()
 static class mg_skt_poll_epoll mg_epoll;
@@ -0,0 +1,264 @@
+/*
+
+    COPYRIGHT AND PERMISSION NOTICE
+    Copyright (c) 2015-2020 Mark Griffiths
+    All rights reserved.
+    Permission to use, copy, modify, and distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+    OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+    USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the name of a copyright holder shall
+    not be used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization of the
+    copyright holder.
+
+	"mg-skt" non-blocking sockets abstraction layer event log.
+
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include "mg-skt_log.h"
+
+using namespace std;
+
+#define MG_LOG_RING_MASK  (MG_LOG_RING_SIZE - 1)
+#define MG_LOG_DRAIN_MS   10		// drainer sweep interval
+#define MG_LOG_LINE       512
+
+/*
+ * Single producer / single consumer ring: only its own thread writes
+ * records, only the holder of mg_log_drain_lock reads them.
+ */
+class mg_log_ring {
+public:
+	mg_log_rec_t rec[MG_LOG_RING_SIZE];
+	atomic<uint64_t> head;		// next record to write
+	atomic<uint64_t> tail;		// next record to format
+	atomic<uint64_t> dropped;	// records lost to a full ring
+	uint64_t dropped_seen;		// consumer side
+	int id;
+	mg_log_ring(int id) : head(0), tail(0), dropped(0)
+	{
+		dropped_seen = 0;
+		this->id = id;
+	}
+};
+
+/* rings are never freed, they may outlive their thread until drained */
+static mutex mg_log_drain_lock;
+static vector<class mg_log_ring*> mg_log_rings;
+static thread_local class mg_log_ring *mg_log_ring_cur;
+
+/* takes one argument per conversion, formatting it with its real type */
+static int mg_log_format(char *out, size_t size, const char *fmt,
+                         const uint64_t *args, int nargs)
+{
+	size_t o = 0;
+	int a = 0;
+	while (*fmt && o + 1 < size) {
+		if (*fmt != '%') {
+			out[o++] = *fmt++;
+			continue;
+		}
+		if (fmt[1] == '%') {
+			out[o++] = '%';
+			fmt += 2;
+			continue;
+		}
+		/* %[flags][width][.precision][length]conversion */
+		const char *start = fmt++;
+		fmt += strspn(fmt, "-+ #0");
+		fmt += strspn(fmt, "0123456789");
+		if (*fmt == '.') {
+			fmt++;
+			fmt += strspn(fmt, "0123456789");
+		}
+		const char *len = fmt;
+		fmt += strspn(fmt, "hlzjtL");
+		char conv = *fmt;
+		if (!conv) {
+			break;
+		}
+		fmt++;
+		char spec[32];
+		size_t sl = fmt - start;
+		if (sl >= sizeof(spec) || a >= nargs) {
+			/* can't be formatted, leave it as it is */
+			sl = sl < size - o - 1 ? sl : size - o - 1;
+			memcpy(out + o, start, sl);
+			o += sl;
+			continue;
+		}
+		memcpy(spec, start, sl);
+		spec[sl] = 0;
+		uint64_t v = args[a++];
+		char *p = out + o;
+		size_t n = size - o;
+		int l;
+		int lmod = fmt - 1 - len;	// length modifier characters
+		switch (conv) {
+		case 'd':
+		case 'i':
+			if (!lmod || *len == 'h') {
+				l = snprintf(p, n, spec, (int)v);
+			}
+			else if (*len == 'z' || *len == 't') {
+				l = snprintf(p, n, spec, (ptrdiff_t)v);
+			}
+			else {
+				l = snprintf(p, n, spec, (long long)v);
+			}
+			break;
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			if (!lmod || *len == 'h') {
+				l = snprintf(p, n, spec, (unsigned)v);
+			}
+			else if (*len == 'z' || *len == 't') {
+				l = snprintf(p, n, spec, (size_t)v);
+			}
+			else {
+				l = snprintf(p, n, spec, (unsigned long long)v);
+			}
+			break;
+		case 'c':
+			l = snprintf(p, n, spec, (int)v);
+			break;
+		case 's':
+			l = snprintf(p, n, spec, v ? (const char*)(uintptr_t)v : "(null)");
+			break;
+		case 'p':
+			l = snprintf(p, n, spec, (void*)(uintptr_t)v);
+			break;
+		default: {
+			double d;
+			memcpy(&d, &v, sizeof(d));
+			l = snprintf(p, n, spec, d);
+			break;
+		}
+		}
+		if (l > 0) {
+			o += (size_t)l < n ? (size_t)l : n - 1;
+		}
+	}
+	out[o] = 0;
+	return o;
+}
+
+/* format every pending record, called with mg_log_drain_lock held */
+static void mg_log_drain(void)
+{
+	char line[MG_LOG_LINE];
+	int any = 0;
+	for (class mg_log_ring *r : mg_log_rings) {
+		uint64_t t = r->tail.load(memory_order_relaxed);
+		uint64_t h = r->head.load(memory_order_acquire);
+		for (; t != h; t++) {
+			mg_log_rec_t *rec = &r->rec[t & MG_LOG_RING_MASK];
+			mg_log_format(line, sizeof(line), rec->fmt, rec->args, rec->nargs);
+			printf("%5llu.%06llu %d %s %s", (unsigned long long)(rec->ts / 1000000000),
+			       (unsigned long long)(rec->ts / 1000 % 1000000), r->id,
+			       rec->level == MG_LOG_LEVEL_ERR ? "ERR" : "DBG", line);
+			any = 1;
+		}
+		r->tail.store(t, memory_order_release);
+		uint64_t dropped = r->dropped.load(memory_order_relaxed);
+		if (dropped != r->dropped_seen) {
+			printf("mg_log: %llu records dropped by %d\n",
+			       (unsigned long long)(dropped - r->dropped_seen), r->id);
+			r->dropped_seen = dropped;
+			any = 1;
+		}
+	}
+	if (any) {
+		fflush(stdout);
+	}
+}
+
+void mg_log_flush(void)
+{
+	lock_guard<mutex> lock(mg_log_drain_lock);
+	mg_log_drain();
+}
+
+/* sweeps the rings until the process exits, then drains them one last time */
+class mg_log_drainer {
+public:
+	atomic<int> stop;
+	thread t;
+	mg_log_drainer() : stop(0) {}
+	~mg_log_drainer()
+	{
+		if (t.joinable()) {
+			stop = 1;
+			t.join();
+		}
+		mg_log_flush();
+	}
+	void run(void)
+	{
+		while (!stop) {
+			this_thread::sleep_for(chrono::milliseconds(MG_LOG_DRAIN_MS));
+			mg_log_flush();
+		}
+	}
+};
+static class mg_log_drainer mg_log_drain_thread;
+
+static class mg_log_ring *mg_log_ring_open(void)
+{
+	lock_guard<mutex> lock(mg_log_drain_lock);
+	class mg_log_ring *r = new mg_log_ring(mg_log_rings.size());
+	mg_log_rings.push_back(r);
+	if (!mg_log_drain_thread.t.joinable()) {
+		mg_log_drain_thread.t = thread(&mg_log_drainer::run, &mg_log_drain_thread);
+	}
+	return r;
+}
+
+void mg_log_write(int level, const char *fmt, const uint64_t *args, int nargs)
+{
+	class mg_log_ring *r = mg_log_ring_cur;
+	struct timespec ts;
+	if (!r) {
+		r = mg_log_ring_cur = mg_log_ring_open();
+	}
+	uint64_t h = r->head.load(memory_order_relaxed);
+	if (h - r->tail.load(memory_order_acquire) >= MG_LOG_RING_SIZE) {
+		r->dropped.fetch_add(1, memory_order_relaxed);
+	}
+	else {
+		mg_log_rec_t *rec = &r->rec[h & MG_LOG_RING_MASK];
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		rec->ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		rec->fmt = fmt;
+		rec->level = level;
+		rec->nargs = nargs;
+		memcpy(rec->args, args, nargs * sizeof(args[0]));
+		r->head.store(h + 1, memory_order_release);
+	}
+	if (level == MG_LOG_LEVEL_ERR) {
+		/* errors are often followed by an assert(), don't lose them */
+		mg_log_flush();
+	}
+}
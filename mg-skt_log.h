@@ -0,0 +1,107 @@
+/*
+
+    COPYRIGHT AND PERMISSION NOTICE
+    Copyright (c) 2015-2020 Mark Griffiths
+    All rights reserved.
+    Permission to use, copy, modify, and distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+    OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+    USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the name of a copyright holder shall
+    not be used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization of the
+    copyright holder.
+
+ */
+
+
+#ifndef __MG_SKT_LOG_H__
+#define __MG_SKT_LOG_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+/*
+ * Binary event log. A log site doesn't format anything: it copies its
+ * format string pointer (the event id), a timestamp and its arguments
+ * into a fixed size record in the calling thread's ring, i.e. the ring of
+ * the event loop running on that thread. A background thread drains the
+ * rings and does the printf() formatting.
+ *
+ * Sites above MG_LOG_LEVEL compile out entirely, arguments included.
+ * %s arguments are stored as pointers, so they must outlive the record:
+ * string literals and strerror() are fine, stack buffers are not.
+ * When a ring is full, records are dropped and counted, the loop never
+ * waits for the drainer.
+ */
+#define MG_LOG_LEVEL_NONE 0
+#define MG_LOG_LEVEL_ERR  1
+#define MG_LOG_LEVEL_DBG  2
+
+#ifndef MG_LOG_LEVEL
+#define MG_LOG_LEVEL MG_LOG_LEVEL_ERR
+#endif
+
+#define MG_LOG_ARGS      5	// arguments per record
+#define MG_LOG_RING_SIZE 4096	// records per thread, power of 2
+
+typedef struct {
+	uint64_t ts;		// ns, CLOCK_MONOTONIC
+	const char *fmt;	// event id: the site's format string
+	uint32_t level;
+	uint32_t nargs;
+	uint64_t args[MG_LOG_ARGS];
+} mg_log_rec_t;
+
+void mg_log_write(int level, const char *fmt, const uint64_t *args, int nargs);
+/* format everything logged so far, also done for every error record */
+void mg_log_flush(void);
+
+template<typename T>
+static inline typename std::enable_if<std::is_integral<T>::value ||
+        std::is_enum<T>::value, uint64_t>::type mg_log_arg(T v)
+{
+	return (uint64_t)v;
+}
+template<typename T>
+static inline uint64_t mg_log_arg(T *v)
+{
+	return (uint64_t)(uintptr_t)v;
+}
+static inline uint64_t mg_log_arg(double v)
+{
+	uint64_t a;
+	memcpy(&a, &v, sizeof(a));
+	return a;
+}
+
+template<typename... Args>
+static inline void mg_log(int level, const char *fmt, Args... args)
+{
+	static_assert(sizeof...(Args) <= MG_LOG_ARGS, "too many log arguments");
+	uint64_t a[] = { mg_log_arg(args)..., 0 };
+	mg_log_write(level, fmt, a, sizeof...(Args));
+}
+
+#if (MG_LOG_LEVEL >= MG_LOG_LEVEL_DBG)
+#define MG_LOG_DBG(...) mg_log(MG_LOG_LEVEL_DBG, __VA_ARGS__)
+#else
+#define MG_LOG_DBG(...) do { } while (0)
+#endif
+
+#if (MG_LOG_LEVEL >= MG_LOG_LEVEL_ERR)
+#define MG_LOG_ERR(...) mg_log(MG_LOG_LEVEL_ERR, __VA_ARGS__)
+#else
+#define MG_LOG_ERR(...) do { } while (0)
+#endif
+
+#endif // __MG_SKT_LOG_H__
@@ -0,0 +1,138 @@
+/*
+
+    COPYRIGHT AND PERMISSION NOTICE
+    Copyright (c) 2015-2020 Mark Griffiths
+    All rights reserved.
+    Permission to use, copy, modify, and distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+    OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+    USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the name of a copyright holder shall
+    not be used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization of the
+    copyright holder.
+
+	"mg-skt" non-blocking sockets abstraction layer offload thread pool.
+
+ */
+
+#include <assert.h>
+#include "mg-skt_offload.h"
+
+mg_offload::mg_offload(int threads, uint32_t queue_max)
+{
+	assert(threads > 0);
+	next = 0;
+	pending = 0;
+	sleepers = 0;
+	stopping = 0;
+	for (int i = 0; i < threads; i++) {
+		class mg_offload_queue *q = new mg_offload_queue;
+		q->ring.resize(queue_max ? queue_max : MG_OFFLOAD_QUEUE);
+		queues.push_back(q);
+	}
+	for (int i = 0; i < threads; i++) {
+		workers.push_back(std::thread(&mg_offload::run, this, i));
+	}
+}
+
+mg_offload::~mg_offload()
+{
+	{
+		std::lock_guard<std::mutex> l(idle_lock);
+		stopping = 1;
+	}
+	idle_cv.notify_all();
+	for (std::thread &t : workers) {
+		t.join();
+	}
+	for (class mg_offload_queue *q : queues) {
+		delete q;
+	}
+}
+
+int mg_offload::push(class mg_offload_queue *q, class mg_offload_job *job)
+{
+	std::lock_guard<std::mutex> l(q->lock);
+	if (q->len == q->ring.size()) {
+		return -1;
+	}
+	q->ring[(q->head + q->len++) % q->ring.size()] = job;
+	return 0;
+}
+
+class mg_offload_job *mg_offload::pop(class mg_offload_queue *q)
+{
+	std::lock_guard<std::mutex> l(q->lock);
+	if (!q->len) {
+		return NULL;
+	}
+	class mg_offload_job *job = q->ring[q->head];
+	q->head = (q->head + 1) % q->ring.size();
+	q->len--;
+	return job;
+}
+
+int mg_offload::submit(class mg_offload_job *job)
+{
+	uint32_t n = queues.size();
+	uint32_t first = next.fetch_add(1, std::memory_order_relaxed);
+	uint32_t i;
+	for (i = 0; i < n; i++) {
+		/* the next queue round robin, or any other with room */
+		if (push(queues[(first + i) % n], job) == 0) {
+			break;
+		}
+	}
+	if (i == n) {
+		return -1;
+	}
+	pending++;
+	if (sleepers) {
+		std::lock_guard<std::mutex> l(idle_lock);
+		idle_cv.notify_one();
+	}
+	return 0;
+}
+
+/* own queue first, then steal from the others */
+class mg_offload_job *mg_offload::take(int id)
+{
+	int n = queues.size();
+	for (int i = 0; i < n; i++) {
+		class mg_offload_job *job = pop(queues[(id + i) % n]);
+		if (job) {
+			pending--;
+			return job;
+		}
+	}
+	return NULL;
+}
+
+void mg_offload::run(int id)
+{
+	for (;;) {
+		class mg_offload_job *job = take(id);
+		if (!job) {
+			std::unique_lock<std::mutex> l(idle_lock);
+			sleepers++;
+			/* queued jobs are still run once stopping */
+			idle_cv.wait(l, [this] { return pending > 0 || stopping; });
+			sleepers--;
+			if (pending <= 0 && stopping) {
+				return;
+			}
+			continue;
+		}
+		job->work(job->arg);
+		job->complete(job);
+	}
+}
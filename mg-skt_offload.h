@@ -0,0 +1,78 @@
+/*
+
+    COPYRIGHT AND PERMISSION NOTICE
+    Copyright (c) 2015-2020 Mark Griffiths
+    All rights reserved.
+    Permission to use, copy, modify, and distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+    OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+    USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the name of a copyright holder shall
+    not be used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization of the
+    copyright holder.
+
+ */
+
+#ifndef __MG_SKT_OFFLOAD_H__
+#define __MG_SKT_OFFLOAD_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define MG_OFFLOAD_QUEUE 256	// default jobs per worker queue
+
+class mg_offload_job {
+public:
+	void (*work)(void*);
+	void *arg;
+	/* on the worker, once work(arg) has returned */
+	void (*complete)(class mg_offload_job*);
+};
+
+/*
+ * Work-stealing thread pool. Every worker has its own bounded queue;
+ * jobs are spread round robin over the queues and a worker whose queue
+ * is empty takes from the others before going to sleep. Thread safe.
+ */
+class mg_offload {
+public:
+	mg_offload(int threads, uint32_t queue_max);
+	~mg_offload();		// runs the jobs still queued, then joins the workers
+	int submit(class mg_offload_job *job);	// -1 if every queue is full
+	int threads(void) { return (int)workers.size(); }
+private:
+	class mg_offload_queue {
+	public:
+		std::mutex lock;
+		std::vector<class mg_offload_job*> ring;
+		uint32_t head = 0;
+		uint32_t len = 0;
+	};
+	std::vector<class mg_offload_queue*> queues;
+	std::vector<std::thread> workers;
+	std::atomic<uint32_t> next;	// queue the next job goes to
+	std::atomic<int> pending;	// jobs queued, all queues
+	std::atomic<int> sleepers;
+	int stopping;
+	std::mutex idle_lock;
+	std::condition_variable idle_cv;
+	int push(class mg_offload_queue *q, class mg_offload_job *job);
+	class mg_offload_job *pop(class mg_offload_queue *q);
+	class mg_offload_job *take(int id);
+	void run(int id);
+};
+
+#endif // __MG_SKT_OFFLOAD_H__
@@ -25,30 +25,49 @@
 #ifndef __MG_SKT_POLL_H__
 #define __MG_SKT_POLL_H__
 
-#if (1)	// set to 1 for debug messages
-#define MG_LOG_DBG(...) printf(__VA_ARGS__)
-#else
-#define MG_LOG_DBG(...)
-#endif
-
-#if (1)	// set to 1 for error messages
-#define MG_LOG_ERR(...) printf(__VA_ARGS__)
-#else
-#define MG_LOG_ERR(...)
-#endif
+/* MG_LOG_DBG / MG_LOG_ERR, compiled in up to MG_LOG_LEVEL */
+#include "mg-skt_log.h"
 
+/*
+ * The instance registered through mg_register() is only a prototype:
+ * every mg loop gets its own driver from create(), so several loops
+ * (e.g. one per reactor thread) never share driver state.
+ */
 class mg_skt_poll_drv {
 public:
     std::string name;
+	virtual ~mg_skt_poll_drv() {};
+	virtual mg_skt_poll_drv *create(void) { return NULL; };
 	virtual int init(class mg*) { return 0; };
+	/* -1 if fd can't be watched, the socket is then closed on the next pass */
 	virtual int fd_add(int fd, class mg_skt*) { return 0; };
 	virtual int fd_del(class mg_skt*) { return 0; };
 	virtual int fd_tx_watch(class mg_skt*, int) { return 0; };
+	virtual int fd_rx_watch(class mg_skt*, int) { return 0; };
+	/*
+	 * Completion drivers only: finish the read still in the kernel now,
+	 * its result goes to mg_rx_comp_held(), and leave rx unarmed.
+	 */
+	virtual int fd_rx_sync(class mg_skt*) { return 0; };
 	virtual int wait_for_events(void) { return 0; };
 };
 void mg_register(std::string name, mg_skt_poll_drv *drv);
 void mg_dequeue(class mg_skt*);
 void mg_rx(class mg_skt*);
-void mg_timeout(class mg*);
+/*
+ * Completion reads: a buffer to read into instead of waiting for
+ * readiness, NULL if the socket must be polled, then the read's result
+ * (bytes or -errno) with the buffer, delivered or, from fd_rx_sync(),
+ * kept for whoever reads the socket next.
+ */
+void *mg_rx_comp_buf(class mg_skt*, unsigned char **data, size_t *size);
+void mg_rx_comp(class mg_skt*, void *buf, int res);
+void mg_rx_comp_held(class mg_skt*, void *buf, int res);
+void mg_timeout(class mg*);	// run due timers, after every wait
+int mg_poll_timeout(class mg*);	// ms the driver may block for, -1 = forever
+void mg_wait_done(class mg*, int events);	// straight after the kernel wait
+void mg_events_done(class mg*);	// end of each wait_for_events() batch
+int mg_skt_rx_watched(class mg_skt*);	// current interest of a socket
+int mg_skt_tx_watched(class mg_skt*);
 
 #endif // __MG_SKT_POLL_H__
@@ -0,0 +1,90 @@
+/*
+
+    COPYRIGHT AND PERMISSION NOTICE
+    Copyright (c) 2015-2020 Mark Griffiths
+    All rights reserved.
+    Permission to use, copy, modify, and distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+    OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+    USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the name of a copyright holder shall
+    not be used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization of the
+    copyright holder.
+
+	"mg-skt" non-blocking sockets abstraction layer object pools.
+
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include "mg-skt_pool.h"
+
+#define MG_POOL_ALIGN 16
+
+mg_pool::mg_pool(size_t size)
+{
+	this->size = (size + MG_POOL_ALIGN - 1) & ~(size_t)(MG_POOL_ALIGN - 1);
+	used = 0;
+	total = 0;
+	free_list = NULL;
+}
+
+mg_pool::~mg_pool()
+{
+	for (void *slab : slab_list) {
+		free(slab);
+	}
+}
+
+/* carve at least n more objects, a slab's worth at the least */
+void mg_pool::grow(size_t n)
+{
+	size_t per_slab = MG_POOL_SLAB / size;
+	if (n < per_slab) {
+		n = per_slab;
+	}
+	unsigned char *slab = (unsigned char*)malloc(n * size);
+	assert(slab);
+	slab_list.push_back(slab);
+	for (size_t i = n; i > 0; i--) {
+		struct mg_pool_obj *o = (struct mg_pool_obj*)(slab + (i - 1) * size);
+		o->next = free_list;
+		free_list = o;
+	}
+	total += n;
+}
+
+void *mg_pool::get(void)
+{
+	if (!free_list) {
+		grow(1);
+	}
+	struct mg_pool_obj *o = free_list;
+	free_list = o->next;
+	used++;
+	return o;
+}
+
+void mg_pool::put(void *p)
+{
+	struct mg_pool_obj *o = (struct mg_pool_obj*)p;
+	o->next = free_list;
+	free_list = o;
+	used--;
+}
+
+void mg_pool::reserve(size_t n)
+{
+	if (total - used < n) {
+		grow(n - (total - used));
+	}
+}
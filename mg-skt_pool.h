@@ -0,0 +1,58 @@
+/*
+
+    COPYRIGHT AND PERMISSION NOTICE
+    Copyright (c) 2015-2020 Mark Griffiths
+    All rights reserved.
+    Permission to use, copy, modify, and distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+    OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+    USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the name of a copyright holder shall
+    not be used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization of the
+    copyright holder.
+
+ */
+
+#ifndef __MG_SKT_POOL_H__
+#define __MG_SKT_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#define MG_POOL_SLAB (1 << 18)	// bytes malloc()ed at a time, at least one object
+
+/*
+ * Fixed size object pool. Objects are carved out of slabs allocated a
+ * batch at a time and recycled through a free list; the slabs are only
+ * freed with the pool, so its memory is the high water mark of its use.
+ * Not thread safe: each event loop has its own pools.
+ */
+class mg_pool {
+public:
+	mg_pool(size_t size);
+	~mg_pool();
+	void *get(void);
+	void put(void *p);
+	void reserve(size_t n);	// make sure n more objects can be had without malloc()
+	size_t size;		// object size, rounded up for alignment
+	size_t used;		// objects handed out
+	size_t total;		// objects carved out of the slabs
+private:
+	struct mg_pool_obj {
+		struct mg_pool_obj *next;
+	} *free_list;
+	std::vector<void*> slab_list;
+	void grow(size_t n);
+};
+
+#endif // __MG_SKT_POOL_H__
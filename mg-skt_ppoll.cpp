@@ -0,0 +1,214 @@
+/*
+
+    COPYRIGHT AND PERMISSION NOTICE
+    Copyright (c) 2015-2020 Mark Griffiths
+    All rights reserved.
+    Permission to use, copy, modify, and distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+    OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+    USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the name of a copyright holder shall
+    not be used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization of the
+    copyright holder.
+
+	"mg-skt" non-blocking sockets abstraction layer poll module.
+
+ */
+
+#include <sys/socket.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+#include "mg-skt.h"
+#include "mg-skt_poll.h"
+#include <vector>
+
+using namespace std;
+
+/*
+ * A densely packed pollfd array, kept up to date by fd_add / fd_del /
+ * fd_tx_watch: it is handed to poll() as it is on every pass. Removal
+ * moves the last entry into the hole; the array is walked from the end,
+ * so the entries not yet seen in the current pass stay below dispatch_pos.
+ */
+class mg_skt_poll_ppoll : mg_skt_poll_drv {
+private:
+	class mg *_mg_handle;
+	vector<struct pollfd> pfd_list;
+	vector<class mg_skt*> skt_list;	// socket of each pfd_list entry
+	vector<int> fd_index;		// pfd_list position by fd, -1 if unused
+	size_t dispatch_pos;		// entries below it are yet to be dispatched
+	int fd_pos(int fd)
+	{
+		assert(fd >= 0 && fd < (int)fd_index.size() && fd_index[fd] >= 0);
+		return fd_index[fd];
+	}
+	void mg_pfd_dispatch(void)
+	{
+		for (dispatch_pos = pfd_list.size(); dispatch_pos > 0;) {
+			dispatch_pos--;
+			if (dispatch_pos >= pfd_list.size()) {
+				/* entries removed by the last callbacks */
+				continue;
+			}
+			struct pollfd *pfd = &pfd_list[dispatch_pos];
+			short revents = pfd->revents;
+			class mg_skt *skt = skt_list[dispatch_pos];
+			if (!revents) {
+				continue;
+			}
+			pfd->revents = 0;
+			if (revents & POLLNVAL) {
+				MG_LOG_ERR("mg_ppoll[%d]: fd closed but not removed\n", pfd->fd);
+				continue;
+			}
+			if (revents & POLLOUT) {
+				mg_dequeue(skt);
+			}
+			/* errors and hang ups are reported by the read */
+			if (revents & (POLLIN | POLLHUP | POLLERR)) {
+				mg_rx(skt);
+			}
+		}
+	}
+public:
+	const char *name = "poll";
+	// constructor
+	mg_skt_poll_ppoll()
+	{
+		mg_register(name, this);
+	};
+	mg_skt_poll_ppoll(const mg_skt_poll_ppoll &proto)
+	{
+		_mg_handle = NULL;
+		dispatch_pos = 0;
+	};
+	// new driver instance for an mg loop
+	mg_skt_poll_drv *create(void)
+	{
+		return new mg_skt_poll_ppoll(*this);
+	}
+	int init(class mg *mg_handle)
+	{
+		_mg_handle = mg_handle;
+		return 0;
+	}
+	// add a file descriptor
+	int fd_add(int fd, class mg_skt *skt)
+	{
+		struct pollfd pfd;
+		if (fd >= (int)fd_index.size()) {
+			fd_index.resize(fd + 1, -1);
+		}
+		assert(fd_index[fd] < 0);
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		fd_index[fd] = pfd_list.size();
+		pfd_list.push_back(pfd);
+		skt_list.push_back(skt);
+		return 0;
+	}
+	int fd_del(class mg_skt *skt)
+	{
+		int fd = mg_skt_fd(skt);
+		size_t pos = fd_pos(fd);
+		size_t last = pfd_list.size() - 1;
+		assert(skt_list[pos] == skt);
+		if (pos != last) {
+			pfd_list[pos] = pfd_list[last];
+			skt_list[pos] = skt_list[last];
+			fd_index[mg_skt_fd(skt_list[pos])] = pos;
+			if (last >= dispatch_pos) {
+				/* already dispatched in this pass */
+				pfd_list[pos].revents = 0;
+			}
+		}
+		pfd_list.pop_back();
+		skt_list.pop_back();
+		fd_index[fd] = -1;
+		return 0;
+	}
+	/*
+	 * events of interest changed. With none, e.g. paused, the fd is
+	 * negated so that poll() skips it rather than report POLLHUP.
+	 */
+	int fd_mod(class mg_skt *mg_skt)
+	{
+		int fd = mg_skt_fd(mg_skt);
+		struct pollfd *pfd = &pfd_list[fd_pos(fd)];
+		pfd->events = 0;
+		if (mg_skt_rx_watched(mg_skt)) {
+			pfd->events |= POLLIN;
+		}
+		if (mg_skt_tx_watched(mg_skt)) {
+			pfd->events |= POLLOUT;
+		}
+		pfd->fd = pfd->events ? fd : ~fd;
+		return 0;
+	}
+	// watch for tx complete event
+	int fd_tx_watch(class mg_skt *mg_skt, int enable)
+	{
+		MG_LOG_DBG("fd_tx_watch [%d] enable = %d\n", mg_skt_fd(mg_skt), enable);
+		return fd_mod(mg_skt);
+	};
+	// watch for rx events, off while paused
+	int fd_rx_watch(class mg_skt *mg_skt, int enable)
+	{
+		MG_LOG_DBG("fd_rx_watch [%d] enable = %d\n", mg_skt_fd(mg_skt), enable);
+		return fd_mod(mg_skt);
+	};
+	// wait_for_events
+	int wait_for_events(void)
+	{
+		int err = 0;
+		/* sleep no longer than until the next timer is due */
+		int ms = mg_poll_timeout(_mg_handle);
+#ifdef __linux__
+		struct timespec ts, *tp = NULL;
+		if (ms >= 0) {
+			ts.tv_sec = ms / 1000;
+			ts.tv_nsec = (long)(ms % 1000) * 1000000;
+			tp = &ts;
+		}
+		int n = ppoll(pfd_list.data(), pfd_list.size(), tp, NULL);
+#else
+		int n = poll(pfd_list.data(), pfd_list.size(), ms);
+#endif
+		mg_wait_done(_mg_handle, n > 0 ? n : 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				MG_LOG_DBG("mg_ppoll: signal interrupt...resuming\n");
+			}
+			else {
+				MG_LOG_ERR("mg_ppoll: poll err %s\n", strerror(errno));
+				err = errno;
+				assert(0);
+			}
+		}
+		else if (n > 0) {
+			mg_pfd_dispatch();
+		}
+		/* timers are due whether or not there was traffic */
+		mg_timeout(_mg_handle);
+		mg_events_done(_mg_handle);
+		return err;
+	}
+};
+
+// create the prototype instance: constructor calls mg_register()
+static class mg_skt_poll_ppoll mg_ppoll;
@@ -25,99 +25,61 @@
  */
 
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
-#include <fcntl.h>
+#include <time.h>
 #include <assert.h>
 #include "mg-skt.h"
 #include "mg-skt_poll.h"
-#include <unordered_map>
+#include <vector>
 
 using namespace std;
 
-#define MG_FD_LIST_SIZE  32
-
-typedef struct mg_timer_cb {
-	struct mg_timer_cb *next;
-	void *handle;
-	void (*callback)(void*);
-} mg_timer_cb_t;
-
-class mg_fd_list_entry {
-public:
-	class mg_skt *mg_skt;
-	int tx_watch;
-	int deleting;
-	int tx_watch_timestamp;
-	mg_fd_list_entry(class mg_skt *skt)
-	{
-		mg_skt = skt;
-		tx_watch = 0;
-		deleting = 0;
-	}
-};
-
+/*
+ * The fd_sets handed to select() are copies of master sets that are only
+ * touched by fd_add / fd_del / fd_tx_watch, nothing is rebuilt per pass.
+ * Sockets are looked up by fd number, so fds are limited to FD_SETSIZE.
+ */
 class mg_skt_poll_select : mg_skt_poll_drv {
 private:
 	class mg *_mg_handle;
-	mg_timer_cb_t *timer_cb_first;
-	int fd_isset_in_progress;
-	unordered_map<int, mg_fd_list_entry*> fd_list;
-	struct timeval timeout;
-	int mg_fd_set(fd_set *rx_fds, fd_set *tx_fds)
-	{
-		int max_fd = 0;
-		FD_ZERO(rx_fds);
-		FD_ZERO(tx_fds);
-		for (auto it = fd_list.begin(); it != fd_list.end(); it++) {
-			int fd = it->first;
-			mg_fd_list_entry *le = it->second;
-			assert(le->deleting == 0);
-			FD_SET(fd, rx_fds);
-			if (le->tx_watch) {
-				printf("mg_fd_set[%d]: tx_watch\n", fd);
-				FD_SET(fd, tx_fds);
-				fcntl(fd, F_SETFL, (fcntl(fd, F_GETFL) | O_NONBLOCK));
-			}
-			if (fd > max_fd) {
-				max_fd = fd;
-			}
-		}
-		return max_fd;
-	}
-	int mg_fd_isset(fd_set *rx_fds, fd_set *tx_fds)
+	fd_set rx_fds_master, tx_fds_master;
+	int max_fd;
+	fd_set *rx_fds_cur, *tx_fds_cur;	// sets being walked by mg_fd_isset()
+	vector<class mg_skt*> fd_list;		// indexed by fd, NULL if unused
+	void mg_fd_isset(fd_set *rx_fds, fd_set *tx_fds, int n)
 	{
-		fd_isset_in_progress = 1;
-		for (auto it = fd_list.begin(); it != fd_list.end(); it++) {
-			int fd = it->first;
-			mg_fd_list_entry *le = it->second;
-			if (le->deleting) {
-				FD_CLR(fd, tx_fds);
-				FD_CLR(fd, rx_fds);
+		rx_fds_cur = rx_fds;
+		tx_fds_cur = tx_fds;
+		/* stop as soon as all n ready fds are seen */
+		for (int fd = 0; fd <= max_fd && n > 0; fd++) {
+			int tx = FD_ISSET(fd, tx_fds);
+			int rx = FD_ISSET(fd, rx_fds);
+			if (!tx && !rx) {
 				continue;
 			}
-			if (FD_ISSET(fd, tx_fds)) {
-				mg_dequeue(le->mg_skt);
-				FD_CLR(fd, tx_fds);
+			n -= (tx != 0) + (rx != 0);
+			class mg_skt *skt = fd_list[fd];
+			if (tx) {
+				mg_dequeue(skt);
 			}
-			if (FD_ISSET(fd, rx_fds)) {
-				mg_rx(le->mg_skt);
-				FD_CLR(fd, rx_fds);
+			/* the socket may have been closed, or the fd reused, by now */
+			if (rx && FD_ISSET(fd, rx_fds)) {
+				mg_rx(fd_list[fd]);
 			}
 		}
-		fd_isset_in_progress = 0;
-		/* clean up deleted fds */
-		for (auto it = fd_list.begin(), it_next = it; it != fd_list.end(); it = it_next) {
-			it_next = next(it, 1);
-			mg_fd_list_entry *le = it->second;
-			if (le->deleting) {
-				delete(it->second);
-				fd_list.erase(it);
-			}
+		rx_fds_cur = tx_fds_cur = NULL;
+	}
+	/* an fd of the current pass changed hands, drop its pending events */
+	void fd_forget(int fd)
+	{
+		if (rx_fds_cur) {
+			FD_CLR(fd, rx_fds_cur);
+			FD_CLR(fd, tx_fds_cur);
 		}
-		return 0;
 	}
 public:
 	const char *name = "select";
@@ -125,54 +87,101 @@ public:
 	mg_skt_poll_select()
 	{
 		mg_register(name, this);
-		timeout.tv_sec = 1;
-		timeout.tv_usec = 0;
 	};
+	mg_skt_poll_select(const mg_skt_poll_select &proto)
+	{
+		_mg_handle = NULL;
+		FD_ZERO(&rx_fds_master);
+		FD_ZERO(&tx_fds_master);
+		max_fd = -1;
+		rx_fds_cur = tx_fds_cur = NULL;
+	};
+	// new driver instance for an mg loop
+	mg_skt_poll_drv *create(void)
+	{
+		return new mg_skt_poll_select(*this);
+	}
 	int init(class mg *mg_handle)
 	{
 		_mg_handle = mg_handle;
 		return 0;
 	}
-	// add a file descriptor
+	// add a file descriptor, -1 if select() can't take it
 	int fd_add(int fd, class mg_skt *skt)
 	{
-		assert(fd_list.size() < MG_FD_LIST_SIZE);
-		fd_list.emplace(fd, new mg_fd_list_entry(skt));
+		if (fd >= FD_SETSIZE) {
+			MG_LOG_DBG("mg_select_fd_add[%d]: above FD_SETSIZE (%d)\n", fd, FD_SETSIZE);
+			return -1;
+		}
+		if (fd >= (int)fd_list.size()) {
+			fd_list.resize(fd + 1, NULL);
+		}
+		assert(!fd_list[fd]);
+		fd_list[fd] = skt;
+		FD_SET(fd, &rx_fds_master);
+		fd_forget(fd);
+		if (fd > max_fd) {
+			max_fd = fd;
+		}
 		return 0;
 	}
 	int fd_del(class mg_skt *skt)
 	{
-		assert(fd_list.size());
-		auto it = fd_list.find(mg_skt_fd(skt));
-		assert(it != fd_list.end());
-		if (fd_isset_in_progress) {
-			mg_fd_list_entry *le = it->second;
-			le->deleting = 1;
-		}
-		else {
-			delete(it->second);
-			fd_list.erase(it);
+		int fd = mg_skt_fd(skt);
+		assert(fd < (int)fd_list.size() && fd_list[fd] == skt);
+		fd_list[fd] = NULL;
+		FD_CLR(fd, &rx_fds_master);
+		FD_CLR(fd, &tx_fds_master);
+		fd_forget(fd);
+		while (max_fd >= 0 && !fd_list[max_fd]) {
+			max_fd--;
 		}
 		return 0;
 	}
 	// watch for tx complete event
 	int fd_tx_watch(class mg_skt *mg_skt, int enable)
 	{
-		MG_LOG_DBG("fd_tx_watch [%d] enable = %d, count = %lu\n", mg_skt_fd(mg_skt), enable, fd_list.size());
-		auto it = fd_list.find(mg_skt_fd(mg_skt));
-		assert(it != fd_list.end());
-		mg_fd_list_entry *le = it->second;
-		le->tx_watch = enable;
-		le->tx_watch_timestamp = enable ? time(NULL) : 0;
+		int fd = mg_skt_fd(mg_skt);
+		MG_LOG_DBG("fd_tx_watch [%d] enable = %d\n", fd, enable);
+		assert(fd < (int)fd_list.size() && fd_list[fd] == mg_skt);
+		if (enable) {
+			FD_SET(fd, &tx_fds_master);
+		}
+		else {
+			FD_CLR(fd, &tx_fds_master);
+		}
+		return 0;
+	};
+	// watch for rx events, off while paused
+	int fd_rx_watch(class mg_skt *mg_skt, int enable)
+	{
+		int fd = mg_skt_fd(mg_skt);
+		MG_LOG_DBG("fd_rx_watch [%d] enable = %d\n", fd, enable);
+		assert(fd < (int)fd_list.size() && fd_list[fd] == mg_skt);
+		if (enable) {
+			FD_SET(fd, &rx_fds_master);
+		}
+		else {
+			FD_CLR(fd, &rx_fds_master);
+		}
 		return 0;
 	};
 	// wait_for_events
 	int wait_for_events(void)
 	{
-		fd_set rx_fds, tx_fds;
+		fd_set rx_fds = rx_fds_master;
+		fd_set tx_fds = tx_fds_master;
+		struct timeval timeout, *tp = NULL;
 		int err = 0;
-		int max_fd = mg_fd_set(&rx_fds, &tx_fds);
-		int n = select(max_fd + 1, &rx_fds, &tx_fds, NULL, &timeout);
+		/* sleep no longer than until the next timer is due */
+		int ms = mg_poll_timeout(_mg_handle);
+		if (ms >= 0) {
+			timeout.tv_sec = ms / 1000;
+			timeout.tv_usec = (ms % 1000) * 1000;
+			tp = &timeout;
+		}
+		int n = select(max_fd + 1, &rx_fds, &tx_fds, NULL, tp);
+		mg_wait_done(_mg_handle, n > 0 ? n : 0);
 		if (n < 0) {
 			if (errno == EINTR) {
 				MG_LOG_DBG("mg_poll: signal interrupt...resuming\n");
@@ -184,15 +193,14 @@ public:
 			}
 		}
 		else if (n > 0) {
-			mg_fd_isset(&rx_fds, &tx_fds);
-		}
-		else {
-			mg_timeout(_mg_handle);
-			timeout.tv_sec = 1;
+			mg_fd_isset(&rx_fds, &tx_fds, n);
 		}
+		/* timers are due whether or not there was traffic */
+		mg_timeout(_mg_handle);
+		mg_events_done(_mg_handle);
 		return err;
 	}
 };
 
-// create an instance of this: constructor calls mg_register()
+// create the prototype instance: constructor calls mg_register()
 static class mg_skt_poll_select mg_select;
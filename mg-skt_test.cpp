@@ -0,0 +1,290 @@
+/*
+
+    COPYRIGHT AND PERMISSION NOTICE
+    Copyright (c) 2019-2020 Mark Griffiths
+    All rights reserved.
+    Permission to use, copy, modify, and distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+    OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+    USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the name of a copyright holder shall
+    not be used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization of the
+    copyright holder.
+
+    mg-skt library tests.
+
+	The timing wheel is driven by a simulated clock: expire() and
+	next_ms() take the time as an argument, only add() reads the real one.
+	The select driver is run with the process past FD_SETSIZE fds.
+
+	usage: mg-skt-test	(exits non-zero on the first failure)
+
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "mg-skt.h"
+#include "mg-skt_timer.h"
+
+#define TEST_TW_TIMERS 2000
+#define TEST_TW_RANGE  200000		// ms, spans level 0 .. 2
+#define TEST_FD_CLIENTS 3		// the first one still fits in an fd_set
+#define TEST_FD_MS     200
+
+#define CHECK(c) do { \
+	if (!(c)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #c); \
+		exit(1); \
+	} \
+} while (0)
+
+typedef struct {
+	mg_timer_cb t;
+	uint64_t *clock;
+	uint64_t fired_at;
+} test_timer_t;
+
+static void test_timer_cb(void *handle)
+{
+	test_timer_t *tt = (test_timer_t*)handle;
+	tt->fired_at = *tt->clock;
+}
+
+static void test_timer_init(test_timer_t *tt, uint64_t *clock)
+{
+	tt->t.handle = tt;
+	tt->t.callback = test_timer_cb;
+	tt->clock = clock;
+	tt->fired_at = 0;
+}
+
+/*
+ * A level 1 timer due just after a 256 ms boundary, with the wheel left
+ * exactly on that boundary: its slot is cascaded on the next expire().
+ */
+static void test_timer_boundary(void)
+{
+	mg_timer_wheel w;
+	test_timer_t tt;
+	uint64_t clock = mg_timer_wheel::now_ms();
+	uint64_t b = ((clock >> MG_TW_BITS) + 2) << MG_TW_BITS;
+	test_timer_init(&tt, &clock);
+	/* more than 256 ms ahead of the wheel, so it is filed on level 1 */
+	clock = b - 201;
+	w.expire(clock);
+	w.add(&tt.t, (uint32_t)(b + 61 - mg_timer_wheel::now_ms()));
+	CHECK(tt.t.expires > b && tt.t.expires < b + MG_TW_SIZE);
+	clock = b - 1;
+	w.expire(clock);
+	CHECK(w.next_ms(clock) == (int)(tt.t.expires - clock));
+	clock = tt.t.expires - 1;
+	w.expire(clock);
+	CHECK(w.fired == 0);
+	clock = tt.t.expires;
+	w.expire(clock);
+	CHECK(w.fired == 1);
+	CHECK(tt.fired_at == tt.t.expires);
+}
+
+/* sleeping exactly next_ms() between passes runs every timer on time */
+static void test_timer_random(void)
+{
+	mg_timer_wheel w;
+	std::vector<test_timer_t> tt(TEST_TW_TIMERS);
+	uint64_t clock = mg_timer_wheel::now_ms();
+	srand(1);
+	for (size_t i = 0; i < tt.size(); i++) {
+		test_timer_init(&tt[i], &clock);
+		w.add(&tt[i].t, rand() % TEST_TW_RANGE);
+	}
+	for (;;) {
+		int ms = w.next_ms(clock);
+		if (ms < 0) {
+			break;
+		}
+		CHECK(ms <= TEST_TW_RANGE);
+		clock += ms;
+		w.expire(clock);
+	}
+	CHECK(w.fired == TEST_TW_TIMERS);
+	for (size_t i = 0; i < tt.size(); i++) {
+		CHECK(tt[i].fired_at == tt[i].t.expires);
+	}
+}
+
+typedef struct {
+	mg_base *mg;
+	void *l;
+	void *skt[TEST_FD_CLIENTS];
+	int clients[TEST_FD_CLIENTS];
+	std::vector<int> fds;	// taking up the fds below FD_SETSIZE
+	struct sockaddr_in addr;
+	int accepted;
+	int connected;
+	int closed;
+	int err;		// of the outbound socket
+} test_fd_t;
+
+static void test_fd_stop(void *handle)
+{
+	((mg_base*)handle)->stop();
+}
+
+static void test_fd_rx(void *handle, struct sockaddr *addr, unsigned char *buf, int len)
+{
+}
+
+static void test_fd_connected(void *handle)
+{
+	((test_fd_t*)handle)->connected++;
+}
+
+static void test_fd_close(void *handle)
+{
+	((test_fd_t*)handle)->closed++;
+}
+
+static void **test_fd_accept(void *handle, mg_skt_param_t *p)
+{
+	test_fd_t *t = (test_fd_t*)handle;
+	p->handle = t;
+	p->rx = test_fd_rx;
+	p->connected = test_fd_connected;
+	p->close = test_fd_close;
+	return &t->skt[t->accepted++];
+}
+
+static void test_fd_out_close(void *handle)
+{
+	test_fd_t *t = (test_fd_t*)handle;
+	t->err = mg_skt_error(t->skt[0]);
+	t->mg->stop();
+}
+
+/* every client accepted: only the first one is still open */
+static void test_fd_accepted(void *handle)
+{
+	test_fd_t *t = (test_fd_t*)handle;
+	mg_skt_stats_t st;
+	char c = 0;
+	CHECK(t->accepted == TEST_FD_CLIENTS);
+	CHECK(t->connected == 1);
+	CHECK(t->closed == TEST_FD_CLIENTS - 1);
+	mg_skt_stats(t->l, &st);
+	CHECK(st.accept_drops == TEST_FD_CLIENTS - 1);
+	for (int i = 1; i < TEST_FD_CLIENTS; i++) {
+		CHECK(recv(t->clients[i], &c, 1, 0) <= 0);
+	}
+	CHECK(mg_skt_tx(t->skt[0], (unsigned char*)"x", 1) == 0);
+	CHECK(recv(t->clients[0], &c, 1, 0) == 1 && c == 'x');
+	t->mg->skt_close(t->skt[0]);
+	/* outbound: the one free fd left is past FD_SETSIZE */
+	int fd = open("/dev/null", O_RDONLY);
+	CHECK(fd == FD_SETSIZE - 1);
+	t->fds.push_back(fd);
+	mg_skt_param_t p = {
+		.handle = t,
+		.rx = test_fd_rx,
+		.close = test_fd_out_close,
+		.family = AF_INET,
+		.type = SOCK_STREAM,
+		.connect_addr = (struct sockaddr*)&t->addr,
+		.connect_addr_len = sizeof(t->addr),
+	};
+	t->skt[0] = t->mg->skt_open(&p);
+	CHECK(mg_skt_fd(t->skt[0]) >= FD_SETSIZE);
+}
+
+/*
+ * select: connections accepted past FD_SETSIZE are shed, a socket
+ * opened past it is reported closed, and the loop carries on.
+ */
+static void test_select_fds(void)
+{
+	test_fd_t t = {};
+	socklen_t len = sizeof(t.addr);
+	struct rlimit rl;
+	CHECK(getrlimit(RLIMIT_NOFILE, &rl) == 0);
+	if (rl.rlim_cur < FD_SETSIZE + 64) {
+		rl.rlim_cur = FD_SETSIZE + 64;
+		if (rl.rlim_cur > rl.rlim_max || setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+			printf("select fds: skipped, %d fds not allowed\n", FD_SETSIZE + 64);
+			return;
+		}
+	}
+	t.mg = new mg_base;
+	CHECK(t.mg->init("select") == 0);
+	t.addr.sin_family = AF_INET;
+	t.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	mg_listen_param_t lp = {
+		.handle = &t,
+		.accept = test_fd_accept,
+		.family = AF_INET,
+		.type = SOCK_STREAM,
+		.sock_addr = (struct sockaddr*)&t.addr,
+		.slen = sizeof(t.addr)
+	};
+	t.l = t.mg->listen_open(&lp);
+	CHECK(t.l);
+	getsockname(mg_skt_fd(t.l), (struct sockaddr*)&t.addr, &len);
+	for (int i = 0; i < TEST_FD_CLIENTS; i++) {
+		t.clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+		CHECK(t.clients[i] >= 0);
+		CHECK(connect(t.clients[i], (struct sockaddr*)&t.addr, sizeof(t.addr)) == 0);
+	}
+	/* one fd left below FD_SETSIZE, for the first connection */
+	for (;;) {
+		int fd = open("/dev/null", O_RDONLY);
+		CHECK(fd >= 0);
+		if (fd == FD_SETSIZE - 1) {
+			close(fd);
+			break;
+		}
+		t.fds.push_back(fd);
+	}
+	void *check = t.mg->timer_add(&t, test_fd_accepted, TEST_FD_MS, 0);
+	void *timeout = t.mg->timer_add(t.mg, test_fd_stop, 10 * TEST_FD_MS, 0);
+	mg_param_t p = {};
+	t.mg->dispatch(&p);
+	CHECK(t.err == EMFILE);
+	t.mg->timer_del(check);
+	t.mg->timer_del(timeout);
+	t.mg->listen_close(t.l);
+	delete t.mg;
+	for (int fd : t.fds) {
+		close(fd);
+	}
+	for (int fd : t.clients) {
+		close(fd);
+	}
+}
+
+int main(void)
+{
+	test_timer_boundary();
+	test_timer_random();
+	printf("timer: ok\n");
+	test_select_fds();
+	printf("select fds: ok\n");
+	return 0;
+}
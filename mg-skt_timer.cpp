@@ -0,0 +1,237 @@
+/*
+
+    COPYRIGHT AND PERMISSION NOTICE
+    Copyright (c) 2015-2020 Mark Griffiths
+    All rights reserved.
+    Permission to use, copy, modify, and distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+    OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+    USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the name of a copyright holder shall
+    not be used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization of the
+    copyright holder.
+
+	"mg-skt" non-blocking sockets abstraction layer timing wheel.
+
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include "mg-skt_timer.h"
+
+/* level of a timer taken off the wheel because it is due this tick */
+#define MG_TW_DUE MG_TW_LEVELS
+
+mg_timer_wheel::mg_timer_wheel()
+{
+	now = now_ms();
+	count = 0;
+	fired = 0;
+	memset(bitmap, 0, sizeof(bitmap));
+}
+
+uint64_t mg_timer_wheel::now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* file t into the slot matching its expiry time */
+void mg_timer_wheel::link(class mg_timer_cb *t)
+{
+	uint64_t expires = t->expires < now ? now : t->expires;
+	uint64_t delta = expires - now;
+	int level;
+	for (level = 0; level < MG_TW_LEVELS - 1; level++) {
+		if (delta < (1ULL << (MG_TW_BITS * (level + 1)))) {
+			break;
+		}
+	}
+	if (delta >= (1ULL << (MG_TW_BITS * MG_TW_LEVELS))) {
+		/* out of range: park it in the last slot, it is re-filed when cascaded */
+		expires = now + (1ULL << (MG_TW_BITS * MG_TW_LEVELS)) - 1;
+	}
+	int slot = (expires >> (MG_TW_BITS * level)) & MG_TW_MASK;
+	class mg_timer_cb *head = &slots[level][slot];
+	t->next = head;
+	t->prev = head->prev;
+	head->prev->next = t;
+	head->prev = t;
+	t->level = level;
+	t->slot = slot;
+	bitmap[level][slot >> 6] |= 1ULL << (slot & 63);
+}
+
+void mg_timer_wheel::unlink(class mg_timer_cb *t)
+{
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	if (t->level < MG_TW_DUE) {
+		class mg_timer_cb *head = &slots[t->level][t->slot];
+		if (head->next == head) {
+			bitmap[t->level][t->slot >> 6] &= ~(1ULL << (t->slot & 63));
+		}
+	}
+	t->next = t->prev = t;
+	t->level = -1;
+}
+
+void mg_timer_wheel::add(class mg_timer_cb *t, uint32_t ms)
+{
+	cancel(t);
+	t->expires = now_ms() + ms;
+	link(t);
+	count++;
+}
+
+void mg_timer_wheel::cancel(class mg_timer_cb *t)
+{
+	if (t->armed()) {
+		unlink(t);
+		count--;
+	}
+}
+
+/* move every timer of a higher level slot down to where it now belongs */
+void mg_timer_wheel::cascade(int level, int slot)
+{
+	class mg_timer_cb *head = &slots[level][slot];
+	class mg_timer_cb list;
+	if (head->next == head) {
+		return;
+	}
+	list.next = head->next;
+	list.prev = head->prev;
+	list.next->prev = &list;
+	list.prev->next = &list;
+	head->next = head->prev = head;
+	bitmap[level][slot >> 6] &= ~(1ULL << (slot & 63));
+	while (list.next != &list) {
+		class mg_timer_cb *t = list.next;
+		list.next = t->next;
+		t->next->prev = &list;
+		link(t);
+	}
+}
+
+/* first non-empty slot of a level at or after from, -1 if none */
+int mg_timer_wheel::bitmap_next(int level, int from)
+{
+	for (int w = from >> 6; w < MG_TW_SIZE / 64; w++) {
+		uint64_t m = bitmap[level][w];
+		if (w == from >> 6) {
+			m &= ~0ULL << (from & 63);
+		}
+		if (m) {
+			return (w << 6) + __builtin_ctzll(m);
+		}
+	}
+	return -1;
+}
+
+void mg_timer_wheel::expire(uint64_t now_ms)
+{
+	while (now <= now_ms) {
+		int idx = now & MG_TW_MASK;
+		class mg_timer_cb *head = &slots[0][idx];
+		class mg_timer_cb due;
+		if (head->next != head) {
+			due.next = head->next;
+			due.prev = head->prev;
+			due.next->prev = &due;
+			due.prev->next = &due;
+			head->next = head->prev = head;
+			bitmap[0][idx >> 6] &= ~(1ULL << (idx & 63));
+			for (class mg_timer_cb *t = due.next; t != &due; t = t->next) {
+				/* still cancellable by the callbacks run before it */
+				t->level = MG_TW_DUE;
+			}
+		}
+		/* timers added by the callbacks land on the next tick at the earliest */
+		now++;
+		while (due.next != &due) {
+			class mg_timer_cb *t = due.next;
+			unlink(t);
+			count--;
+			if (t->interval) {
+				/* periodic: re-arm before the callback, which may delete it */
+				t->expires += t->interval;
+				link(t);
+				count++;
+			}
+			fired++;
+			t->callback(t->handle);
+		}
+		if ((now & MG_TW_MASK) && now <= now_ms) {
+			/* skip the empty level 0 slots, up to the next wrap */
+			int next = bitmap_next(0, now & MG_TW_MASK);
+			uint64_t to = (now & ~(uint64_t)MG_TW_MASK) + (next < 0 ? MG_TW_SIZE : next);
+			now = to < now_ms + 1 ? to : now_ms + 1;
+		}
+		if (!(now & MG_TW_MASK)) {
+			/*
+			 * level 0 wrapped: pull the next slot of each level down now,
+			 * not on the next pass, so next_ms() sees them on level 0
+			 */
+			for (int level = 1; level < MG_TW_LEVELS; level++) {
+				int slot = (now >> (MG_TW_BITS * level)) & MG_TW_MASK;
+				cascade(level, slot);
+				if (slot) {
+					break;
+				}
+			}
+		}
+	}
+}
+
+int mg_timer_wheel::next_ms(uint64_t now_ms)
+{
+	uint64_t next = UINT64_MAX;
+	if (!count) {
+		return -1;
+	}
+	int b = bitmap_next(0, now & MG_TW_MASK);
+	if (b >= 0) {
+		next = (now & ~(uint64_t)MG_TW_MASK) + b;
+	}
+	else {
+		/* nothing left in this turn of level 0: wake up for the next cascade */
+		if (bitmap_next(0, 0) >= 0) {
+			/* level 0 timers filed into the next turn */
+			next = ((now >> MG_TW_BITS) + 1) << MG_TW_BITS;
+		}
+		for (int level = 1; level < MG_TW_LEVELS; level++) {
+			int shift = MG_TW_BITS * level;
+			int cur = (now >> shift) & MG_TW_MASK;
+			int d;
+			b = cur + 1 < MG_TW_SIZE ? bitmap_next(level, cur + 1) : -1;
+			if (b < 0) {
+				b = bitmap_next(level, 0);
+			}
+			if (b < 0) {
+				continue;
+			}
+			d = b > cur ? b - cur : b + MG_TW_SIZE - cur;
+			uint64_t t = ((now >> shift) + d) << shift;
+			if (t < next) {
+				next = t;
+			}
+		}
+	}
+	if (next <= now_ms) {
+		return 0;
+	}
+	return next - now_ms > INT_MAX ? INT_MAX : (int)(next - now_ms);
+}
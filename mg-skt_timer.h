@@ -0,0 +1,83 @@
+/*
+
+    COPYRIGHT AND PERMISSION NOTICE
+    Copyright (c) 2015-2020 Mark Griffiths
+    All rights reserved.
+    Permission to use, copy, modify, and distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+    OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+    USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the name of a copyright holder shall
+    not be used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization of the
+    copyright holder.
+
+ */
+
+#ifndef __MG_SKT_TIMER_H__
+#define __MG_SKT_TIMER_H__
+
+#include <stdint.h>
+
+#define MG_TW_BITS   8
+#define MG_TW_SIZE   (1 << MG_TW_BITS)	// slots per level
+#define MG_TW_MASK   (MG_TW_SIZE - 1)
+#define MG_TW_LEVELS 4			// 1ms resolution, ~49 day range
+
+class mg_timer_cb {
+public:
+	class mg *_mg;
+	void *handle;
+	void (*callback)(void*);
+	uint32_t interval;	// ms, 0 for one-shot
+	uint64_t expires;	// absolute, in ms
+	/* wheel slot list, level < 0 when not armed */
+	class mg_timer_cb *next, *prev;
+	int level;
+	int slot;
+	mg_timer_cb()
+	{
+		next = prev = this;
+		level = -1;
+		slot = 0;
+		interval = 0;
+		expires = 0;
+	}
+	int armed(void) { return level >= 0; }
+};
+
+/*
+ * Hierarchical timing wheel: MG_TW_LEVELS levels of MG_TW_SIZE slots, each
+ * level MG_TW_SIZE times coarser than the one below. Timers are doubly
+ * linked into their slot, so arming and cancelling are O(1); the slots of
+ * a higher level are cascaded into the lower ones as the wheel turns.
+ */
+class mg_timer_wheel {
+public:
+	mg_timer_wheel();
+	void add(class mg_timer_cb *t, uint32_t ms);	// (re)arm, ms from now
+	void cancel(class mg_timer_cb *t);
+	void expire(uint64_t now_ms);	// run everything due up to now_ms
+	int next_ms(uint64_t now_ms);	// ms until the next expiry, -1 if none
+	static uint64_t now_ms(void);
+	uint64_t fired;			// callbacks run
+private:
+	uint64_t now;			// next tick to be processed
+	int count;			// armed timers
+	class mg_timer_cb slots[MG_TW_LEVELS][MG_TW_SIZE];	// list heads
+	uint64_t bitmap[MG_TW_LEVELS][MG_TW_SIZE / 64];	// non-empty slots
+	void link(class mg_timer_cb *t);
+	void unlink(class mg_timer_cb *t);
+	void cascade(int level, int slot);
+	int bitmap_next(int level, int from);
+};
+
+#endif // __MG_SKT_TIMER_H__
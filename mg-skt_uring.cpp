@@ -0,0 +1,570 @@
+/*
+
+    COPYRIGHT AND PERMISSION NOTICE
+    Copyright (c) 2015-2020 Mark Griffiths
+    All rights reserved.
+    Permission to use, copy, modify, and distribute this software for any
+    purpose with or without fee is hereby granted, provided that the above
+    copyright notice and this permission notice appear in all copies.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+    OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+    USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the name of a copyright holder shall
+    not be used in advertising or otherwise to promote the sale, use or other
+    dealings in this Software without prior written authorization of the
+    copyright holder.
+
+	"mg-skt" non-blocking sockets abstraction layer io_uring module.
+
+	Talks to the kernel through the raw io_uring syscalls (no liburing).
+	Every fd_add / fd_tx_watch / fd_del only queues an SQE; the whole
+	batch is handed to the kernel by the single io_uring_enter() that
+	also waits, up to the next timer expiry, for the next completions,
+	so registration changes cost no extra syscalls. Polls are one-shot and re-armed from the
+	completion handler, which also means no data is ever stranded in a
+	socket buffer waiting for another edge.
+
+	Plain rx and rx_buf stream sockets are read with IORING_OP_RECV
+	instead, into a pooled rx buffer: the data comes with the completion
+	and goes straight to the callback, no read syscalls at all. Writes
+	and accepts stay readiness driven: a write is tried straight away
+	and only polled once the socket is full, and mg_accept() takes every
+	pending connection per event.
+
+ */
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include "mg-skt.h"
+#include "mg-skt_poll.h"
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+#define MG_URING_ENTRIES 256
+
+/* completion reads need IORING_REGISTER_SYNC_CANCEL, see fd_rx_sync() */
+#ifdef IORING_ASYNC_CANCEL_FD_FIXED
+#define MG_URING_RECV 1
+#else
+#define MG_URING_RECV 0
+#endif
+
+/* user_data tags, stored in the low bits of the mg_uring_fd pointer */
+#define MG_URING_TAG_RX     0
+#define MG_URING_TAG_TX     1
+#define MG_URING_TAG_CANCEL 2
+#define MG_URING_TAG_MASK   3
+
+class mg_uring_fd {
+public:
+	class mg_skt *mg_skt;
+	int fd;
+	int tx_watch;
+	int rx_watch;
+	int rx_armed;
+	int rx_recv;	// what is armed is a read into rx_buf, not a poll
+	void *rx_buf;
+	int tx_armed;
+	int deleting;
+	mg_uring_fd(int fd_, class mg_skt *skt)
+	{
+		fd = fd_;
+		mg_skt = skt;
+		tx_watch = 0;
+		rx_watch = 1;
+		rx_armed = 0;
+		rx_recv = 0;
+		rx_buf = NULL;
+		tx_armed = 0;
+		deleting = 0;
+	}
+};
+
+typedef struct {
+	uint64_t user_data;
+	int res;
+} mg_uring_cqe_t;
+
+class mg_skt_poll_uring : mg_skt_poll_drv {
+private:
+	int ring_fd;
+	class mg *_mg_handle;
+	void *sq_map, *cq_map;
+	size_t sq_map_size, cq_map_size;
+	/* submission queue */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	unsigned sq_local_tail;
+	unsigned sq_pending;
+	struct io_uring_sqe *sqes;
+	/* completion queue */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	std::vector<mg_uring_fd*> fd_list;
+	std::unordered_set<mg_uring_fd*> del_list;	// removed, polls still in the kernel
+	/* entry whose completion is being processed, must not be freed yet */
+	mg_uring_fd *fd_busy;
+	/* completions taken off the ring, processed from cq_next on */
+	std::vector<mg_uring_cqe_t> cq_batch;
+	size_t cq_next;
+	int recv_ok;	// completion reads, if the kernel can sync cancel
+	static int sys_setup(unsigned entries, struct io_uring_params *p)
+	{
+		return (int)syscall(__NR_io_uring_setup, entries, p);
+	}
+	static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+	                     unsigned flags, struct io_uring_getevents_arg *arg)
+	{
+		return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		                    flags, arg, arg ? sizeof(*arg) : 0);
+	}
+	static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+	{
+		return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+	}
+	/*
+	 * hand all queued SQEs to the kernel, optionally waiting for
+	 * completions for at most timeout_ms (-1 = forever)
+	 */
+	int submit(unsigned wait_nr, int timeout_ms = -1)
+	{
+		unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+		struct io_uring_getevents_arg arg, *argp = NULL;
+		struct __kernel_timespec ts;
+		int r;
+		__atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+		if (!sq_pending && !wait_nr) {
+			return 0;
+		}
+		if (wait_nr && timeout_ms >= 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+			memset(&arg, 0, sizeof(arg));
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+			argp = &arg;
+			flags |= IORING_ENTER_EXT_ARG;
+		}
+		r = sys_enter(ring_fd, sq_pending, wait_nr, flags, argp);
+		if (r < 0) {
+			return -errno;
+		}
+		sq_pending -= (unsigned)r < sq_pending ? (unsigned)r : sq_pending;
+		return r;
+	}
+	struct io_uring_sqe *get_sqe(void)
+	{
+		unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+		if (sq_local_tail - head >= sq_entries) {
+			/* ring full: push what we have to the kernel first */
+			int r = submit(0);
+			if (r < 0) {
+				MG_LOG_ERR("mg_uring_get_sqe: submit failed <%s>\n", strerror(-r));
+				assert(0);
+			}
+			head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+			assert(sq_local_tail - head < sq_entries);
+		}
+		unsigned idx = sq_local_tail & *sq_mask;
+		struct io_uring_sqe *sqe = &sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sq_array[idx] = idx;
+		sq_local_tail++;
+		sq_pending++;
+		return sqe;
+	}
+	void poll_add(mg_uring_fd *le, int tag, unsigned mask)
+	{
+		struct io_uring_sqe *sqe = get_sqe();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = le->fd;
+		sqe->poll32_events = mask;
+		sqe->user_data = (uint64_t)(uintptr_t)le | tag;
+	}
+	void poll_remove(mg_uring_fd *le, int tag, int recv = 0)
+	{
+		struct io_uring_sqe *sqe = get_sqe();
+		sqe->opcode = recv ? IORING_OP_ASYNC_CANCEL : IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = (uint64_t)(uintptr_t)le | tag;
+		sqe->user_data = MG_URING_TAG_CANCEL;
+	}
+	void rx_arm(mg_uring_fd *le)
+	{
+		unsigned char *data;
+		size_t size;
+		le->rx_armed = 1;
+		le->rx_buf = recv_ok ? mg_rx_comp_buf(le->mg_skt, &data, &size) : NULL;
+		if (!le->rx_buf) {
+			le->rx_recv = 0;
+			poll_add(le, MG_URING_TAG_RX, POLLIN);
+			return;
+		}
+		/* the data comes with the completion */
+		struct io_uring_sqe *sqe = get_sqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = le->fd;
+		sqe->addr = (uint64_t)(uintptr_t)data;
+		sqe->len = size;
+		sqe->user_data = (uint64_t)(uintptr_t)le | MG_URING_TAG_RX;
+		le->rx_recv = 1;
+	}
+	/* move new completions off the ring, the kernel may post more meanwhile */
+	void reap(void)
+	{
+		unsigned head = *cq_head;
+		while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+			cq_batch.push_back({ cqe->user_data, cqe->res });
+			head++;
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	}
+	void tx_arm(mg_uring_fd *le)
+	{
+		le->tx_armed = 1;
+		poll_add(le, MG_URING_TAG_TX, POLLOUT);
+	}
+	mg_uring_fd *fd_find(int fd)
+	{
+		if (fd < 0 || (size_t)fd >= fd_list.size()) {
+			return NULL;
+		}
+		return fd_list[fd];
+	}
+	// process a single completion
+	void complete(uint64_t user_data, int res)
+	{
+		int tag = user_data & MG_URING_TAG_MASK;
+		mg_uring_fd *le = (mg_uring_fd*)(uintptr_t)(user_data & ~(uint64_t)MG_URING_TAG_MASK);
+		fd_busy = le;
+		switch (tag) {
+		case MG_URING_TAG_CANCEL:
+			fd_busy = NULL;
+			return;
+		case MG_URING_TAG_TX:
+			le->tx_armed = 0;
+			if (!le->deleting && le->tx_watch && res > 0) {
+				mg_dequeue(le->mg_skt);
+			}
+			/* mg_dequeue() re-enables tx_watch if the socket is still full */
+			if (!le->deleting && le->tx_watch && !le->tx_armed) {
+				tx_arm(le);
+			}
+			break;
+		case MG_URING_TAG_RX:
+			le->rx_armed = 0;
+			if (le->rx_recv) {
+				void *b = le->rx_buf;
+				le->rx_recv = 0;
+				le->rx_buf = NULL;
+				if (le->deleting) {
+					mg_buf_release(b);
+					break;
+				}
+				mg_rx_comp(le->mg_skt, b, res);
+				if (!le->deleting && le->rx_watch && !le->rx_armed) {
+					rx_arm(le);
+				}
+			}
+			else if (res < 0) {
+				if (res != -ECANCELED) {
+					MG_LOG_ERR("mg_uring[%d]: poll failed <%s>\n", le->fd, strerror(-res));
+				}
+			}
+			else if (!le->deleting && le->rx_watch) {
+				if ((res & POLLHUP) && !(res & POLLIN)) {
+					/* same as the epoll driver: nothing to read, drop it */
+					break;
+				}
+				mg_rx(le->mg_skt);
+				if (!le->deleting && le->rx_watch && !le->rx_armed) {
+					rx_arm(le);
+				}
+			}
+			break;
+		}
+		fd_busy = NULL;
+		if (le->deleting && !le->rx_armed && !le->tx_armed) {
+			/* no kernel references left */
+			del_list.erase(le);
+			delete le;
+		}
+	}
+public:
+	std::string name = "io_uring";
+	// constructor
+	mg_skt_poll_uring()
+	{
+		ring_fd = -1;
+		mg_register(name, this);
+	};
+	mg_skt_poll_uring(const mg_skt_poll_uring &proto)
+	{
+		ring_fd = -1;
+		_mg_handle = NULL;
+	};
+	~mg_skt_poll_uring()
+	{
+		if (ring_fd < 0) {
+			return;
+		}
+		munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+		if (cq_map != sq_map) {
+			munmap(cq_map, cq_map_size);
+		}
+		munmap(sq_map, sq_map_size);
+		close(ring_fd);
+		for (mg_uring_fd *le : fd_list) {
+			if (le && le->rx_buf) {
+				mg_buf_release(le->rx_buf);
+			}
+			delete le;
+		}
+		for (mg_uring_fd *le : del_list) {
+			if (le->rx_buf) {
+				mg_buf_release(le->rx_buf);
+			}
+			delete le;
+		}
+	}
+	// new driver instance for an mg loop
+	mg_skt_poll_drv *create(void)
+	{
+		return new mg_skt_poll_uring(*this);
+	}
+	// override init function
+	int init(class mg *mg_handle)
+	{
+		struct io_uring_params p;
+		void *sq_ptr, *cq_ptr;
+		size_t sq_size, cq_size;
+		memset(&p, 0, sizeof(p));
+		ring_fd = sys_setup(MG_URING_ENTRIES, &p);
+		MG_LOG_DBG("mg_uring_init: ring_fd = %d\n", ring_fd);
+		if (ring_fd < 0) {
+			MG_LOG_ERR("mg_uring_init: io_uring_setup failed <%s>\n", strerror(errno));
+			assert(0);
+		}
+		sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP) {
+			sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+		}
+		sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+		              MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		assert(sq_ptr != MAP_FAILED);
+		if (p.features & IORING_FEAT_SINGLE_MMAP) {
+			cq_ptr = sq_ptr;
+		}
+		else {
+			cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+			              MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+			assert(cq_ptr != MAP_FAILED);
+		}
+		sqes = (struct io_uring_sqe*)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		                                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                                  ring_fd, IORING_OFF_SQES);
+		assert(sqes != MAP_FAILED);
+		sq_head = (unsigned*)((char*)sq_ptr + p.sq_off.head);
+		sq_tail = (unsigned*)((char*)sq_ptr + p.sq_off.tail);
+		sq_mask = (unsigned*)((char*)sq_ptr + p.sq_off.ring_mask);
+		sq_array = (unsigned*)((char*)sq_ptr + p.sq_off.array);
+		sq_entries = p.sq_entries;
+		sq_local_tail = *sq_tail;
+		sq_pending = 0;
+		cq_head = (unsigned*)((char*)cq_ptr + p.cq_off.head);
+		cq_tail = (unsigned*)((char*)cq_ptr + p.cq_off.tail);
+		cq_mask = (unsigned*)((char*)cq_ptr + p.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe*)((char*)cq_ptr + p.cq_off.cqes);
+		sq_map = sq_ptr;
+		sq_map_size = sq_size;
+		cq_map = cq_ptr;
+		cq_map_size = cq_size;
+		/* timeouts are passed straight to io_uring_enter() */
+		if (!(p.features & IORING_FEAT_EXT_ARG)) {
+			MG_LOG_ERR("mg_uring_init: kernel lacks IORING_FEAT_EXT_ARG\n");
+			assert(0);
+		}
+		recv_ok = 0;
+#if MG_URING_RECV
+		{
+			/* nothing to cancel: ENOENT if the kernel has it at all */
+			struct io_uring_sync_cancel_reg reg;
+			memset(&reg, 0, sizeof(reg));
+			reg.timeout.tv_sec = -1;
+			reg.timeout.tv_nsec = -1;
+			recv_ok = sys_register(ring_fd, IORING_REGISTER_SYNC_CANCEL, &reg, 1) < 0 &&
+			          errno == ENOENT;
+		}
+#endif
+		MG_LOG_DBG("mg_uring_init: completion reads %s\n", recv_ok ? "on" : "off");
+		fd_busy = NULL;
+		cq_next = 0;
+		_mg_handle = mg_handle;
+		return 0;
+	}
+	// add a file descriptor
+	int fd_add(int fd, class mg_skt *mg_skt)
+	{
+		assert(fd >= 0);
+		if ((size_t)fd >= fd_list.size()) {
+			fd_list.resize(fd + 1, NULL);
+		}
+		assert(fd_list[fd] == NULL);
+		mg_uring_fd *le = new mg_uring_fd(fd, mg_skt);
+		fd_list[fd] = le;
+		/* polled first: it may not even be connected yet */
+		le->rx_armed = 1;
+		poll_add(le, MG_URING_TAG_RX, POLLIN);
+		return 0;
+	}
+	// delete a file descriptor
+	int fd_del(class mg_skt *mg_skt)
+	{
+		int fd = mg_skt_fd(mg_skt);
+		mg_uring_fd *le = fd_find(fd);
+		MG_LOG_DBG("mg_uring_fd_del: fd = %d\n", fd);
+		assert(le);
+		fd_list[fd] = NULL;
+		le->deleting = 1;
+		if (le->rx_armed) {
+			poll_remove(le, MG_URING_TAG_RX, le->rx_recv);
+		}
+		if (le->tx_armed) {
+			poll_remove(le, MG_URING_TAG_TX);
+		}
+		if (!le->rx_armed && !le->tx_armed) {
+			if (le != fd_busy) {
+				delete le;
+			}
+		}
+		else {
+			del_list.insert(le);
+			/*
+			 * The fd is about to be closed: the removals must reach the
+			 * kernel before its number can be reused by another socket.
+			 */
+			submit(0);
+		}
+		return 0;
+	}
+	// watch for tx complete event
+	int fd_tx_watch(class mg_skt *mg_skt, int enable)
+	{
+		mg_uring_fd *le = fd_find(mg_skt_fd(mg_skt));
+		assert(le);
+		le->tx_watch = enable;
+		if (enable && !le->tx_armed) {
+			tx_arm(le);
+		}
+		/* a stale POLLOUT is ignored on completion when tx_watch is clear */
+		return 0;
+	};
+	// watch for rx events, off while paused
+	int fd_rx_watch(class mg_skt *mg_skt, int enable)
+	{
+		mg_uring_fd *le = fd_find(mg_skt_fd(mg_skt));
+		assert(le);
+		le->rx_watch = enable;
+		if (enable && !le->rx_armed) {
+			rx_arm(le);
+		}
+		/*
+		 * likewise a stale POLLIN, which is not re-armed while paused; a
+		 * read completing meanwhile is kept by mg_rx_comp() until resumed
+		 */
+		return 0;
+	};
+#if MG_URING_RECV
+	// finish the read in the kernel now, for rx changing hands
+	int fd_rx_sync(class mg_skt *mg_skt)
+	{
+		mg_uring_fd *le = fd_find(mg_skt_fd(mg_skt));
+		assert(le);
+		if (!le->rx_armed || !le->rx_recv) {
+			return 0;
+		}
+		uint64_t user_data = (uint64_t)(uintptr_t)le | MG_URING_TAG_RX;
+		struct io_uring_sync_cancel_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.addr = user_data;
+		reg.timeout.tv_sec = -1;
+		reg.timeout.tv_nsec = -1;
+		/* it may still be in the submission queue */
+		submit(0);
+		if (sys_register(ring_fd, IORING_REGISTER_SYNC_CANCEL, &reg, 1) < 0 &&
+		        errno != ENOENT) {
+			MG_LOG_ERR("mg_uring_fd_rx_sync[%d]: cancel failed <%s>\n", le->fd, strerror(errno));
+			assert(0);
+		}
+		/* done either way: its completion is on the ring, or flushed to it */
+		for (;;) {
+			reap();
+			for (size_t i = cq_next; i < cq_batch.size(); i++) {
+				if (cq_batch[i].user_data != user_data) {
+					continue;
+				}
+				void *b = le->rx_buf;
+				cq_batch[i].user_data = MG_URING_TAG_CANCEL;
+				le->rx_armed = 0;
+				le->rx_recv = 0;
+				le->rx_buf = NULL;
+				mg_rx_comp_held(mg_skt, b, cq_batch[i].res);
+				return 0;
+			}
+			submit(1);
+		}
+	}
+#endif
+
+	// wait_for_events
+	int wait_for_events(void)
+	{
+		/*
+		 * sleep no longer than until the next timer is due, not at all
+		 * with completions fd_rx_sync() took off the ring still to do
+		 */
+		int r = submit(1, cq_next < cq_batch.size() ? 0 : mg_poll_timeout(_mg_handle));
+		if (r < 0 && r != -ETIME) {
+			if (r == -EINTR) {
+				MG_LOG_DBG("wait_for_events: signal interrupt...resuming\n");
+			}
+			else {
+				MG_LOG_ERR("wait_for_events: io_uring_enter err %s\n", strerror(-r));
+				assert(0);
+			}
+		}
+		reap();
+		mg_wait_done(_mg_handle, cq_batch.size() - cq_next);
+		while (cq_next < cq_batch.size()) {
+			mg_uring_cqe_t c = cq_batch[cq_next++];
+			complete(c.user_data, c.res);
+			if (cq_next == cq_batch.size()) {
+				/* e.g. a read that completed on our own write */
+				reap();
+			}
+		}
+		cq_batch.clear();
+		cq_next = 0;
+		mg_timeout(_mg_handle);
+		mg_events_done(_mg_handle);
+		return 0;
+	}
+};
+
+// create the prototype instance: constructor calls mg_register()
+static class mg_skt_poll_uring mg_uring;
@@ -23,8 +23,8 @@
     Simple single-threaded, multi-connect non-blocking TCP Proxy application
     demonstrating usage of mg-skt non-blocking library.
 
-	Listens to port 8080 on local machine and connects to port 80 on remote
-	machine.
+	Listens to port 8080 on local machine and spreads the clients over a
+	set of remote servers, port 80 unless given.
 
  */
 
@@ -32,22 +32,71 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <mutex>
+#include <new>
 #include <string>
 #include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 #include "mg-skt.h"
 
 
 #define HP_DATA_CONN_MAX 256
+#define TP_POOL_WARM     8	// default warm upstream connections per loop
+#define TP_POOL_TICK_MS  100	// pool top up period
+#define TP_POOL_IDLE_MAX 300	// ticks a warm connection is kept unused
+#define TP_HC_PERIOD_MS  1000	// active health check period
+#define TP_HC_RISE       2	// probes in a row to bring a backend back
+#define TP_HC_FALL       2	// failures in a row to take a backend out
+#define TP_HASH_VNODES   64	// consistent hash ring points per backend
+#define TP_HANDOFF_PATH  "/tmp/tcp-proxy-demo.sock"	// hot restart control socket
+
+/* one of the servers the clients are spread over */
+class tp_backend {
+public:
+	class tpc *tp;
+	int id;			// index in tpc::backends
+	struct sockaddr_in addr;
+	char name[INET_ADDRSTRLEN + 6];
+	std::atomic<int> up{1};		// given new clients
+	std::atomic<int> active{0};	// clients bound to it, all loops
+	std::atomic<int> fails{0};	// connect / read / probe failures in a row
+	int oks = 0;			// probes in a row, loop 0 only
+	void *probe = NULL;		// health check in flight, loop 0 only
+};
 
 /* data connection record */
 class tp_sock_data {
 public:
-	class tp_conn *conn;
-	void *sock;
+	class tp_conn *conn;	// NULL while a pooled upstream waits for a client
+	void *sock = NULL;
+	class tp_backend *backend = NULL;	// upstream sockets: where to
+	class tp_pool *pool = NULL;	// upstream sockets: the loop's pool, if any
+	int up = 0;		// upstream connected
+	int idle = 0;		// ticks spent in the pool
+};
+
+/*
+ * Upstream connections of one loop to one backend, opened ahead of the
+ * clients so that a client is bound to an already connected socket on
+ * accept instead of waiting for a handshake of its own. Topped up from
+ * the loop's timer.
+ */
+class tp_pool {
+public:
+	class tpc *tp;
+	class tp_backend *backend;
+	std::vector<class tp_sock_data*> warm;	// connected, unused
+	int connecting = 0;	// opened for the pool, not up yet
 };
 
 /* tcp proxy record */
@@ -55,134 +104,470 @@ class tpc {
 public:
 	void *listen_handle;
 	struct in_addr srv_ip_loc;
-	struct in_addr srv_ip_rem;
+	std::vector<class tp_backend*> backends;
+	/* selection policy, NULL if no backend is up */
+	class tp_backend *(*pick)(class tpc*, struct in_addr client);
+	std::atomic<unsigned> rr{0};	// next backend to try
+	std::vector<std::pair<uint32_t, class tp_backend*>> ring;	// by hash
 	std::unordered_set<class tp_conn*> conn;
-	tpc(const char *loc, const char *rem)
+	std::mutex conn_lock;	// conn is shared by all reactors
+	int pool_size = TP_POOL_WARM;	// warm upstream connections per loop and backend
+	int reactors = 1;
+	void *handoff_handle = NULL;	// control socket, a successor connects to take over
+	int handoff_fd = -1;		// connected successor, while handing over
+	int handoff_failed = 0;		// the successor went away, carry on here
+	tpc(const char *loc)
 	{
-		inet_pton(AF_INET, loc, &srv_ip_rem);
-		inet_pton(AF_INET, rem, &srv_ip_loc);
+		inet_pton(AF_INET, loc, &srv_ip_loc);
 	};
+	int backends_add(const char *list);
+	void ring_build(void);
 	void conn_list_print(void);
 	class mg_base *mg;
 };
 
+/* the calling loop's warm upstream connections by backend, empty if pooling is off */
+static thread_local std::vector<class tp_pool*> tp_pools;
+/* the calling loop's reactor id */
+static thread_local int tp_reactor_id;
+
 /* connection record */
 class tp_conn {
 private:
 public:
 	class tpc *tp;
 	class tp_sock_data client_sock_data;
-	class tp_sock_data server_sock_data;
+	class tp_sock_data *server_sock_data;	// from the pool, or opened for it
 	struct {
 		struct in_addr ip;
 		in_port_t port;
 	} client;
 	int age;
+	int reactor;		// the loop serving both sockets
 	tp_conn(class tpc *tp_, struct sockaddr_in *a)
 	{
 		printf("tp_conn constructor\n");
 		tp = tp_;
 		age = 0;
+		reactor = tp_reactor_id;
 		client_sock_data.conn = this;
-		server_sock_data.conn = this;
+		server_sock_data = NULL;
 		client.ip.s_addr = a->sin_addr.s_addr;
 		client.port = a->sin_port;
+		std::lock_guard<std::mutex> l(tp->conn_lock);
 		tp->conn.insert(this);
 	}
 	~tp_conn(void)
 	{
 		printf("tp_conn destructor\n");
+		std::lock_guard<std::mutex> l(tp->conn_lock);
 		tp->conn.erase(this);
 	}
 };
 
-/* Print active client-server connections */
+/*
+ * Print active client-server connections: bytes from / to the client and
+ * what is still queued for it. Counters of connections served by other
+ * reactors may be a little behind.
+ */
 void tpc::conn_list_print(void)
 {
 	char ip_c[INET_ADDRSTRLEN];
-	printf("--------------------------------\n");
-	printf("|   Client IP    / Port  | Age |\n");
-	printf("--------------------------------\n");
+	mg_loop_stats_t ls;
+	mg->stats(&ls, NULL);
+	std::lock_guard<std::mutex> l(conn_lock);
+	printf("-------------------------------------------------------------\n");
+	printf("|   Client IP    / Port  | Age |  Rx KB |  Tx KB | Queued KB |\n");
+	printf("-------------------------------------------------------------\n");
 	for (tp_conn *c : conn) {
+		mg_skt_stats_t st = {};
+		if (c->client_sock_data.sock) {
+			/* NULL until accept completes on another reactor */
+			mg_skt_stats(c->client_sock_data.sock, &st);
+		}
 		inet_ntop(AF_INET, &c->client.ip, ip_c, sizeof(ip_c));
-		printf("|%17s/%5d |%4d |\n", ip_c, c->client.port, c->age);
+		printf("|%17s/%5d |%4d |%7lu |%7lu |%10lu |\n", ip_c, c->client.port, c->age,
+		       (unsigned long)(st.rx_bytes >> 10), (unsigned long)(st.tx_bytes >> 10),
+		       (unsigned long)(st.txq_len >> 10));
+	}
+	printf("-------------------------------------------------------------\n");
+	printf("loop %d: %lu sockets, %lu waits, rx %lu KB, tx %lu KB, tx queue max %lu KB\n",
+	       ls.reactor_id, (unsigned long)ls.sockets, (unsigned long)ls.waits,
+	       (unsigned long)(ls.total.rx_bytes >> 10), (unsigned long)(ls.total.tx_bytes >> 10),
+	       (unsigned long)(ls.total.txq_hwm >> 10));
+	for (class tp_backend *b : backends) {
+		printf("backend %-21s %-4s %4d active", b->name, b->up ? "up" : "down", (int)b->active);
+		if (!tp_pools.empty()) {
+			printf(", loop %d: %zu warm", ls.reactor_id, tp_pools[b->id]->warm.size());
+		}
+		printf("\n");
+	}
+}
+
+/* comma separated <IPv4 address>[:port] list, -1 if it doesn't parse */
+int tpc::backends_add(const char *list)
+{
+	std::string s(list);
+	size_t pos = 0;
+	while (pos <= s.size()) {
+		size_t end = s.find(',', pos);
+		if (end == std::string::npos) {
+			end = s.size();
+		}
+		std::string host = s.substr(pos, end - pos);
+		int port = 80;
+		size_t colon = host.find(':');
+		if (colon != std::string::npos) {
+			port = atoi(host.c_str() + colon + 1);
+			host.resize(colon);
+		}
+		class tp_backend *b = new tp_backend;
+		memset(&b->addr, 0, sizeof(b->addr));
+		if (inet_pton(AF_INET, host.c_str(), &b->addr.sin_addr) != 1 ||
+		        port <= 0 || port > 65535) {
+			delete b;
+			return -1;
+		}
+		b->addr.sin_family = AF_INET;
+		b->addr.sin_port = htons(port);
+		b->tp = this;
+		b->id = backends.size();
+		snprintf(b->name, sizeof(b->name), "%s:%d", host.c_str(), port);
+		backends.push_back(b);
+		pos = end + 1;
+	}
+	return 0;
+}
+
+/* murmur3 finalizer */
+static uint32_t tp_hash(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/* TP_HASH_VNODES points per backend, so one going down spreads its clients */
+void tpc::ring_build(void)
+{
+	ring.clear();
+	for (class tp_backend *b : backends) {
+		for (uint32_t v = 0; v < TP_HASH_VNODES; v++) {
+			uint32_t h = tp_hash(b->addr.sin_addr.s_addr ^ tp_hash((b->addr.sin_port << 16) | v));
+			ring.push_back(std::make_pair(h, b));
+		}
 	}
-	printf("--------------------------------\n");
+	std::sort(ring.begin(), ring.end(),
+	[](const std::pair<uint32_t, class tp_backend*> &a,
+	   const std::pair<uint32_t, class tp_backend*> &b) {
+		return a.first < b.first;
+	});
 }
 
-/* Data received from the server -  send to the client */
-static void tp_conn_server_rx(void *handle, struct sockaddr *rx_skt, unsigned char *buf, int buflen)
+/* next backend up in turn */
+static class tp_backend *tp_pick_rr(class tpc *tp, struct in_addr client)
+{
+	size_t n = tp->backends.size();
+	for (size_t i = 0; i < n; i++) {
+		class tp_backend *b = tp->backends[tp->rr++ % n];
+		if (b->up) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/* backend up with the fewest clients, ties taken in turn */
+static class tp_backend *tp_pick_least(class tpc *tp, struct in_addr client)
+{
+	size_t n = tp->backends.size();
+	unsigned start = tp->rr++;
+	class tp_backend *best = NULL;
+	for (size_t i = 0; i < n; i++) {
+		class tp_backend *b = tp->backends[(start + i) % n];
+		if (b->up && (!best || b->active < best->active)) {
+			best = b;
+		}
+	}
+	return best;
+}
+
+/*
+ * Same client IP, same backend, for as long as it is up. Only the clients
+ * of a backend going down or coming back move.
+ */
+static class tp_backend *tp_pick_hash(class tpc *tp, struct in_addr client)
+{
+	uint32_t h = tp_hash(client.s_addr);
+	size_t n = tp->ring.size();
+	size_t i = std::lower_bound(tp->ring.begin(), tp->ring.end(), h,
+	[](const std::pair<uint32_t, class tp_backend*> &e, uint32_t h) {
+		return e.first < h;
+	}) - tp->ring.begin();
+	for (size_t k = 0; k < n; k++) {
+		class tp_backend *b = tp->ring[(i + k) % n].second;
+		if (b->up) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static const struct {
+	const char *name;
+	class tp_backend *(*pick)(class tpc*, struct in_addr);
+} tp_policies[] = {
+	{ "rr",    tp_pick_rr },
+	{ "least", tp_pick_least },
+	{ "hash",  tp_pick_hash },
+};
+
+/* from any loop: a connect, read or health check failed */
+static void tp_backend_fail(class tp_backend *b, const char *why)
+{
+	if (++b->fails >= TP_HC_FALL && b->up.exchange(0)) {
+		printf("backend %s down: %s failed\n", b->name, why);
+	}
+}
+
+static void tp_pool_drop(class tp_sock_data *ds);
+
+/*
+ * Data received from the server -  send to the client. What the client
+ * can't take yet is queued by reference to the rx buffer, not copied.
+ */
+static void tp_conn_server_rx(void *handle, void *rx_buf, unsigned char *buf, int buflen)
 {
 	class tp_sock_data *ds = (class tp_sock_data*)handle;
 	tp_conn *c = ds->conn;
+	if (!c) {
+		/* a pooled upstream talking before it has a client: not reusable */
+		tp_pool_drop(ds);
+		return;
+	}
 	class tp_sock_data *dc = &c->client_sock_data;
-	if (mg_skt_tx(dc->sock, buf, buflen)) {
+	if (mg_skt_tx_buf(dc->sock, rx_buf, buf, buflen)) {
 		printf("could not sent %d bytes from server to client\n", buflen);
 	};
 }
 
 /* Data received from the client - send to the server */
-static void tp_conn_client_rx(void *handle, struct sockaddr *rx_skt, unsigned char *buf, int buflen)
+static void tp_conn_client_rx(void *handle, void *rx_buf, unsigned char *buf, int buflen)
 {
 	class tp_sock_data *dc = (class tp_sock_data*)handle;
 	tp_conn *c = dc->conn;
-	class tp_sock_data *ds = &c->server_sock_data;
-	if (mg_skt_tx(ds->sock, buf, buflen)) {
+	class tp_sock_data *ds = c->server_sock_data;
+	if (mg_skt_tx_buf(ds->sock, rx_buf, buf, buflen)) {
 		printf("could not sent %d bytes from client to server\n", buflen);
 	};
 }
 
+/*
+ * Flow control: while one side's tx queue is above its high mark, stop
+ * reading from the other side, so the proxy runs at the slower peer's
+ * pace instead of queueing without bound.
+ */
+static void tp_conn_server_tx_high(void *handle)
+{
+	class tp_sock_data *ds = (class tp_sock_data*)handle;
+	mg_skt_rx_pause(ds->conn->client_sock_data.sock);
+}
+
+static void tp_conn_server_tx_low(void *handle)
+{
+	class tp_sock_data *ds = (class tp_sock_data*)handle;
+	mg_skt_rx_resume(ds->conn->client_sock_data.sock);
+}
+
+static void tp_conn_client_tx_high(void *handle)
+{
+	class tp_sock_data *dc = (class tp_sock_data*)handle;
+	mg_skt_rx_pause(dc->conn->server_sock_data->sock);
+}
+
+static void tp_conn_client_tx_low(void *handle)
+{
+	class tp_sock_data *dc = (class tp_sock_data*)handle;
+	mg_skt_rx_resume(dc->conn->server_sock_data->sock);
+}
+
+static void tp_upstream_free(class tpc *tp, class tp_sock_data *ds)
+{
+	ds->~tp_sock_data();
+	tp->mg->pool_put(ds, sizeof(*ds));
+}
+
+/* connection records come from the accepting loop's pool, and go back to it */
+static class tp_conn *tp_conn_new(class tpc *tp, struct sockaddr_in *a)
+{
+	return new (tp->mg->pool_get(sizeof(class tp_conn))) tp_conn(tp, a);
+}
+
+static void tp_conn_free(class tp_conn *c)
+{
+	class tpc *tp = c->tp;
+	if (c->server_sock_data) {
+		c->server_sock_data->backend->active--;
+		tp_upstream_free(tp, c->server_sock_data);
+	}
+	c->~tp_conn();
+	tp->mg->pool_put(c, sizeof(*c));
+}
+
+/* the other side closed: what it sent still goes out on this one */
 static void tp_conn_close(class tp_sock_data *d)
 {
-	d->conn->tp->mg->skt_close(d->sock);
-//	mg_skt_close(d->sock);
-	delete d->conn;
+	d->conn->tp->mg->skt_linger(d->sock);
+	tp_conn_free(d->conn);
 }
 
 /* Client is closing the connection - close the server side */
 static void tp_conn_client_close(void *handle)
 {
 	class tp_sock_data *dc = (class tp_sock_data*)handle;
-	tp_conn_close(&dc->conn->server_sock_data);
+	tp_conn_close(dc->conn->server_sock_data);
 }
 
-/* Server is closing the connection - close the client side */
+/* a pooled upstream is no longer on offer */
+static void tp_pool_forget(class tp_sock_data *ds)
+{
+	class tp_pool *pool = ds->pool;
+	if (!ds->up) {
+		pool->connecting--;
+		return;
+	}
+	for (size_t i = 0; i < pool->warm.size(); i++) {
+		if (pool->warm[i] == ds) {
+			pool->warm.erase(pool->warm.begin() + i);
+			break;
+		}
+	}
+}
+
+/* close an unused pooled upstream, the next tick replaces it */
+static void tp_pool_drop(class tp_sock_data *ds)
+{
+	class tpc *tp = ds->pool->tp;
+	tp_pool_forget(ds);
+	tp->mg->skt_close(ds->sock);
+	tp_upstream_free(tp, ds);
+}
+
+/*
+ * Server is closing the connection - close the client side. A failed
+ * connect or read counts against the backend (passive health check).
+ */
 static void tp_conn_server_close(void *handle)
 {
 	class tp_sock_data *ds = (class tp_sock_data*)handle;
+	if (!ds->up || mg_skt_error(ds->sock)) {
+		tp_backend_fail(ds->backend, ds->up ? "read" : "connect");
+	}
+	if (!ds->conn) {
+		/* a pooled upstream died, or never connected, before it was used */
+		class tpc *tp = ds->pool->tp;
+		tp_pool_forget(ds);
+		tp_upstream_free(tp, ds);
+		return;
+	}
 	tp_conn_close(&ds->conn->client_sock_data);
 }
 
+/* upstream handshake done: a pooled one is ready for a client */
+static void tp_upstream_connected(void *handle)
+{
+	class tp_sock_data *ds = (class tp_sock_data*)handle;
+	ds->up = 1;
+	ds->backend->fails = 0;
+	if (ds->conn) {
+		/* opened for a client, which already has it */
+		return;
+	}
+	ds->pool->connecting--;
+	ds->pool->warm.push_back(ds);
+}
+
+/* socket params of upstream ds to backend b */
+static mg_skt_param_t tp_upstream_param(class tp_sock_data *ds, class tp_backend *b)
+{
+	mg_skt_param_t server_data_skt_param = {
+		.handle = ds,
+		.close = tp_conn_server_close,
+		.family = AF_INET,
+		.type = SOCK_STREAM,
+		.connect_addr = (struct sockaddr*)&b->addr,
+		.connect_addr_len = sizeof(b->addr),
+		.rx_buf = tp_conn_server_rx,
+		.tx_high = tp_conn_server_tx_high,
+		.tx_low = tp_conn_server_tx_low,
+		.autocork = 1,
+		.connected = tp_upstream_connected,
+	};
+	return server_data_skt_param;
+}
+
+/* open a data socket to backend b, for client c or for the pool if NULL */
+static class tp_sock_data *tp_upstream_open(class tp_backend *b, class tp_pool *pool,
+                                            class tp_conn *c)
+{
+	class tpc *tp = b->tp;
+	class tp_sock_data *ds = new (tp->mg->pool_get(sizeof(class tp_sock_data))) tp_sock_data();
+	mg_skt_param_t server_data_skt_param = tp_upstream_param(ds, b);
+	ds->conn = c;
+	ds->backend = b;
+	ds->pool = pool;
+	ds->sock = tp->mg->skt_open(&server_data_skt_param);
+	assert(ds->sock);
+	return ds;
+}
+
+/* client socket params of connection c, spliced to its upstream */
+static void tp_client_param(mg_skt_param_t *cp, class tp_conn *c)
+{
+	cp->handle = (void*)&c->client_sock_data;
+	cp->rx_buf = tp_conn_client_rx;
+	cp->tx_high = tp_conn_client_tx_high;
+	cp->tx_low = tp_conn_client_tx_low;
+	/* the reads of a pass are forwarded in one writev() */
+	cp->autocork = 1;
+	cp->close = tp_conn_client_close;
+	/* forward in the kernel where possible, the rx callbacks are the fallback */
+	cp->splice = c->server_sock_data->sock;
+}
+
 /* Process inbound connection request from client and make it to the server */
 static void **tp_conn_accept(void *tp_conn_handle, mg_skt_param_t *cp)
 {
 	tpc *tp = (tpc*)tp_conn_handle;
-	tp_conn *c = new tp_conn(tp, (struct sockaddr_in*)cp->sock_addr);
+	struct sockaddr_in *a = (struct sockaddr_in*)cp->sock_addr;
+	class tp_backend *b = tp->pick(tp, a->sin_addr);
+	if (!b) {
+		printf("no backend up, client refused\n");
+		return NULL;
+	}
+	tp_conn *c = tp_conn_new(tp, a);
 	if (c) {
-		/* found a free data connection - open a data socket to the server */
+		/* found a free data connection - bind it to a connected server socket */
 		class tp_sock_data *dc = &c->client_sock_data;
-		class tp_sock_data *ds = &c->server_sock_data;
-		struct sockaddr_in connect_addr = {
-			.sin_family = AF_INET,
-			.sin_port = htons(80),
-			.sin_addr = tp->srv_ip_rem,
-		};
-		mg_skt_param_t server_data_skt_param = {
-			.handle = ds,
-			.rx = tp_conn_server_rx,
-			.close = tp_conn_server_close,
-			.family = AF_INET,
-			.type = SOCK_STREAM,
-			.connect_addr = (struct sockaddr*)&connect_addr,
-			.connect_addr_len = sizeof(connect_addr),
-		};
-		ds->conn = c;
-		ds->sock = tp->mg->skt_open(&server_data_skt_param);
-		assert(ds->sock);
+		class tp_sock_data *ds;
+		class tp_pool *pool = tp_pools.empty() ? NULL : tp_pools[b->id];
+		if (pool && !pool->warm.empty()) {
+			/* the most recently opened one, the oldest may be recycled */
+			ds = pool->warm.back();
+			pool->warm.pop_back();
+			ds->conn = c;
+		}
+		else {
+			/* pool ran dry: connect on demand */
+			ds = tp_upstream_open(b, pool, c);
+		}
+		b->active++;
+		c->server_sock_data = ds;
 		/* fill in client params */
-		cp->handle = (void*)dc;
-		cp->rx = tp_conn_client_rx;
-		cp->close = tp_conn_client_close;
+		tp_client_param(cp, c);
 		dc->conn = c;
 		/* return the *address* of the client's data connection handle */
 		return &dc->sock;
@@ -190,6 +575,348 @@ static void **tp_conn_accept(void *tp_conn_handle, mg_skt_param_t *cp)
 	return NULL;
 }
 
+/*
+ * Pool timer: retire connections left unused for too long, the server
+ * or a middlebox may have dropped them without a word, and open new ones
+ * for those handed out or found dead. Nothing is kept for a backend that
+ * is down.
+ */
+static void tp_pool_tick(void *handle)
+{
+	for (class tp_pool *pool : tp_pools) {
+		for (size_t i = 0; i < pool->warm.size();) {
+			class tp_sock_data *ds = pool->warm[i];
+			if (++ds->idle > TP_POOL_IDLE_MAX || !pool->backend->up) {
+				tp_pool_drop(ds);
+				continue;
+			}
+			i++;
+		}
+		if (!pool->backend->up) {
+			continue;
+		}
+		while ((int)pool->warm.size() + pool->connecting < pool->tp->pool_size) {
+			tp_upstream_open(pool->backend, pool, NULL);
+			pool->connecting++;
+		}
+	}
+}
+
+static void tp_hc_rx(void *handle, struct sockaddr *rx_skt,
+                     unsigned char *rx_buf, int rx_buflen)
+{
+}
+
+/* probe connected: the backend is listening */
+static void tp_hc_up(void *handle)
+{
+	class tp_backend *b = (class tp_backend*)handle;
+	b->tp->mg->skt_close(b->probe);
+	b->probe = NULL;
+	b->fails = 0;
+	if (!b->up && ++b->oks >= TP_HC_RISE) {
+		b->oks = 0;
+		b->up = 1;
+		printf("backend %s up\n", b->name);
+	}
+}
+
+/* probe refused, or reset */
+static void tp_hc_down(void *handle)
+{
+	class tp_backend *b = (class tp_backend*)handle;
+	b->probe = NULL;
+	b->oks = 0;
+	tp_backend_fail(b, "health check");
+}
+
+/*
+ * Active health checks, on loop 0: a non-blocking connect to each backend
+ * per period. One still not answered by the next period has failed.
+ */
+static void tp_hc_tick(void *handle)
+{
+	tpc *tp = (tpc*)handle;
+	for (class tp_backend *b : tp->backends) {
+		if (b->probe) {
+			tp->mg->skt_close(b->probe);
+			b->probe = NULL;
+			b->oks = 0;
+			tp_backend_fail(b, "health check");
+		}
+		mg_skt_param_t probe_param = {
+			.handle = b,
+			.rx = tp_hc_rx,
+			.close = tp_hc_down,
+			.family = AF_INET,
+			.type = SOCK_STREAM,
+			.connect_addr = (struct sockaddr*)&b->addr,
+			.connect_addr_len = sizeof(b->addr),
+			.connected = tp_hc_up,
+		};
+		b->probe = tp->mg->skt_open(&probe_param);
+		assert(b->probe);
+	}
+}
+
+/*
+ * Hot restart. A new tp connects to TP_HANDOFF_PATH and is handed the
+ * connections of each loop in turn, each loop posting to the next one,
+ * then, back on loop 0, the listener, which is paused meanwhile; then
+ * this tp stops. Connections still waiting for their upstream are not
+ * handed over. If the new tp goes away halfway, this one carries on with
+ * what it still has.
+ */
+enum {
+	TP_HO_LISTENER,
+	TP_HO_CLIENT,
+	TP_HO_SERVER
+};
+
+/* the proxy's side of a handed over socket */
+typedef struct {
+	int kind;
+	int backend;		// server: index in tpc::backends
+	struct sockaddr_in client;
+	int age;
+} tp_handoff_t;
+
+static void tp_handoff_done(void *handle);
+
+static void tp_handoff_loop(void *handle)
+{
+	tpc *tp = (tpc*)handle;
+	std::vector<class tp_conn*> conns;
+	int handed = 0;
+	{
+		std::lock_guard<std::mutex> l(tp->conn_lock);
+		for (class tp_conn *c : tp->conn) {
+			if (c->reactor == tp_reactor_id && c->client_sock_data.sock &&
+			        c->server_sock_data->up) {
+				conns.push_back(c);
+			}
+		}
+	}
+	for (class tp_conn *c : conns) {
+		class tp_sock_data *ds = c->server_sock_data;
+		tp_handoff_t rec = {};
+		int r;
+		rec.kind = TP_HO_CLIENT;
+		rec.client.sin_family = AF_INET;
+		rec.client.sin_addr = c->client.ip;
+		rec.client.sin_port = c->client.port;
+		rec.age = c->age;
+		r = mg_skt_handoff(c->client_sock_data.sock, tp->handoff_fd, &rec, sizeof(rec));
+		if (r == -1) {
+			printf("handoff: client not handed over\n");
+			continue;
+		}
+		if (r < 0) {
+			/* still ours, both sides */
+			tp->handoff_failed = 1;
+			break;
+		}
+		rec.kind = TP_HO_SERVER;
+		rec.backend = ds->backend->id;
+		r = mg_skt_handoff(ds->sock, tp->handoff_fd, &rec, sizeof(rec));
+		if (r < 0) {
+			/* its client is gone already */
+			printf("handoff: server not handed over\n");
+			tp->mg->skt_close(ds->sock);
+			tp->handoff_failed = r == -2;
+		}
+		tp_conn_free(c);
+		if (tp->handoff_failed) {
+			break;
+		}
+		handed++;
+	}
+	printf("handoff: loop %d handed over %d connections\n", tp_reactor_id, handed);
+	if (!tp->handoff_failed && tp_reactor_id + 1 < tp->reactors) {
+		tp->mg->post(tp_handoff_loop, tp, tp_reactor_id + 1);
+		return;
+	}
+	if (tp_reactor_id) {
+		tp->mg->post(tp_handoff_done, tp, 0);
+		return;
+	}
+	tp_handoff_done(tp);
+}
+
+static void tp_handoff_listen(tpc *tp);
+
+/* on loop 0: the listener goes last, unless the new tp went away */
+static void tp_handoff_done(void *handle)
+{
+	tpc *tp = (tpc*)handle;
+	tp_handoff_t rec = {};
+	rec.kind = TP_HO_LISTENER;
+	if (!tp->handoff_failed &&
+	        mg_skt_handoff(tp->listen_handle, tp->handoff_fd, &rec, sizeof(rec)) < 0) {
+		tp->handoff_failed = 1;
+	}
+	if (tp->handoff_failed) {
+		printf("handoff: the new tp went away, carrying on\n");
+		close(tp->handoff_fd);
+		tp->handoff_fd = -1;
+		tp->handoff_failed = 0;
+		mg_skt_rx_resume(tp->listen_handle);
+		tp_handoff_listen(tp);
+		return;
+	}
+	tp->listen_handle = NULL;
+	mg_handoff_end(tp->handoff_fd);
+	close(tp->handoff_fd);
+	tp->handoff_fd = -1;
+	tp->mg->stop();
+}
+
+/* a successor connected: hand everything over to it */
+static void tp_handoff_rx(void *handle)
+{
+	tpc *tp = (tpc*)handle;
+	int fd = accept(mg_skt_fd(tp->handoff_handle), NULL, NULL);
+	tp->mg->skt_close(tp->handoff_handle);
+	tp->handoff_handle = NULL;
+	if (fd < 0) {
+		/* nobody there after all: start afresh, or this would be called again */
+		tp_handoff_listen(tp);
+		return;
+	}
+	printf("handoff: taken over by a new tp\n");
+	tp->handoff_fd = fd;
+	/* new clients wait in the backlog for whoever ends up with it */
+	mg_skt_rx_pause(tp->listen_handle);
+	tp_handoff_loop(tp);
+}
+
+/* control socket, on loop 0 */
+static void tp_handoff_listen(tpc *tp)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	strncpy(addr.sun_path, TP_HANDOFF_PATH, sizeof(addr.sun_path) - 1);
+	unlink(TP_HANDOFF_PATH);
+	if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+		perror("handoff: " TP_HANDOFF_PATH);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return;
+	}
+	/* readable means a successor is waiting, accepted by tp_handoff_rx() */
+	mg_skt_param_t p = {
+		.handle = tp,
+		.rx_ready = tp_handoff_rx,
+	};
+	tp->handoff_handle = tp->mg->fd_open(fd, &p);
+}
+
+/* a handed over socket not to be adopted */
+static void tp_handoff_drop(mg_handoff_t *h)
+{
+	close(h->fd);
+	free(h->tx);
+	free(h->rx);
+	h->fd = -1;
+	h->tx = NULL;
+	h->rx = NULL;
+}
+
+/*
+ * Take over from a running tp, if there is one: adopt its listener and
+ * connections onto loop 0. Nonzero if the listener was handed over.
+ */
+static int tp_handoff_take(tpc *tp, mg_listen_param_t *listen_param)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	mg_handoff_t h, client;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0), r, conns = 0;
+	strncpy(addr.sun_path, TP_HANDOFF_PATH, sizeof(addr.sun_path) - 1);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		/* nobody to take over from */
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 0;
+	}
+	client.fd = -1;
+	client.tx = NULL;
+	client.rx = NULL;
+	while ((r = mg_handoff_recv(fd, &h)) > 0) {
+		tp_handoff_t *rec = (tp_handoff_t*)h.app;
+		if (h.app_len != sizeof(*rec)) {
+			tp_handoff_drop(&h);
+			continue;
+		}
+		if (rec->kind == TP_HO_LISTENER) {
+			tp->listen_handle = tp->mg->listen_adopt(&h, listen_param);
+			continue;
+		}
+		if (rec->kind == TP_HO_CLIENT) {
+			/* its upstream comes next; an earlier one still waiting never got it */
+			if (client.fd >= 0) {
+				tp_handoff_drop(&client);
+			}
+			client = h;
+			continue;
+		}
+		tp_handoff_t *crec = (tp_handoff_t*)client.app;
+		if (client.fd < 0 || rec->backend < 0 || rec->backend >= (int)tp->backends.size()) {
+			tp_handoff_drop(&h);
+			if (client.fd >= 0) {
+				tp_handoff_drop(&client);
+			}
+			continue;
+		}
+		class tp_backend *b = tp->backends[rec->backend];
+		class tp_conn *c = tp_conn_new(tp, &crec->client);
+		class tp_sock_data *ds = new (tp->mg->pool_get(sizeof(class tp_sock_data))) tp_sock_data();
+		mg_skt_param_t sp = tp_upstream_param(ds, b);
+		mg_skt_param_t cp = {};
+		c->age = crec->age;
+		ds->conn = c;
+		ds->backend = b;
+		ds->up = 1;
+		b->active++;
+		c->server_sock_data = ds;
+		ds->sock = tp->mg->skt_adopt(&h, &sp);
+		tp_client_param(&cp, c);
+		c->client_sock_data.sock = tp->mg->skt_adopt(&client, &cp);
+		client.fd = -1;
+		conns++;
+	}
+	if (client.fd >= 0) {
+		tp_handoff_drop(&client);
+	}
+	close(fd);
+	printf("handoff: took over %s and %d connections\n",
+	       tp->listen_handle ? "the listener" : "no listener", conns);
+	return tp->listen_handle != NULL;
+}
+
+/* each loop keeps its own pools, on its own timer */
+static void tp_reactor_start(void *handle, int id)
+{
+	tpc *tp = (tpc*)handle;
+	tp_reactor_id = id;
+	if (id == 0) {
+		tp->mg->timer_add(tp, tp_hc_tick, TP_HC_PERIOD_MS, 1);
+		tp_handoff_listen(tp);
+	}
+	if (!tp->pool_size) {
+		return;
+	}
+	for (class tp_backend *b : tp->backends) {
+		class tp_pool *pool = new tp_pool;
+		pool->tp = tp;
+		pool->backend = b;
+		tp_pools.push_back(pool);
+	}
+	tp->mg->timer_add(tp, tp_pool_tick, TP_POOL_TICK_MS, 1);
+	tp_pool_tick(tp);
+}
+
 /* Accept console input. Any input generates a list of active connections */
 static void tp_console_rx(void *handle, struct sockaddr *rx_skt,
 						  unsigned char *rx_buf, int rx_buflen)
@@ -202,24 +929,45 @@ static void tp_console_rx(void *handle, struct sockaddr *rx_skt,
 static void tp_timeout(void *handle)
 {
 	tpc *tp = (tpc*)handle;
+	std::lock_guard<std::mutex> l(tp->conn_lock);
 	for (class tp_conn *c : tp->conn) {
 		c->age++;
 	}
 }
 
+static void tp_usage(void)
+{
+	printf("usage: tp <remote IPv4 address>[:port][,...] <my IPv4 address> "
+	       "[reactors] [warm] [rr|least|hash]\n");
+	exit(1);
+}
+
 int main(int argc, char *argv[])
 {
 	/* validate input */
 	struct in_addr ip;
-	if (argc != 3 ||
-	        inet_pton(AF_INET, argv[1], &ip) != 1 ||
-	        inet_pton(AF_INET, argv[2], &ip) != 1) {
+	int reactors = 1, warm = TP_POOL_WARM;
+	const char *policy = argc == 6 ? argv[5] : "rr";
+	if (argc < 3 || argc > 6 ||
+	        inet_pton(AF_INET, argv[2], &ip) != 1 ||
+	        (argc >= 4 && (reactors = atoi(argv[3])) < 1) ||
+	        (argc >= 5 && (warm = atoi(argv[4])) < 0)) {
 		/* couldn't parse IP address(es) */
-		printf("usage: tp <remote IPv4 address> <my IPv4 address>\n");
-		exit(1);
+		tp_usage();
 	}
 	/* construct tp object */
-	tpc tp(argv[1], argv[2]);
+	tpc tp(argv[2]);
+	tp.pool_size = warm;
+	tp.pick = NULL;
+	for (const auto &pol : tp_policies) {
+		if (!strcmp(pol.name, policy)) {
+			tp.pick = pol.pick;
+		}
+	}
+	if (!tp.pick || tp.backends_add(argv[1])) {
+		tp_usage();
+	}
+	tp.ring_build();
 	struct sockaddr_in listen_addr = {
 		.sin_family = AF_INET,
 		.sin_port = htons(8080),
@@ -233,15 +981,29 @@ int main(int argc, char *argv[])
 		.sock_addr = (struct sockaddr*)&listen_addr,
 		.slen = sizeof(listen_addr)
 	};
-	/* initialize */
-	mg_base *mg = tp.mg = new mg_base;
-	mg->init("select");	// use select multiplexing
-//	mg->init("epoll");	// use epoll multiplexing
-	tp.listen_handle = mg->listen_open(&listen_param);
+	/* initialize, with room for HP_DATA_CONN_MAX connections per loop */
+	mg_pool_param_t pool = {
+		.skts = 2 * HP_DATA_CONN_MAX + TP_POOL_WARM,
+		.tx_chunks = HP_DATA_CONN_MAX / 4,	// mostly spliced
+		.app_size = sizeof(class tp_conn),
+		.app_count = HP_DATA_CONN_MAX,
+	};
+	mg_base *mg = tp.mg = new mg_base(&pool);
+	mg->init("select", reactors);	// use select multiplexing
+//	mg->init("poll", reactors);	// use poll multiplexing
+//	mg->init("epoll", reactors);	// use epoll multiplexing
+//	mg->init("io_uring", reactors);	// use io_uring multiplexing
+	tp.reactors = reactors;
+	/* hot restart: from the running tp if there is one, else bind afresh */
+	if (!tp_handoff_take(&tp, &listen_param)) {
+		tp.listen_handle = mg->listen_open(&listen_param);
+	}
 	assert(tp.listen_handle);
 	/* allow console input */
 	mg_param_t tpp = {
-		.console = { .rx = tp_console_rx, .handle = &tp }
+		.console = { .rx = tp_console_rx, .handle = &tp },
+		/* fill each loop's upstream pool */
+		.reactor = { .start = tp_reactor_start, .handle = &tp }
 	};
 	/* add a 1-sec periodic timer */
 	mg->timer_add((void*) &tp, tp_timeout);